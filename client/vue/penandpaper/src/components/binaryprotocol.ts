@@ -0,0 +1,283 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The compact binary encoding of the high frequency packets. The layout of
+// every packet is documented in server/cpp/src/BinaryProtocol.h
+
+export enum BinaryPacketType {
+  MoveToken = 1,
+  CreateDoodadLine = 2,
+  ModifyRoom = 3,
+  ModifyWall = 4,
+  ModifyDoor = 5,
+  ModifyFurniture = 6,
+  MoveTokens = 7,
+  AppendStroke = 8,
+  Chunk = 9
+}
+
+// The flags of a Chunk packet
+const CHUNK_LAST = 1
+const CHUNK_BINARY = 2
+
+// Puts together the large messages the server splits into Chunk packets.
+// The parts of one message arrive in order, other messages may arrive in
+// between.
+export class ChunkBuffer {
+  parts: Uint8Array[] = []
+
+  isEmpty () : boolean {
+    return this.parts.length === 0
+  }
+
+  // Returns the message once its last part was added, null before
+  add (buffer: ArrayBuffer) : { data: ArrayBuffer, isBinary: boolean } | null {
+    let flags = new DataView(buffer).getUint8(1)
+    this.parts.push(new Uint8Array(buffer, 2))
+    if ((flags & CHUNK_LAST) === 0) {
+      return null
+    }
+    let size = this.parts.reduce((sum, part) => sum + part.length, 0)
+    let whole = new Uint8Array(size)
+    let offset = 0
+    for (let part of this.parts) {
+      whole.set(part, offset)
+      offset += part.length
+    }
+    this.parts = []
+    return { data: whole.buffer, isBinary: (flags & CHUNK_BINARY) !== 0 }
+  }
+}
+
+export function isChunk (buffer: ArrayBuffer) : boolean {
+  return buffer.byteLength >= 2 &&
+    new DataView(buffer).getUint8(0) === BinaryPacketType.Chunk
+}
+
+class BinaryWriter {
+  view: DataView
+  pos: number = 0
+
+  constructor (size: number) {
+    this.view = new DataView(new ArrayBuffer(size))
+  }
+
+  u8 (v: number) {
+    this.view.setUint8(this.pos, v)
+    this.pos += 1
+  }
+
+  bool (v: boolean) {
+    this.u8(v ? 1 : 0)
+  }
+
+  u32 (v: number) {
+    this.view.setUint32(this.pos, v, true)
+    this.pos += 4
+  }
+
+  f32 (v: number) {
+    this.view.setFloat32(this.pos, v, true)
+    this.pos += 4
+  }
+
+  // Ids are below 2^53, so they can be split into two 32 bit halves
+  u64 (v: number) {
+    this.view.setUint32(this.pos, v % 4294967296, true)
+    this.view.setUint32(this.pos + 4, Math.floor(v / 4294967296), true)
+    this.pos += 8
+  }
+}
+
+class BinaryReader {
+  view: DataView
+  pos: number = 0
+
+  constructor (buffer: ArrayBuffer) {
+    this.view = new DataView(buffer)
+  }
+
+  u8 () : number {
+    let v = this.view.getUint8(this.pos)
+    this.pos += 1
+    return v
+  }
+
+  u32 () : number {
+    let v = this.view.getUint32(this.pos, true)
+    this.pos += 4
+    return v
+  }
+
+  f32 () : number {
+    let v = this.view.getFloat32(this.pos, true)
+    this.pos += 4
+    return v
+  }
+
+  u64 () : number {
+    let low = this.view.getUint32(this.pos, true)
+    let high = this.view.getUint32(this.pos + 4, true)
+    this.pos += 8
+    return high * 4294967296 + low
+  }
+
+  // A zig-zag encoded varint. Multiplication instead of shifts keeps values
+  // above 2^31 intact.
+  zigzag () : number {
+    let v = 0
+    let scale = 1
+    let byte
+    do {
+      byte = this.u8()
+      v += (byte & 0x7f) * scale
+      scale *= 128
+    } while (byte & 0x80)
+    return v % 2 === 0 ? v / 2 : -(v + 1) / 2
+  }
+}
+
+// The resolution of the coordinates of encoded strokes
+const STROKE_QUANTUM = 1 / 64
+
+// Decodes the base64 encoded strokes of the Init packet into their json
+// form. The encoding is documented at Stroke::writeBinary on the server.
+export function decodeStrokes (encoded: string) : any[] {
+  let decoded = atob(encoded)
+  let bytes = new Uint8Array(decoded.length)
+  for (let i = 0; i < decoded.length; ++i) {
+    bytes[i] = decoded.charCodeAt(i)
+  }
+  let r = new BinaryReader(bytes.buffer)
+  let strokes = []
+  let count = r.u32()
+  for (let i = 0; i < count; i++) {
+    let id = r.u64()
+    let complete = r.u8() !== 0
+    let size = r.u32()
+    let points = new Array(size * 2)
+    for (let axis = 0; axis < 2; axis++) {
+      let v = 0
+      for (let j = 0; j < size; j++) {
+        v += r.zigzag()
+        points[2 * j + axis] = v * STROKE_QUANTUM
+      }
+    }
+    strokes.push({ id: id, points: points, complete: complete })
+  }
+  return strokes
+}
+
+// Returns the binary encoding of the given json packet, or null if the packet
+// has no binary encoding.
+export function encodePacket (packet: any) : ArrayBuffer | null {
+  let data = packet.data
+  let w: BinaryWriter
+  if (packet.type === 'MoveToken') {
+    w = new BinaryWriter(21)
+    w.u8(BinaryPacketType.MoveToken)
+    w.u64(data.id)
+    w.f32(data.x)
+    w.f32(data.y)
+    w.f32(data.rotation)
+  } else if (packet.type === 'CreateDoodadLine') {
+    w = new BinaryWriter(17)
+    w.u8(BinaryPacketType.CreateDoodadLine)
+    w.f32(data.sx)
+    w.f32(data.sy)
+    w.f32(data.ex)
+    w.f32(data.ey)
+  } else if (packet.type === 'ModifyRoom') {
+    w = new BinaryWriter(26)
+    w.u8(BinaryPacketType.ModifyRoom)
+    w.u64(data.id)
+    w.f32(data.position.x)
+    w.f32(data.position.y)
+    w.f32(data.size.x)
+    w.f32(data.size.y)
+    w.bool(data.is_visible)
+  } else if (packet.type === 'ModifyWall') {
+    w = new BinaryWriter(26)
+    w.u8(BinaryPacketType.ModifyWall)
+    w.u64(data.id)
+    w.f32(data.start.x)
+    w.f32(data.start.y)
+    w.f32(data.end.x)
+    w.f32(data.end.y)
+    w.bool(data.is_visible)
+  } else if (packet.type === 'ModifyDoor') {
+    w = new BinaryWriter(27)
+    w.u8(BinaryPacketType.ModifyDoor)
+    w.u64(data.id)
+    w.f32(data.position.x)
+    w.f32(data.position.y)
+    w.f32(data.width)
+    w.f32(data.rotation)
+    w.bool(data.is_open)
+    w.bool(data.is_visible)
+  } else if (packet.type === 'MoveTokens') {
+    w = new BinaryWriter(5 + 20 * data.moves.length)
+    w.u8(BinaryPacketType.MoveTokens)
+    w.u32(data.moves.length)
+    data.moves.forEach((move: any) => {
+      w.u64(move.id)
+      w.f32(move.x)
+      w.f32(move.y)
+      w.f32(move.rotation)
+    })
+  } else if (packet.type === 'AppendStroke') {
+    w = new BinaryWriter(13 + 4 * data.points.length)
+    w.u8(BinaryPacketType.AppendStroke)
+    w.u64(data.stroke)
+    w.u32(data.points.length)
+    data.points.forEach((v: number) => w.f32(v))
+  } else if (packet.type === 'ModifyFurniture') {
+    w = new BinaryWriter(30)
+    w.u8(BinaryPacketType.ModifyFurniture)
+    w.u64(data.id)
+    w.f32(data.position.x)
+    w.f32(data.position.y)
+    w.f32(data.size.x)
+    w.f32(data.size.y)
+    w.f32(data.rotation)
+    w.bool(data.is_visible)
+  } else {
+    return null
+  }
+  return w.view.buffer
+}
+
+// Decodes a binary packet sent by the server into the same form as its json
+// counterpart.
+export function decodePacket (buffer: ArrayBuffer) : any {
+  let r = new BinaryReader(buffer)
+  let type = r.u8()
+  if (type === BinaryPacketType.MoveTokens) {
+    let seq = r.u64()
+    let count = r.u32()
+    let moves = []
+    for (let i = 0; i < count; i++) {
+      let id = r.u64()
+      let x = r.f32()
+      let y = r.f32()
+      let rotation = r.f32()
+      moves.push({ id: id, x: x, y: y, rotation: rotation })
+    }
+    return { type: 'MoveTokens', seq: seq, data: moves }
+  }
+  console.log('Received a binary packet of unknown type', type)
+  return null
+}
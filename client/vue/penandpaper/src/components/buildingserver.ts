@@ -281,7 +281,7 @@ export default class BuildingServer {
             data: r.toSerializable()
           }
           packet.data.is_open = !packet.data.is_open
-          this.dispatcher.send(JSON.stringify(packet))
+          this.dispatcher.sendPacket(packet)
         }
       })
     }
@@ -370,7 +370,7 @@ export default class BuildingServer {
           data: r.toSerializable()
         }
         packet.data.is_visible = !packet.data.is_visible
-        this.dispatcher.send(JSON.stringify(packet))
+        this.dispatcher.sendPacket(packet)
       }
     })
     this.building.doors.forEach((r: B.Door) => {
@@ -382,7 +382,7 @@ export default class BuildingServer {
           data: r.toSerializable()
         }
         packet.data.is_visible = !packet.data.is_visible
-        this.dispatcher.send(JSON.stringify(packet))
+        this.dispatcher.sendPacket(packet)
       }
     })
     this.building.furniture.forEach((r: B.Furniture) => {
@@ -393,7 +393,7 @@ export default class BuildingServer {
           data: r.toSerializable()
         }
         packet.data.is_visible = !packet.data.is_visible
-        this.dispatcher.send(JSON.stringify(packet))
+        this.dispatcher.sendPacket(packet)
       }
     })
     this.building.walls.forEach((r: B.Wall) => {
@@ -404,7 +404,7 @@ export default class BuildingServer {
           data: r.toSerializable()
         }
         packet.data.is_visible = !packet.data.is_visible
-        this.dispatcher.send(JSON.stringify(packet))
+        this.dispatcher.sendPacket(packet)
       }
     })
   }
@@ -16,4 +16,7 @@
 
 export default interface PacketDispatcher {
   send (data: string) : any;
+  // Sends the packet using the binary protocol if it was negotiated with the
+  // server and the packet has a binary encoding, as json otherwise.
+  sendPacket (packet: any) : any;
 }
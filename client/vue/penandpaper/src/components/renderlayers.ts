@@ -19,7 +19,8 @@ export default class RenderLayers {
   static TILES: number = 1
   static BUILDING: number = 2
   static DOORS: number = 3
-  static DOODADS: number = 4
-  static TOKENS: number = 5
-  static TOOL: number = 6
+  static LIGHTING: number = 4
+  static DOODADS: number = 5
+  static TOKENS: number = 6
+  static TOOL: number = 7
 }
@@ -22,6 +22,7 @@ import eventBus from '../eventbus'
 import * as Sim from '../simulation/simulation'
 import * as B from '../simulation/building'
 import PacketDispatcher from './packetdispatcher'
+import { encodePacket, decodePacket, decodeStrokes, ChunkBuffer, isChunk } from './binaryprotocol'
 
 import BuildingServer from './buildingserver'
 
@@ -34,11 +35,13 @@ export class Player {
 // Used to communicate the simulation state of the server via the event bus
 export class ServerState {
   tokens: Sim.Token[] = []
-  lines: Sim.Line[] = []
+  strokes: Sim.Stroke[] = []
   building: B.Building | null = null
   isStateLoaded = false
   tilesPath: string = ''
   players: Player[] = []
+  lights: Sim.Light[] = []
+  lightTiles: Sim.LightTiles | null = null
 }
 
 export default class Server implements PacketDispatcher {
@@ -47,14 +50,37 @@ export default class Server implements PacketDispatcher {
     store: Store<any>;
 
     tokens: Sim.Token[] = []
-    lines: Sim.Line[] = []
+    strokes: Sim.Stroke[] = []
+    lights: Sim.Light[] = []
+    lightTiles: Sim.LightTiles | null = null
 
     buildingServer: BuildingServer
 
     isStateLoaded = false
 
+    // The sequence number of the last state change received from the server
+    // and the epoch it belongs to. Sent when reconnecting to resume the
+    // session without downloading the whole state again.
+    lastSeq = -1
+    epoch = -1
+
+    // The parts of a large message received so far. Small packets sent after
+    // it may overtake its remaining parts, they are held back in deferred
+    // and handled once the message is complete.
+    chunks = new ChunkBuffer()
+    deferred: any[] = []
+
+    // True once the server accepted the binary protocol for this connection
+    useBinaryProtocol = false
+
     tilesPaths: string = ''
 
+    // The viewport waiting to be sent to the server. Viewport changes are
+    // throttled as the camera changes on every frame while panning.
+    pendingViewport: Sim.Rectangle | null = null
+    viewport: Sim.Rectangle | null = null
+    viewportTimer: number | null = null
+
     players: Player[] = []
 
     errorhandler?: () => void;
@@ -74,15 +100,31 @@ export default class Server implements PacketDispatcher {
       eventBus.$on('/client/token/clear', () => { this.clientClearTokens() })
       eventBus.$on('/client/token/toggle_foe', (data: Sim.Token) => { this.onClientTokenToggleFoe(data) })
       eventBus.$on('/client/token/delete', (data: Sim.Token) => { this.onClientDeleteToken(data) })
-      eventBus.$on('/client/line/create', (data: Sim.Line) => { this.onClientCreateLine(data) })
+      eventBus.$on('/client/tokens/create', (data: Sim.Point[]) => { this.onClientCreateTokens(data) })
+      eventBus.$on('/client/tokens/move', (data: Sim.TokenMoveOrder[]) => { this.onClientMoveTokens(data) })
+      eventBus.$on('/client/tokens/delete', (data: Sim.Token[]) => { this.onClientDeleteTokens(data) })
+      eventBus.$on('/client/stroke/begin', (data: Sim.StrokePoints) => { this.onClientStroke('BeginStroke', data) })
+      eventBus.$on('/client/stroke/append', (data: Sim.StrokePoints) => { this.onClientStroke('AppendStroke', data) })
+      eventBus.$on('/client/stroke/end', (stroke: number) => { this.onClientEndStroke(stroke) })
       eventBus.$on('/client/line/clear', () => { this.onClientClearLines() })
+      eventBus.$on('/client/light/create', (data: Sim.Light) => { this.onClientCreateLight(data) })
+      eventBus.$on('/client/light/clear', () => { this.onClientClearLights() })
+      eventBus.$on('/client/token/query_movement', (data: Sim.MovementQuery) => { this.onClientQueryMovement(data) })
+      eventBus.$on('/client/areas/query', (data: Sim.AreaQuery) => { this.onClientQueryAreas(data) })
       eventBus.$on('/server/request_state', () => { this.onStateRequest() })
+      eventBus.$on('/client/viewport', (data: Sim.Rectangle) => { this.onClientViewport(data) })
     }
 
     connect () {
       console.log('Connecting to the ws server.')
       let port = ':8081'
-      this.socket = new WebSocket('wss://' + window.location.hostname + port)
+      // Every table is an independent game hosted by the same server
+      let table = new URLSearchParams(window.location.search).get('table') || ''
+      this.socket = new WebSocket('wss://' + window.location.hostname + port + '/' + encodeURIComponent(table))
+      this.socket.binaryType = 'arraybuffer'
+      this.useBinaryProtocol = false
+      this.chunks = new ChunkBuffer()
+      this.deferred = []
 
       // Wrap the callbacks into anonymous functions to ensure they are called
       // with the correct object as 'this'
@@ -102,26 +144,83 @@ export default class Server implements PacketDispatcher {
     }
 
     onmessage (msg: MessageEvent) {
+      if (msg.data instanceof ArrayBuffer) {
+        this.onbinary(msg.data)
+        return
+      }
       let packet = JSON.parse(msg.data)
+      console.log('Received a message: ', packet)
+      this.onreceived(packet)
+    }
+
+    onbinary (buffer: ArrayBuffer) {
+      if (isChunk(buffer)) {
+        let message = this.chunks.add(buffer)
+        if (message === null) {
+          return
+        }
+        if (message.isBinary) {
+          this.onbinary(message.data)
+        } else {
+          this.onpacket(JSON.parse(new TextDecoder().decode(message.data)))
+        }
+        // The packets that overtook the message were sent after it
+        let deferred = this.deferred
+        this.deferred = []
+        deferred.forEach((p: any) => this.onpacket(p))
+        return
+      }
+      let binaryPacket = decodePacket(buffer)
+      if (binaryPacket !== null) {
+        this.onreceived(binaryPacket)
+      }
+    }
+
+    // Handles a packet that was not split into chunks
+    onreceived (packet: any) {
+      if (this.chunks.isEmpty()) {
+        this.onpacket(packet)
+      } else {
+        this.deferred.push(packet)
+      }
+    }
+
+    onpacket (packet: any) {
       let type = packet['type']
       let data = packet['data']
-      console.log('Received a message: ', packet)
-      if (type === 'Session') {
+      if (packet['seq'] !== undefined) {
+        this.lastSeq = packet['seq']
+      }
+      if (type === 'Batch') {
+        data.forEach((p: any) => this.onpacket(p))
+      } else if (type === 'Session') {
         this.onServerSession(data)
       } else if (type === 'Chat') {
         this.onchat(data)
       } else if (type === 'Init') {
         this.onServerInit(data)
+      } else if (type === 'Sync') {
+        this.onServerSync(data)
       } else if (type === 'CreateToken') {
         this.onServerCreateToken(data)
       } else if (type === 'ClearTokens') {
         this.serverClearTokens()
       } else if (type === 'MoveToken') {
         this.onServerMoveToken(data)
+      } else if (type === 'MoveTokens') {
+        this.onServerMoveTokens(data)
       } else if (type === 'DeleteToken') {
         this.onServerDeleteToken(data)
-      } else if (type === 'CreateDoodadLine') {
-        this.onServerCreateLine(data)
+      } else if (type === 'CreateTokens') {
+        data.forEach((t: any) => this.onServerCreateToken(t))
+      } else if (type === 'DeleteTokens') {
+        data.ids.forEach((id: number) => this.onServerDeleteToken({ id: id }))
+      } else if (type === 'CreateStroke') {
+        this.onServerCreateStroke(data)
+      } else if (type === 'AppendStrokes') {
+        this.onServerAppendStrokes(data)
+      } else if (type === 'DeleteStrokes') {
+        this.onServerDeleteStrokes(data)
       } else if (type === 'ClearDoodads') {
         this.onServerClearDoodads()
       } else if (type === 'TokenToggleFoe') {
@@ -134,6 +233,18 @@ export default class Server implements PacketDispatcher {
         this.onServerClearTiles(data)
       } else if (type === 'PlayerList') {
         this.onServerPlayerList(data)
+      } else if (type === 'CreateLight') {
+        this.onServerCreateLight(data)
+      } else if (type === 'DeleteLight') {
+        this.onServerDeleteLight(data)
+      } else if (type === 'ClearLights') {
+        this.onServerClearLights()
+      } else if (type === 'LightTiles') {
+        this.onServerLightTiles(data)
+      } else if (type === 'Movement') {
+        this.onServerMovement(data)
+      } else if (type === 'AreaTokens') {
+        this.onServerAreaTokens(data)
       } else if (this.buildingServer.onmessage(type, data)) {
         // the message was handled by the buildingServer
       }
@@ -145,6 +256,10 @@ export default class Server implements PacketDispatcher {
 
     onServerInit (data: any) {
       this.isStateLoaded = true
+      this.epoch = data.epoch
+      // The init packet replaces any state from a previous connection
+      this.tokens.splice(0, this.tokens.length)
+      this.strokes.splice(0, this.strokes.length)
       for (let rawToken of data.tokens) {
         let token = new Sim.Token()
         token.x = rawToken.x
@@ -157,18 +272,78 @@ export default class Server implements PacketDispatcher {
         token.rotation = rawToken.rotation
         this.tokens.push(token)
       }
-      for (let rawLine of data.doodads) {
-        let line = new Sim.Line()
-        line.start.x = rawLine.sx
-        line.start.y = rawLine.sy
-        line.stop.x = rawLine.ex
-        line.stop.y = rawLine.ey
-        this.lines.push(line)
+      for (let rawStroke of decodeStrokes(data.doodads)) {
+        this.strokes.push(Sim.Stroke.fromSerializable(rawStroke))
       }
+      this.lights.splice(0, this.lights.length)
+      for (let rawLight of data.lighting.lights) {
+        this.lights.push(Sim.Light.fromSerializable(rawLight))
+      }
+      this.lightTiles = Sim.LightTiles.fromSerializable(data.lighting)
       this.buildingServer.onServerInit(data)
       this.tilesPaths = data['tiles']
       // Broadcast our initialized state
       this.onStateRequest()
+      // The server only knows our viewport after we told it again
+      this.sendViewport()
+    }
+
+    // The current state of everything that became visible with our last
+    // viewport change. Updates outside of our viewport are not sent to us.
+    onServerSync (data: any) {
+      for (let rawToken of data.tokens) {
+        let token = this.findTokenById(rawToken.id)
+        if (token === undefined) {
+          this.onServerCreateToken(rawToken)
+          token = this.findTokenById(rawToken.id)
+        } else {
+          this.onServerMoveToken(rawToken)
+        }
+        if (token !== undefined && token.isFoe !== rawToken.foe) {
+          token.isFoe = rawToken.foe
+          eventBus.$emit('/server/token/toggle_foe', token)
+        }
+      }
+      for (let rawStroke of data.doodads) {
+        this.onServerAppendStrokes([{
+          id: rawStroke.id, offset: 0, points: rawStroke.points, complete: rawStroke.complete
+        }])
+      }
+      data.rooms.forEach((r: any) => this.buildingServer.onmessage('ModifyRoom', r))
+      data.walls.forEach((w: any) => this.buildingServer.onmessage('ModifyWall', w))
+      data.doors.forEach((d: any) => this.buildingServer.onmessage('ModifyDoor', d))
+      data.furniture.forEach((f: any) => this.buildingServer.onmessage('ModifyFurniture', f))
+    }
+
+    onClientViewport (viewport: Sim.Rectangle) {
+      this.pendingViewport = viewport
+      if (this.viewportTimer === null) {
+        this.viewportTimer = window.setTimeout(() => {
+          this.viewportTimer = null
+          if (this.pendingViewport !== null) {
+            this.viewport = this.pendingViewport
+            this.pendingViewport = null
+            this.sendViewport()
+          }
+        }, 250)
+      }
+    }
+
+    sendViewport () {
+      if (this.viewport === null) {
+        return
+      }
+      let packet = {
+        type: 'SetViewport',
+        uid: this.uid,
+        data: {
+          min_x: this.viewport.min.x,
+          min_y: this.viewport.min.y,
+          max_x: this.viewport.max.x,
+          max_y: this.viewport.max.y
+        }
+      }
+      this.send(JSON.stringify(packet))
     }
 
     sendChat (text : string) {
@@ -232,7 +407,7 @@ export default class Server implements PacketDispatcher {
           'rotation': move.rotation
         }
       }
-      this.send(JSON.stringify(packet))
+      this.sendPacket(packet)
     }
 
     onServerMoveToken (data: any) {
@@ -255,6 +430,11 @@ export default class Server implements PacketDispatcher {
       }
     }
 
+    // The server batches all moves of a tick into a single packet
+    onServerMoveTokens (data: any[]) {
+      data.forEach(move => this.onServerMoveToken(move))
+    }
+
     onClientDeleteToken (data: Sim.Token) {
       let packet = {
         type: 'DeleteToken',
@@ -266,6 +446,42 @@ export default class Server implements PacketDispatcher {
       this.send(JSON.stringify(packet))
     }
 
+    // Groups of tokens are changed with a single packet
+    onClientCreateTokens (positions: Sim.Point[]) {
+      let packet = {
+        type: 'CreateTokens',
+        uid: this.uid,
+        data: {
+          positions: positions.map((p: Sim.Point) => { return { x: p.x, y: p.y } })
+        }
+      }
+      this.send(JSON.stringify(packet))
+    }
+
+    onClientMoveTokens (moves: Sim.TokenMoveOrder[]) {
+      let packet = {
+        type: 'MoveTokens',
+        uid: this.uid,
+        data: {
+          moves: moves.map((move: Sim.TokenMoveOrder) => {
+            return { id: move.token.id, x: move.x, y: move.y, rotation: move.rotation }
+          })
+        }
+      }
+      this.sendPacket(packet)
+    }
+
+    onClientDeleteTokens (tokens: Sim.Token[]) {
+      let packet = {
+        type: 'DeleteTokens',
+        uid: this.uid,
+        data: {
+          ids: tokens.map((t: Sim.Token) => t.id)
+        }
+      }
+      this.send(JSON.stringify(packet))
+    }
+
     onServerDeleteToken (data: any) {
       let token = this.findTokenById(data.id)
       if (token !== undefined) {
@@ -277,29 +493,67 @@ export default class Server implements PacketDispatcher {
       }
     }
 
-    onClientCreateLine (line: Sim.Line) {
+    // type is BeginStroke or AppendStroke
+    onClientStroke (type: string, data: Sim.StrokePoints) {
       let packet = {
-        type: 'CreateDoodadLine',
+        type: type,
         uid: this.uid,
         data: {
-          'sx': line.start.x,
-          'sy': line.start.y,
-          'ex': line.stop.x,
-          'ey': line.stop.y
+          stroke: data.stroke,
+          points: data.points
         }
       }
+      this.sendPacket(packet)
+    }
+
+    onClientEndStroke (stroke: number) {
+      let packet = {
+        type: 'EndStroke',
+        uid: this.uid,
+        data: { stroke: stroke }
+      }
       this.send(JSON.stringify(packet))
     }
 
-    onServerCreateLine (data: any) {
-      let line = new Sim.Line()
-      line.start.x = data.sx
-      line.start.y = data.sy
-      line.stop.x = data.ex
-      line.stop.y = data.ey
-      line.id = data.id
-      eventBus.$emit('/server/line/create', line)
-      this.lines.push(line)
+    onServerCreateStroke (data: any) {
+      let stroke = Sim.Stroke.fromSerializable(data)
+      this.strokes.push(stroke)
+      eventBus.$emit('/server/stroke/create', stroke)
+    }
+
+    // The points appended to strokes since the last tick. A change with
+    // offset 0 carries the whole stroke, e.g. because it just became visible.
+    onServerAppendStrokes (data: any[]) {
+      data.forEach((change: any) => {
+        let stroke = this.strokes.find((s: Sim.Stroke) => s.id === change.id)
+        if (stroke === undefined) {
+          if (change.offset === 0) {
+            this.onServerCreateStroke(change)
+          }
+          return
+        }
+        if (change.offset === 0) {
+          stroke.points = change.points
+        } else if (change.offset * 2 === stroke.points.length) {
+          stroke.points.push(...change.points)
+        } else {
+          console.log('Missed points of stroke', change.id)
+        }
+        stroke.complete = change.complete
+        eventBus.$emit('/server/stroke/update', stroke)
+      })
+    }
+
+    // Strokes the server joined to others, which are sent in full with the
+    // same packet.
+    onServerDeleteStrokes (data: any) {
+      data.ids.forEach((id: number) => {
+        let pos = this.strokes.findIndex((s: Sim.Stroke) => s.id === id)
+        if (pos >= 0) {
+          eventBus.$emit('/server/stroke/delete', id)
+          this.strokes.splice(pos, 1)
+        }
+      })
     }
 
     onClientClearLines () {
@@ -311,23 +565,111 @@ export default class Server implements PacketDispatcher {
       this.send(JSON.stringify(packet))
     }
 
+    onClientCreateLight (light: Sim.Light) {
+      let packet = {
+        type: 'CreateLight',
+        uid: this.uid,
+        data: {
+          position: { x: light.position.x, y: light.position.y },
+          radius: light.radius,
+          token: light.token
+        }
+      }
+      this.send(JSON.stringify(packet))
+    }
+
+    onClientClearLights () {
+      let packet = {
+        type: 'ClearLights',
+        uid: this.uid,
+        data: { }
+      }
+      this.send(JSON.stringify(packet))
+    }
+
+    onServerCreateLight (data: any) {
+      this.lights.push(Sim.Light.fromSerializable(data))
+    }
+
+    onServerDeleteLight (data: any) {
+      let i = this.lights.findIndex((l: Sim.Light) => l.id === data.id)
+      if (i !== -1) {
+        this.lights.splice(i, 1)
+      }
+    }
+
+    onServerClearLights () {
+      this.lights.splice(0, this.lights.length)
+    }
+
+    // The light map is computed by the server, we only blend its tiles
+    onServerLightTiles (data: any) {
+      eventBus.$emit('/server/lighting/tiles', Sim.LightTiles.fromSerializable(data))
+    }
+
+    onClientQueryMovement (query: Sim.MovementQuery) {
+      let packet = {
+        type: 'QueryMovement',
+        uid: this.uid,
+        data: {
+          id: query.id,
+          budget: query.budget,
+          target: { x: query.target.x, y: query.target.y }
+        }
+      }
+      this.send(JSON.stringify(packet))
+    }
+
+    onServerMovement (data: any) {
+      eventBus.$emit('/server/token/movement', Sim.Movement.fromSerializable(data))
+    }
+
+    // All templates of a drag can be sent in one query
+    onClientQueryAreas (query: Sim.AreaQuery) {
+      let packet = {
+        type: 'QueryAreas',
+        uid: this.uid,
+        data: {
+          query: query.query,
+          areas: query.areas.map((a: Sim.AreaShape) => {
+            return {
+              shape: a.shape,
+              origin: { x: a.origin.x, y: a.origin.y },
+              target: { x: a.target.x, y: a.target.y },
+              angle: a.angle,
+              width: a.width
+            }
+          }),
+          filter: query.filter,
+          occlusion: query.occlusion
+        }
+      }
+      this.send(JSON.stringify(packet))
+    }
+
+    onServerAreaTokens (data: any) {
+      eventBus.$emit('/server/areas/tokens', Sim.AreaTokens.fromSerializable(data))
+    }
+
     onServerToggleDoor (data: any) {
       eventBus.$emit('/server/building/toggle_door', data.ids)
     }
 
     onServerClearDoodads () {
-      eventBus.$emit('/server/line/clear')
-      this.lines.splice(0, this.lines.length)
+      eventBus.$emit('/server/stroke/clear')
+      this.strokes.splice(0, this.strokes.length)
     }
 
     onStateRequest () {
       let state = new ServerState()
       state.tokens = this.tokens
-      state.lines = this.lines
+      state.strokes = this.strokes
       state.building = this.buildingServer.building
       state.isStateLoaded = this.isStateLoaded
       state.tilesPath = this.tilesPaths
       state.players = this.players
+      state.lights = this.lights
+      state.lightTiles = this.lightTiles
       eventBus.$emit('/server/state', state)
     }
 
@@ -354,6 +696,9 @@ export default class Server implements PacketDispatcher {
 
     onServerSession (data: any) {
       let permissions = parseInt(data['permissions'])
+      this.useBinaryProtocol = data['protocol'] === 'binary'
+      // A resumed session does not get an Init packet
+      this.sendViewport()
       this.store.commit('setUsername', data['name'])
       this.store.commit('setPermissions', permissions)
       eventBus.$emit('/server/is_gm', permissions > 0)
@@ -381,7 +726,11 @@ export default class Server implements PacketDispatcher {
       // Send the session init
       let packet = {
         type: 'InitSession',
-        data: { uid: this.uid }
+        data: { uid: this.uid, protocol: 'binary' } as any
+      }
+      if (this.isStateLoaded) {
+        packet.data.last_seq = this.lastSeq
+        packet.data.epoch = this.epoch
       }
       this.send(JSON.stringify(packet))
     }
@@ -404,6 +753,19 @@ export default class Server implements PacketDispatcher {
       }
     }
 
+    sendPacket (packet: any) {
+      if (this.useBinaryProtocol) {
+        let data = encodePacket(packet)
+        if (data !== null) {
+          if (this.socket) {
+            this.socket.send(data)
+          }
+          return
+        }
+      }
+      this.send(JSON.stringify(packet))
+    }
+
     loadUid () {
       let uid : string | null = localStorage.getItem('uid')
       if (uid !== null) {
@@ -0,0 +1,38 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import TexturedMaterial from './textured_material'
+
+// Blends a light map tile over the map. The texture only has an alpha
+// channel, which holds the light level.
+export default class LightMaterial extends TexturedMaterial {
+  constructor () {
+    super()
+
+    this.fragmentShaderSrc = `
+      #version 100
+      precision highp float;
+
+      uniform sampler2D uTexture;
+
+      varying vec2 vUV;
+
+      void main() {
+        float light = texture2D(uTexture, vUV).a;
+        gl_FragColor = vec4(1.0, 0.85, 0.55, 0.45 * light);
+      }
+    `
+  }
+}
@@ -0,0 +1,71 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import Actor, { ShaderInputType } from './actor'
+import LightMaterial from './light_material'
+import TexturedMaterial from './textured_material'
+
+// A single tile of the light map sent by the server
+export default class LightActor extends Actor {
+  size: number
+  levels: Uint8Array
+  levelsDirty: boolean = true
+
+  texture: WebGLTexture | null = null
+
+  constructor (size: number, levels: Uint8Array) {
+    super()
+    this.material = new LightMaterial()
+    this.size = size
+    this.levels = levels
+
+    let positions = [-1, -1, -1, 1, 1, -1, -1, 1, 1, -1, 1, 1]
+    let uv = [0, 0, 0, 1, 1, 0, 0, 1, 1, 0, 1, 1]
+    this.vertexShaderInput.set(ShaderInputType.POSITION, positions)
+    this.vertexShaderInput.set(ShaderInputType.TEXTURE_COORD, uv)
+  }
+
+  setLevels (levels: Uint8Array) {
+    this.levels = levels
+    this.levelsDirty = true
+  }
+
+  activate (gl: WebGLRenderingContext) {
+    if (this.levelsDirty) {
+      this._uploadTexture(gl)
+    }
+    super.activate(gl)
+  }
+
+  _uploadTexture (gl: WebGLRenderingContext) {
+    this.levelsDirty = false
+    if (this.texture === null) {
+      this.texture = gl.createTexture()
+      if (this.texture === null) {
+        console.log('Error: Unable to create a texture.')
+        return
+      }
+      let tm = this.material as TexturedMaterial
+      tm.setTexture(this.texture)
+    }
+    gl.bindTexture(gl.TEXTURE_2D, this.texture)
+    gl.texImage2D(gl.TEXTURE_2D, 0, gl.ALPHA, this.size, this.size,
+      0, gl.ALPHA, gl.UNSIGNED_BYTE, this.levels)
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MIN_FILTER, gl.LINEAR)
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MAG_FILTER, gl.LINEAR)
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_S, gl.CLAMP_TO_EDGE)
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_T, gl.CLAMP_TO_EDGE)
+  }
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import Renderer from './renderer'
+import LightActor from './lightactor'
+import RenderLayers from '../components/renderlayers'
+import * as Sim from '../simulation/simulation'
+
+// Keeps one actor per lit tile of the light map
+export default class LightRenderer {
+  renderer: Renderer | null = null
+  actors: Map<string, LightActor> = new Map()
+
+  renderCallback: null | (() => any) = null
+
+  init (r: Renderer) {
+    this.renderer = r
+  }
+
+  setRenderCallback (callback: (() => any) | null) {
+    this.renderCallback = callback
+  }
+
+  setTiles (tiles: Sim.LightTiles) {
+    let tileSize = tiles.cellSize * tiles.tileCells
+    tiles.tiles.forEach((tile: Sim.LightTile) => {
+      let key = tile.x + ',' + tile.y
+      let actor = this.actors.get(key)
+      if (tile.levels === null) {
+        // The tile is no longer lit
+        if (actor !== undefined) {
+          if (this.renderer !== null) {
+            this.renderer.removeActor(actor)
+          }
+          this.actors.delete(key)
+        }
+        return
+      }
+      if (actor !== undefined) {
+        actor.setLevels(tile.levels)
+        return
+      }
+      actor = new LightActor(tiles.tileCells, tile.levels)
+      actor.setScale(tileSize / 2, tileSize / 2)
+      actor.setPosition((tile.x + 0.5) * tileSize, (tile.y + 0.5) * tileSize)
+      this.actors.set(key, actor)
+      if (this.renderer !== null) {
+        this.renderer.addActor(actor, RenderLayers.LIGHTING)
+      } else {
+        console.log('Unable to add a light actor, the lightrenderer was not initialized.')
+      }
+    })
+    if (this.renderCallback !== null) {
+      this.renderCallback()
+    }
+  }
+
+  clear () {
+    this.actors.forEach((actor) => {
+      if (this.renderer !== null) {
+        this.renderer.removeActor(actor)
+      }
+    })
+    this.actors.clear()
+    if (this.renderCallback !== null) {
+      this.renderCallback()
+    }
+  }
+}
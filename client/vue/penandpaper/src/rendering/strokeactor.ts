@@ -0,0 +1,65 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+import Actor, { ShaderInputType } from './actor'
+import DiffuseMaterial from './diffuse_material'
+
+// A polyline of constant thickness, drawn as one quad per segment
+export default class StrokeActor extends Actor {
+  points: number[] = []
+  thickness: number = 0
+
+  constructor () {
+    super()
+    let dm = new DiffuseMaterial()
+    dm.r = 1
+    dm.g = 1
+    dm.b = 1
+    this.material = dm
+  }
+
+  setPoints (points: number[], thickness: number) {
+    this.points = points
+    this.thickness = thickness
+    this.updateVertexData()
+  }
+
+  updateVertexData () {
+    let positions = []
+    for (let i = 0; i + 3 < this.points.length; i += 2) {
+      let sx = this.points[i]
+      let sy = this.points[i + 1]
+      let ex = this.points[i + 2]
+      let ey = this.points[i + 3]
+      let l = Math.hypot(ex - sx, ey - sy)
+      if (l === 0) {
+        continue
+      }
+      let nx = -(ey - sy) / l * this.thickness
+      let ny = (ex - sx) / l * this.thickness
+
+      positions.push(sx + nx, sy + ny)
+      positions.push(sx - nx, sy - ny)
+      positions.push(ex + nx, ey + ny)
+
+      positions.push(sx - nx, sy - ny)
+      positions.push(ex - nx, ey - ny)
+      positions.push(ex + nx, ey + ny)
+    }
+    this.vertexShaderInput.set(ShaderInputType.POSITION, positions)
+    this.setVertexDataChanged()
+  }
+}
@@ -127,10 +127,149 @@ export class Token {
   displaySpeed: number = 8
 }
 
-export class Line {
+// A freehand stroke, its points are stored as x and y one after the other
+export class Stroke {
   id: number = -1
-  start: Point = new Point(0, 0)
-  stop: Point = new Point(0, 0)
+  points: number[] = []
+  // False while the stroke is still being drawn
+  complete: boolean = false
+
+  static fromSerializable (data: any) : Stroke {
+    let s = new Stroke()
+    s.id = data.id
+    s.points = data.points
+    s.complete = data.complete
+    return s
+  }
+}
+
+// Points a client appends to the stroke it numbered stroke
+export class StrokePoints {
+  stroke: number = 0
+  points: number[] = []
+}
+
+export class Light {
+  id: number = -1
+  position: Point = new Point(0, 0)
+  radius: number = 1
+  // The id of the token carrying the light or 0
+  token: number = 0
+
+  static fromSerializable (data: any) : Light {
+    let l = new Light()
+    l.id = data.id
+    l.position = new Point(data.position.x, data.position.y)
+    l.radius = data.radius
+    l.token = data.token
+    return l
+  }
+}
+
+export class LightTile {
+  x: number = 0
+  y: number = 0
+  // One light level per cell, or null if the tile is no longer lit
+  levels: Uint8Array | null = null
+}
+
+// A part of the light map computed by the server
+// A row of grid cells, from minX to maxX inclusive
+export class CellSpan {
+  y: number = 0
+  minX: number = 0
+  maxX: number = 0
+}
+
+export class MovementQuery {
+  id: number = -1
+  // The movement budget in map units
+  budget: number = 0
+  target: Point = new Point(0, 0)
+}
+
+// Where a token can move, as answered by the server
+export class Movement {
+  id: number = -1
+  cellSize: number = 1
+  reachable: CellSpan[] = []
+  // The corners of the shortest path to the target, empty if it is unreachable
+  path: Point[] = []
+  cost: number = 0
+
+  static fromSerializable (data: any) : Movement {
+    let m = new Movement()
+    m.id = data.id
+    m.cellSize = data.cell_size
+    m.reachable = data.reachable.map((raw: number[]) => {
+      let span = new CellSpan()
+      span.y = raw[0]
+      span.minX = raw[1]
+      span.maxX = raw[2]
+      return span
+    })
+    m.path = data.path.map((raw: any) => new Point(raw.x, raw.y))
+    m.cost = data.cost
+    return m
+  }
+}
+
+// The template of an area of effect, see PacketSchema.h on the server
+export class AreaShape {
+  shape: 'circle' | 'cone' | 'line' | 'rectangle' = 'circle'
+  origin: Point = new Point(0, 0)
+  target: Point = new Point(0, 0)
+  // The full opening angle of a cone in radians
+  angle: number = 0
+  // The width of a line
+  width: number = 0
+}
+
+export class AreaQuery {
+  // Echoed by the server to match answers to queries
+  query: number = 0
+  areas: AreaShape[] = []
+  filter: 'all' | 'enemies' | 'friends' = 'all'
+  occlusion: boolean = false
+}
+
+export class AreaTokens {
+  query: number = 0
+  // The ids of the tokens inside of each area, in the order of the areas
+  tokens: number[][] = []
+
+  static fromSerializable (data: any) : AreaTokens {
+    let a = new AreaTokens()
+    a.query = data.query
+    a.tokens = data.tokens
+    return a
+  }
+}
+
+export class LightTiles {
+  cellSize: number = 1
+  tileCells: number = 1
+  tiles: LightTile[] = []
+
+  static fromSerializable (data: any) : LightTiles {
+    let t = new LightTiles()
+    t.cellSize = data.cell_size
+    t.tileCells = data.tile_cells
+    data.tiles.forEach((raw: any) => {
+      let tile = new LightTile()
+      tile.x = raw.x
+      tile.y = raw.y
+      if (raw.levels.length > 0) {
+        let decoded = atob(raw.levels)
+        tile.levels = new Uint8Array(decoded.length)
+        for (let i = 0; i < decoded.length; ++i) {
+          tile.levels[i] = decoded.charCodeAt(i)
+        }
+      }
+      t.tiles.push(tile)
+    })
+    return t
+  }
 }
 
 export const TOKEN_COLORS = [
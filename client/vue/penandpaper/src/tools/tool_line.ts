@@ -20,21 +20,28 @@ import * as Sim from '../simulation/simulation'
 import eventBus from '../eventbus'
 import Renderer from '../rendering/renderer'
 
+// How often the points of a stroke being drawn are sent, in milliseconds
+const FLUSH_INTERVAL = 50
+
 export default class ToolToken extends Tool {
   isDrawing: boolean = false
-  lastLineStop: Sim.Point = new Sim.Point(0, 0)
   lastLineStopScreen: Sim.Point = new Sim.Point(0, 0)
-  currentLineStop: Sim.Point = new Sim.Point(0, 0)
+  // The number of the current stroke, chosen by us
+  stroke: number = 0
+  // The points not yet sent to the server
+  pendingPoints: number[] = []
+  flushTimer: number | null = null
 
   onMouseDown (event: MouseEvent) : boolean {
     if (event.ctrlKey) {
       let worldPos = this.map.screenToWorldPos(new Sim.Point(event.offsetX, event.offsetY))
-      this.lastLineStop.x = worldPos.x
-      this.lastLineStop.y = worldPos.y
       this.lastLineStopScreen.x = event.offsetX
       this.lastLineStopScreen.y = event.offsetY
-      this.currentLineStop.x = worldPos.x
-      this.currentLineStop.y = worldPos.y
+      this.stroke += 1
+      let begin = new Sim.StrokePoints()
+      begin.stroke = this.stroke
+      begin.points = [worldPos.x, worldPos.y]
+      eventBus.$emit('/client/stroke/begin', begin)
       this.isDrawing = true
       return true
     } else {
@@ -44,22 +51,16 @@ export default class ToolToken extends Tool {
 
   onMouseMove (event: MouseEvent) : boolean {
     if (this.isDrawing) {
-      let worldPos = this.map.screenToWorldPos(new Sim.Point(event.offsetX, event.offsetY))
-      this.currentLineStop.x = worldPos.x
-      this.currentLineStop.y = worldPos.y
-      if (Math.hypot(this.lastLineStopScreen.x - event.offsetX, this.lastLineStopScreen.y - event.offsetY) > this.map.$el.clientHeight / 20) {
-        // create a new line
-        let line = new Sim.Line()
-        line.start.x = this.lastLineStop.x
-        line.start.y = this.lastLineStop.y
-        line.stop.x = worldPos.x
-        line.stop.y = worldPos.y
-        eventBus.$emit('/client/line/create', line)
-        this.lastLineStop = worldPos
+      if (Math.hypot(this.lastLineStopScreen.x - event.offsetX, this.lastLineStopScreen.y - event.offsetY) > this.map.$el.clientHeight / 200) {
+        let worldPos = this.map.screenToWorldPos(new Sim.Point(event.offsetX, event.offsetY))
+        this.pendingPoints.push(worldPos.x, worldPos.y)
         this.lastLineStopScreen.x = event.offsetX
         this.lastLineStopScreen.y = event.offsetY
+        // The points of a stroke are sent in chunks
+        if (this.flushTimer === null) {
+          this.flushTimer = window.setTimeout(() => { this.flush() }, FLUSH_INTERVAL)
+        }
       }
-      this.map.requestRedraw()
     } else {
       super.onMouseMove(event)
     }
@@ -68,21 +69,30 @@ export default class ToolToken extends Tool {
 
   onMouseUp (event: MouseEvent) : boolean {
     if (this.isDrawing) {
-      // create a new line
       let worldPos = this.map.screenToWorldPos(new Sim.Point(event.offsetX, event.offsetY))
-      let line = new Sim.Line()
-      line.start.x = this.lastLineStop.x
-      line.start.y = this.lastLineStop.y
-      line.stop.x = worldPos.x
-      line.stop.y = worldPos.y
-      eventBus.$emit('/client/line/create', line)
-      this.lastLineStop = worldPos
+      this.pendingPoints.push(worldPos.x, worldPos.y)
+      this.flush()
+      eventBus.$emit('/client/stroke/end', this.stroke)
     }
     super.onMouseUp(event)
     this.isDrawing = false
     return false
   }
 
+  flush () {
+    if (this.flushTimer !== null) {
+      window.clearTimeout(this.flushTimer)
+      this.flushTimer = null
+    }
+    if (this.pendingPoints.length > 0) {
+      let append = new Sim.StrokePoints()
+      append.stroke = this.stroke
+      append.points = this.pendingPoints
+      eventBus.$emit('/client/stroke/append', append)
+      this.pendingPoints = []
+    }
+  }
+
   render (renderer: Renderer) {
     // if (this.isDrawing) {
     //   // Draw the lines
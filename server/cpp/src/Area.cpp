@@ -0,0 +1,107 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "Area.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// The end of the edge of a cone that is rotated by angle from its axis
+Vector2f coneEdge(const Vector2f &tip, const Vector2f &target, float angle) {
+  float dx = target.x() - tip.x();
+  float dy = target.y() - tip.y();
+  float c = std::cos(angle);
+  float s = std::sin(angle);
+  return Vector2f(tip.x() + dx * c - dy * s, tip.y() + dx * s + dy * c);
+}
+}  // namespace
+
+Area::Area(Shape shape, const Vector2f &a, const Vector2f &b, float size)
+    : _shape(shape), _a(a), _b(b), _size(size) {
+  float length = std::hypot(b.x() - a.x(), b.y() - a.y());
+  switch (shape) {
+    case Shape::CIRCLE:
+      _bounds = Rect::around(a, size, size);
+      break;
+    case Shape::CONE:
+      _bounds = Rect::around(a, length, length);
+      break;
+    case Shape::LINE:
+      _bounds = Rect::spanning(a, b).expanded(size);
+      break;
+    case Shape::RECTANGLE:
+      _bounds = Rect::spanning(a, b);
+      break;
+  }
+}
+
+Area Area::circle(const Vector2f &center, float radius) {
+  return Area(Shape::CIRCLE, center, center, radius);
+}
+
+Area Area::cone(const Vector2f &tip, const Vector2f &target, float angle) {
+  return Area(Shape::CONE, tip, target, angle / 2);
+}
+
+Area Area::line(const Vector2f &start, const Vector2f &end, float width) {
+  return Area(Shape::LINE, start, end, width / 2);
+}
+
+Area Area::rectangle(const Vector2f &a, const Vector2f &b) {
+  return Area(Shape::RECTANGLE, a, b, 0);
+}
+
+const Vector2f &Area::origin() const { return _a; }
+
+const Rect &Area::bounds() const { return _bounds; }
+
+bool Area::touches(const Vector2f &center, float radius) const {
+  switch (_shape) {
+    case Shape::CIRCLE:
+      return std::hypot(center.x() - _a.x(), center.y() - _a.y()) <=
+             _size + radius;
+    case Shape::LINE:
+      return distanceToSegment(center, _a, _b) <= _size + radius;
+    case Shape::RECTANGLE: {
+      float dx = std::max({_bounds.minX() - center.x(), 0.0f,
+                           center.x() - _bounds.maxX()});
+      float dy = std::max({_bounds.minY() - center.y(), 0.0f,
+                           center.y() - _bounds.maxY()});
+      return std::hypot(dx, dy) <= radius;
+    }
+    case Shape::CONE: {
+      float ax = _b.x() - _a.x(), ay = _b.y() - _a.y();
+      float px = center.x() - _a.x(), py = center.y() - _a.y();
+      float length = std::hypot(ax, ay);
+      float distance = std::hypot(px, py);
+      if (distance > length + radius) {
+        return false;
+      }
+      if (distance == 0 || length == 0) {
+        return distance <= radius;
+      }
+      float cos_angle = (ax * px + ay * py) / (length * distance);
+      if (std::acos(std::max(-1.0f, std::min(1.0f, cos_angle))) <= _size) {
+        return true;
+      }
+      // Outside of the opening the circle can only reach over an edge
+      return distanceToSegment(center, _a, coneEdge(_a, _b, _size)) <=
+                 radius ||
+             distanceToSegment(center, _a, coneEdge(_a, _b, -_size)) <= radius;
+    }
+  }
+  return false;
+}
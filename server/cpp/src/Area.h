@@ -0,0 +1,58 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "geometry/Rect.h"
+#include "geometry/Vector.h"
+
+/**
+ * @brief The area of effect of a spell or ability, used to find the tokens
+ *        inside of it.
+ */
+class Area {
+ public:
+  static Area circle(const Vector2f &center, float radius);
+  /**
+   * @param angle The full opening angle of the cone in radians.
+   */
+  static Area cone(const Vector2f &tip, const Vector2f &target, float angle);
+  static Area line(const Vector2f &start, const Vector2f &end, float width);
+  static Area rectangle(const Vector2f &a, const Vector2f &b);
+
+  /**
+   * @return The point from which the area spreads, e.g. the center of a
+   *         circle or the tip of a cone.
+   */
+  const Vector2f &origin() const;
+  const Rect &bounds() const;
+  /**
+   * @return True if any part of the circle lies within the area.
+   */
+  bool touches(const Vector2f &center, float radius) const;
+
+ private:
+  enum class Shape { CIRCLE, CONE, LINE, RECTANGLE };
+
+  Area(Shape shape, const Vector2f &a, const Vector2f &b, float size);
+
+  Shape _shape;
+  // The origin and target of the shape
+  Vector2f _a, _b;
+  // The radius of a circle, the half angle of a cone or the half width of a
+  // line
+  float _size;
+  Rect _bounds;
+};
@@ -0,0 +1,68 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+
+/**
+ * The compact framing of the high frequency packets. A client that sent
+ * protocol: 'binary' in its InitSession may send these packets as binary
+ * websocket messages and receives MoveTokens as a binary message.
+ *
+ * Every packet starts with its uint8_t type, followed by little endian fields.
+ * The client packets are decoded by the codecs generated from PacketSchema.h,
+ * so the fields below have to match the order of the schema:
+ *  MOVE_TOKEN          u64 id, f32 x, f32 y, f32 rotation
+ *  CREATE_DOODAD_LINE  f32 sx, f32 sy, f32 ex, f32 ey
+ *  MODIFY_ROOM         u64 id, f32 x, f32 y, f32 width, f32 height,
+ *                      u8 is_visible
+ *  MODIFY_WALL         u64 id, f32 sx, f32 sy, f32 ex, f32 ey, u8 is_visible
+ *  MODIFY_DOOR         u64 id, f32 x, f32 y, f32 width, f32 rotation,
+ *                      u8 is_open, u8 is_visible
+ *  MODIFY_FURNITURE    u64 id, f32 x, f32 y, f32 width, f32 height,
+ *                      f32 rotation, u8 is_visible
+ *  MOVE_TOKENS         u32 count, count times
+ *                      (u64 id, f32 x, f32 y, f32 rotation)
+ *  APPEND_STROKE       u64 stroke, u32 count, count times f32
+ *
+ * The server sends MOVE_TOKENS with the sequence number of the update in
+ * front of the count:
+ *  MOVE_TOKENS         u64 seq, u32 count, count times
+ *                      (u64 id, f32 x, f32 y, f32 rotation)
+ *
+ * Large messages, like the Init packet, are split into CHUNK packets so that
+ * small packets can be sent in between. The parts of one message are sent in
+ * order and never interleave with the parts of another message. Once its
+ * first part was sent, a message is always sent completely:
+ *  CHUNK               u8 flags, the next bytes of the message
+ */
+namespace binary {
+enum class PacketType : uint8_t {
+  MOVE_TOKEN = 1,
+  CREATE_DOODAD_LINE = 2,
+  MODIFY_ROOM = 3,
+  MODIFY_WALL = 4,
+  MODIFY_DOOR = 5,
+  MODIFY_FURNITURE = 6,
+  MOVE_TOKENS = 7,
+  APPEND_STROKE = 8,
+  CHUNK = 9
+};
+
+// The flags of a CHUNK packet
+const uint8_t CHUNK_LAST = 1;    // The message is complete with this part
+const uint8_t CHUNK_BINARY = 2;  // The message is binary instead of json
+}  // namespace binary
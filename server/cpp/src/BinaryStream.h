@@ -0,0 +1,103 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/**
+ * @brief Appends fixed size values to a byte string. Values are stored in the
+ *        byte order of the host, which is little endian on every platform the
+ *        server is built for.
+ */
+class BinaryWriter {
+ public:
+  template <typename T>
+  void write(T value) {
+    static_assert(std::is_arithmetic<T>::value,
+                  "Only arithmetic values can be written.");
+    _data.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  void writeBytes(const void *data, size_t size) {
+    _data.append(reinterpret_cast<const char *>(data), size);
+  }
+
+  /**
+   * @brief Writes the size of the string followed by its bytes.
+   */
+  void writeString(const std::string &s) {
+    write(uint32_t(s.size()));
+    writeBytes(s.data(), s.size());
+  }
+
+  std::string &data() { return _data; }
+
+ private:
+  std::string _data;
+};
+
+/**
+ * @brief Reads values written by a BinaryWriter.
+ */
+class BinaryReader {
+ public:
+  BinaryReader(const char *data, size_t size)
+      : _data(data), _size(size), _pos(0) {}
+
+  explicit BinaryReader(const std::string &data)
+      : BinaryReader(data.data(), data.size()) {}
+
+  /**
+   * @throws std::out_of_range if there is not enough data left.
+   */
+  template <typename T>
+  T read() {
+    static_assert(std::is_arithmetic<T>::value,
+                  "Only arithmetic values can be read.");
+    T value;
+    readBytes(&value, sizeof(T));
+    return value;
+  }
+
+  void readBytes(void *dest, size_t size) {
+    if (_size - _pos < size) {
+      throw std::out_of_range("Unexpected end of a binary packet.");
+    }
+    std::memcpy(dest, _data + _pos, size);
+    _pos += size;
+  }
+
+  std::string readString() {
+    uint32_t size = read<uint32_t>();
+    if (_size - _pos < size) {
+      throw std::out_of_range("Unexpected end of a binary packet.");
+    }
+    std::string s(_data + _pos, size);
+    _pos += size;
+    return s;
+  }
+
+  size_t remaining() const { return _size - _pos; }
+
+ private:
+  const char *_data;
+  size_t _size;
+  size_t _pos;
+};
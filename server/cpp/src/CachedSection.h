@@ -0,0 +1,48 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <string>
+
+/**
+ * @brief Caches the serialized form of one section of the simulation state,
+ *        e.g. all tokens, until a modification of that section invalidates it.
+ */
+class CachedSection {
+ public:
+  CachedSection() : _is_dirty(true) {}
+
+  void invalidate() { _is_dirty = true; }
+  bool isDirty() const { return _is_dirty; }
+
+  /**
+   * @param serialize A callable returning the serialized section. Only called
+   *                  if the section was invalidated since the last call.
+   * @return The serialized section.
+   */
+  template <typename F>
+  const std::string &get(F serialize) {
+    if (_is_dirty) {
+      _text = serialize();
+      _is_dirty = false;
+    }
+    return _text;
+  }
+
+ private:
+  bool _is_dirty;
+  std::string _text;
+};
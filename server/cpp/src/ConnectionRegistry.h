@@ -0,0 +1,135 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief The connected clients, by the table they joined.
+ *
+ *        Looking up the clients of a table never waits for clients joining or
+ *        leaving: the clients of every table are published as an immutable
+ *        list, which is replaced as a whole when a client joins or leaves.
+ *        Readers only copy the shared_ptr to the list. std::atomic_load of a
+ *        shared_ptr is not lock free in the common standard libraries, it
+ *        briefly takes one of a pool of locks, but it never contends with
+ *        the writers' mutex.
+ *
+ *        The price is that insert and remove are not O(1): they copy the
+ *        list of the affected table, so they take time linear in the
+ *        number of its clients. Joining and leaving are rare compared to
+ *        broadcasts, which would otherwise have to lock or copy the list
+ *        themselves. The writers are serialized by the mutex.
+ *
+ * @tparam C The per connection state, with a std::string member named table.
+ */
+template <typename C>
+class ConnectionRegistry {
+ public:
+  typedef std::shared_ptr<C> Ptr;
+  typedef std::shared_ptr<const std::vector<Ptr>> List;
+
+  ConnectionRegistry()
+      : _tables(std::make_shared<const TableMap>()),
+        _empty(std::make_shared<const std::vector<Ptr>>()) {}
+
+  ConnectionRegistry(const ConnectionRegistry &other) = delete;
+  ConnectionRegistry &operator=(const ConnectionRegistry &other) = delete;
+
+  void insert(const Ptr &connection) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::shared_ptr<Table> table = tableFor(connection->table);
+    auto members = std::make_shared<std::vector<Ptr>>(
+        *std::atomic_load(&table->members));
+    members->push_back(connection);
+    std::atomic_store(&table->members, List(std::move(members)));
+  }
+
+  void remove(const Ptr &connection) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::shared_ptr<const TableMap> tables = std::atomic_load(&_tables);
+    auto it = tables->find(connection->table);
+    if (it == tables->end()) {
+      return;
+    }
+    List old_members = std::atomic_load(&it->second->members);
+    auto members = std::make_shared<std::vector<Ptr>>();
+    members->reserve(old_members->size());
+    for (const Ptr &member : *old_members) {
+      if (member != connection) {
+        members->push_back(member);
+      }
+    }
+    if (!members->empty()) {
+      std::atomic_store(&it->second->members, List(std::move(members)));
+      return;
+    }
+    // Readers that still hold the old map keep the entry alive, a table that
+    // is joined again gets a new one.
+    std::atomic_store(&it->second->members, _empty);
+    auto reduced = std::make_shared<TableMap>(*tables);
+    reduced->erase(connection->table);
+    std::atomic_store(&_tables, std::shared_ptr<const TableMap>(reduced));
+  }
+
+  /**
+   * @return The connections of the table at the time of the call. The list
+   *         stays valid and unchanged while it is held.
+   */
+  List table(const std::string &name) const {
+    std::shared_ptr<const TableMap> tables = std::atomic_load(&_tables);
+    auto it = tables->find(name);
+    if (it == tables->end()) {
+      return _empty;
+    }
+    return std::atomic_load(&it->second->members);
+  }
+
+ private:
+  struct Table {
+    List members;
+  };
+  typedef std::unordered_map<std::string, std::shared_ptr<Table>> TableMap;
+
+  /**
+   * @return The entry of the table, added if it does not exist. Has to be
+   *         called with _mutex held.
+   */
+  std::shared_ptr<Table> tableFor(const std::string &name) {
+    std::shared_ptr<const TableMap> tables = std::atomic_load(&_tables);
+    auto it = tables->find(name);
+    if (it != tables->end()) {
+      return it->second;
+    }
+    auto table = std::make_shared<Table>();
+    table->members = _empty;
+    auto extended = std::make_shared<TableMap>(*tables);
+    (*extended)[name] = table;
+    std::atomic_store(&_tables, std::shared_ptr<const TableMap>(extended));
+    return table;
+  }
+
+  // Serializes the writers, readers of the tables never take it
+  std::mutex _mutex;
+  // Replaced as a whole when a table gains its first or loses its last
+  // connection. Its size is bounded by the number of open tables.
+  std::shared_ptr<const TableMap> _tables;
+  const List _empty;
+};
@@ -0,0 +1,66 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "Deflater.h"
+
+#include <stdexcept>
+
+Deflater::Deflater(int level, bool context_takeover)
+    : _context_takeover(context_takeover) {
+  _stream.zalloc = Z_NULL;
+  _stream.zfree = Z_NULL;
+  _stream.opaque = Z_NULL;
+  // Negative window bits produce raw deflate data without a zlib header. The
+  // full window is used, clients that ask for a smaller one do not get
+  // compressed messages.
+  if (deflateInit2(&_stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    throw std::runtime_error("Unable to initialize zlib.");
+  }
+}
+
+Deflater::~Deflater() { deflateEnd(&_stream); }
+
+std::string Deflater::compress(const std::string &data) {
+  if (!_context_takeover) {
+    deflateReset(&_stream);
+  }
+  std::string out;
+  out.resize(deflateBound(&_stream, data.size()) + 16);
+  _stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  _stream.avail_in = data.size();
+  _stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  _stream.avail_out = out.size();
+  // A sync flush ends the message on a byte boundary, with an empty stored
+  // block that the extension strips off.
+  int result = deflate(&_stream, Z_SYNC_FLUSH);
+  while (result == Z_OK && _stream.avail_out == 0) {
+    size_t used = out.size();
+    out.resize(used * 2);
+    _stream.next_out = reinterpret_cast<Bytef *>(&out[used]);
+    _stream.avail_out = out.size() - used;
+    result = deflate(&_stream, Z_SYNC_FLUSH);
+  }
+  if (result != Z_OK && result != Z_BUF_ERROR) {
+    throw std::runtime_error("Unable to compress a message.");
+  }
+  out.resize(out.size() - _stream.avail_out);
+  if (out.size() >= 4 &&
+      out.compare(out.size() - 4, 4, "\0\0\xff\xff", 4) == 0) {
+    out.resize(out.size() - 4);
+  }
+  return out;
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <zlib.h>
+
+#include <string>
+
+/**
+ * @brief Compresses the payload of websocket messages for the
+ *        permessage-deflate extension (RFC 7692).
+ */
+class Deflater {
+ public:
+  /**
+   * @param level The zlib compression level, from 1 (fastest) to 9
+   *              (smallest).
+   * @param context_takeover If true, later messages refer back to the earlier
+   *                         ones, which compresses small messages better.
+   *                         Without it, every message can be decompressed on
+   *                         its own and sent to any number of clients.
+   */
+  Deflater(int level, bool context_takeover);
+  ~Deflater();
+
+  Deflater(const Deflater &other) = delete;
+  Deflater &operator=(const Deflater &other) = delete;
+
+  /**
+   * @return The compressed payload, without the empty block that ends it.
+   * @throws std::runtime_error if zlib fails.
+   */
+  std::string compress(const std::string &data);
+
+ private:
+  z_stream _stream;
+  bool _context_takeover;
+};
@@ -0,0 +1,82 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "DeltaLog.h"
+
+#include <chrono>
+
+DeltaLog::DeltaLog(size_t max_entries, size_t max_bytes)
+    : _max_entries(max_entries),
+      _max_bytes(max_bytes),
+      _num_bytes(0),
+      _last_sequence(0) {
+  _epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+               .count();
+}
+
+std::string DeltaLog::append(const std::string &packet) {
+  _last_sequence++;
+  std::string stamped = stamp(packet, _last_sequence);
+  _packets.push_back(stamped);
+  _num_bytes += stamped.size();
+  while (!_packets.empty() &&
+         (_packets.size() > _max_entries || _num_bytes > _max_bytes)) {
+    _num_bytes -= _packets.front().size();
+    _packets.pop_front();
+  }
+  return stamped;
+}
+
+uint64_t DeltaLog::lastSequence() const { return _last_sequence; }
+
+uint64_t DeltaLog::epoch() const { return _epoch; }
+
+bool DeltaLog::appendSince(uint64_t seq, std::string *out) const {
+  if (seq > _last_sequence) {
+    // The client has seen packets this log never sent
+    return false;
+  }
+  uint64_t num_missing = _last_sequence - seq;
+  if (num_missing > _packets.size()) {
+    return false;
+  }
+  for (size_t i = _packets.size() - num_missing; i < _packets.size(); ++i) {
+    *out += ",";
+    *out += _packets[i];
+  }
+  return true;
+}
+
+std::string DeltaLog::stamp(const std::string &packet, uint64_t seq) {
+  size_t pos = packet.find('{');
+  if (pos == std::string::npos) {
+    return packet;
+  }
+  // Json objects are unordered, so the member can simply be inserted after
+  // the opening brace without parsing the packet.
+  std::string stamped;
+  stamped.reserve(packet.size() + 32);
+  stamped.append(packet, 0, pos + 1);
+  stamped += "\"seq\":";
+  stamped += std::to_string(seq);
+  size_t next = packet.find_first_not_of(" \t\r\n", pos + 1);
+  if (next != std::string::npos && packet[next] != '}') {
+    // The object is not empty
+    stamped += ",";
+  }
+  stamped.append(packet, pos + 1, std::string::npos);
+  return stamped;
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+/**
+ * @brief A bounded log of the most recent state changing packets sent to the
+ *        clients. Every packet is stamped with a monotonically increasing
+ *        sequence number, which allows reconnecting clients to only receive
+ *        the packets they missed.
+ */
+class DeltaLog {
+ public:
+  /**
+   * @param max_entries The maximum number of packets kept in the log.
+   * @param max_bytes The maximum total size of the packets kept in the log.
+   */
+  DeltaLog(size_t max_entries, size_t max_bytes);
+
+  /**
+   * @brief Stamps the packet with the next sequence number and stores it.
+   * @return The stamped packet.
+   */
+  std::string append(const std::string &packet);
+
+  /**
+   * @return The sequence number of the last appended packet.
+   */
+  uint64_t lastSequence() const;
+
+  /**
+   * @return An id identifying this log. Sequence numbers of logs with
+   *         different epochs are unrelated.
+   */
+  uint64_t epoch() const;
+
+  /**
+   * @brief Appends all packets with a sequence number greater than seq to out,
+   *        each preceded by a comma.
+   * @return False if the log does not reach back far enough to contain all
+   *         packets after seq. Nothing is appended to out in that case.
+   */
+  bool appendSince(uint64_t seq, std::string *out) const;
+
+  /**
+   * @brief Adds a "seq" member with the given value to the serialized json
+   *        object packet.
+   */
+  static std::string stamp(const std::string &packet, uint64_t seq);
+
+ private:
+  size_t _max_entries;
+  size_t _max_bytes;
+
+  std::deque<std::string> _packets;
+  size_t _num_bytes;
+  uint64_t _last_sequence;
+  uint64_t _epoch;
+};
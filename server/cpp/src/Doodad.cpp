@@ -13,29 +13,266 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-
 #include "Doodad.h"
 
-DoodadLine::DoodadLine(IdGenerator *idg) : _id(idg->next()), _sx(0), _sy(0), _ex(0), _ey(0) {}
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace {
+bool touches(const Vector2f &a, const Vector2f &b) {
+  return std::abs(a.x() - b.x()) <= Stroke::QUANTUM &&
+         std::abs(a.y() - b.y()) <= Stroke::QUANTUM;
+}
+
+int32_t quantize(float v) { return int32_t(std::lround(v / Stroke::QUANTUM)); }
+
+void writeVarint(uint64_t v, BinaryWriter *writer) {
+  while (v >= 0x80) {
+    writer->write(uint8_t(v | 0x80));
+    v >>= 7;
+  }
+  writer->write(uint8_t(v));
+}
+
+uint64_t readVarint(BinaryReader *reader) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = reader->read<uint8_t>();
+    v |= uint64_t(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  return v;
+}
+
+// Writes the differences between consecutive values, zig-zag encoded so that
+// small negative differences are small numbers as well.
+void writeDeltas(const std::vector<int32_t> &values, BinaryWriter *writer) {
+  int64_t last = 0;
+  for (int32_t v : values) {
+    int64_t delta = int64_t(v) - last;
+    writeVarint((uint64_t(delta) << 1) ^ uint64_t(delta >> 63), writer);
+    last = v;
+  }
+}
+
+void readDeltas(size_t count, BinaryReader *reader,
+                std::vector<int32_t> *values) {
+  int64_t last = 0;
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t v = readVarint(reader);
+    last += int64_t(v >> 1) ^ -int64_t(v & 1);
+    values->push_back(int32_t(last));
+  }
+}
+}  // namespace
+
+Stroke::Stroke() : _id(0), _is_complete(false), _is_compacted(false) {}
 
-nlohmann::json DoodadLine::serialize() {
+nlohmann::json Stroke::serialize() {
   using nlohmann::json;
   json j;
   j["id"] = _id;
-  j["type"] = "line";
-  j["sx"] = _sx;
-  j["sy"] = _sy;
-  j["ex"] = _ex;
-  j["ey"] = _ey;
+  j["type"] = "stroke";
+  j["points"] = points();
+  j["complete"] = _is_complete;
   return j;
 }
 
-void DoodadLine::deserialize(const nlohmann::json &j) {
+void Stroke::deserialize(const nlohmann::json &j) {
   if (j.find("id") != j.end()) {
     _id = j.at("id").get<uint64_t>();
   }
-  _sx = j.at("sx").get<float>();
-  _sy = j.at("sy").get<float>();
-  _ex = j.at("ex").get<float>();
-  _ey = j.at("ey").get<float>();
+  _points.clear();
+  _xs.clear();
+  _ys.clear();
+  _is_compacted = false;
+  append(j.at("points").get<std::vector<float>>());
+  _is_complete = j.at("complete").get<bool>();
+}
+
+void Stroke::append(const std::vector<float> &points) {
+  if (_is_compacted) {
+    return;
+  }
+  for (size_t i = 0; i + 1 < points.size(); i += 2) {
+    Vector2f p(points[i], points[i + 1]);
+    _bounds = _points.empty() ? Rect::spanning(p, p)
+                              : _bounds.united(Rect::spanning(p, p));
+    _points.push_back(p.x());
+    _points.push_back(p.y());
+  }
+}
+
+bool Stroke::join(const Stroke &other) {
+  size_t n = size() / 2;
+  size_t m = other.size() / 2;
+  if (n == 0 || m == 0) {
+    return false;
+  }
+  std::vector<float> mine = points();
+  std::vector<float> theirs = other.points();
+  auto reverse = [](std::vector<float> *coordinates) {
+    std::vector<float> &c = *coordinates;
+    for (size_t i = 0, j = c.size() - 2; i < j; i += 2, j -= 2) {
+      std::swap(c[i], c[j]);
+      std::swap(c[i + 1], c[j + 1]);
+    }
+  };
+  // Bring the points into an order in which the end of the first touches
+  // the start of the second
+  if (touches(point(n - 1), other.point(0))) {
+  } else if (touches(point(n - 1), other.point(m - 1))) {
+    reverse(&theirs);
+  } else if (touches(point(0), other.point(m - 1))) {
+    std::swap(mine, theirs);
+  } else if (touches(point(0), other.point(0))) {
+    reverse(&theirs);
+    std::swap(mine, theirs);
+  } else {
+    return false;
+  }
+  mine.insert(mine.end(), theirs.begin() + 2, theirs.end());
+  _points.clear();
+  _xs.clear();
+  _ys.clear();
+  _is_compacted = false;
+  append(mine);
+  return true;
+}
+
+void Stroke::compact(float tolerance) {
+  size_t n = size() / 2;
+  if (n == 0) {
+    return;
+  }
+  // Douglas-Peucker, with a stack instead of recursion because a stroke can
+  // have tens of thousands of points
+  std::vector<bool> keep(n, false);
+  keep[0] = keep[n - 1] = true;
+  std::vector<std::pair<size_t, size_t>> ranges;
+  if (n > 2) {
+    ranges.emplace_back(0, n - 1);
+  }
+  while (!ranges.empty()) {
+    size_t first = ranges.back().first;
+    size_t last = ranges.back().second;
+    ranges.pop_back();
+    Vector2f a = point(first);
+    Vector2f b = point(last);
+    float max_distance = 0;
+    size_t farthest = first;
+    for (size_t i = first + 1; i < last; ++i) {
+      float distance = distanceToSegment(point(i), a, b);
+      if (distance > max_distance) {
+        max_distance = distance;
+        farthest = i;
+      }
+    }
+    if (max_distance > tolerance) {
+      keep[farthest] = true;
+      if (farthest - first > 1) {
+        ranges.emplace_back(first, farthest);
+      }
+      if (last - farthest > 1) {
+        ranges.emplace_back(farthest, last);
+      }
+    }
+  }
+
+  std::vector<int32_t> xs, ys;
+  for (size_t i = 0; i < n; ++i) {
+    if (!keep[i]) {
+      continue;
+    }
+    Vector2f p = point(i);
+    int32_t x = quantize(p.x());
+    int32_t y = quantize(p.y());
+    // Points closer than the resolution collapse into one
+    if (!xs.empty() && xs.back() == x && ys.back() == y && i + 1 < n) {
+      continue;
+    }
+    xs.push_back(x);
+    ys.push_back(y);
+  }
+  _xs = std::move(xs);
+  _ys = std::move(ys);
+  std::vector<float>().swap(_points);
+  _is_compacted = true;
+  updateBounds();
+}
+
+void Stroke::writeBinary(BinaryWriter *writer) const {
+  writer->write(_id);
+  writer->write(uint8_t(_is_complete));
+  writer->write(uint32_t(size() / 2));
+  if (_is_compacted) {
+    writeDeltas(_xs, writer);
+    writeDeltas(_ys, writer);
+    return;
+  }
+  std::vector<int32_t> xs, ys;
+  for (size_t i = 0; i + 1 < _points.size(); i += 2) {
+    xs.push_back(quantize(_points[i]));
+    ys.push_back(quantize(_points[i + 1]));
+  }
+  writeDeltas(xs, writer);
+  writeDeltas(ys, writer);
+}
+
+Stroke Stroke::fromBinary(BinaryReader *reader) {
+  Stroke s;
+  s._id = reader->read<uint64_t>();
+  s._is_complete = reader->read<uint8_t>() != 0;
+  uint32_t count = reader->read<uint32_t>();
+  // Every point takes at least two bytes
+  if (count > reader->remaining() / 2) {
+    throw std::out_of_range("Unexpected end of a stroke.");
+  }
+  readDeltas(count, reader, &s._xs);
+  readDeltas(count, reader, &s._ys);
+  s._is_compacted = true;
+  if (!s._is_complete) {
+    // Points can still be appended
+    s._points = s.points();
+    std::vector<int32_t>().swap(s._xs);
+    std::vector<int32_t>().swap(s._ys);
+    s._is_compacted = false;
+  }
+  s.updateBounds();
+  return s;
+}
+
+size_t Stroke::size() const {
+  return _is_compacted ? _xs.size() * 2 : _points.size();
+}
+
+std::vector<float> Stroke::points(size_t from) const {
+  if (!_is_compacted) {
+    return std::vector<float>(_points.begin() + std::min(from, _points.size()),
+                              _points.end());
+  }
+  std::vector<float> result;
+  for (size_t i = from; i < size(); ++i) {
+    const std::vector<int32_t> &values = i % 2 == 0 ? _xs : _ys;
+    result.push_back(values[i / 2] * QUANTUM);
+  }
+  return result;
+}
+
+Vector2f Stroke::point(size_t i) const {
+  if (_is_compacted) {
+    return Vector2f(_xs[i] * QUANTUM, _ys[i] * QUANTUM);
+  }
+  return Vector2f(_points[2 * i], _points[2 * i + 1]);
+}
+
+void Stroke::updateBounds() {
+  for (size_t i = 0; i < size() / 2; ++i) {
+    Vector2f p = point(i);
+    _bounds = i == 0 ? Rect::spanning(p, p)
+                     : _bounds.united(Rect::spanning(p, p));
+  }
 }
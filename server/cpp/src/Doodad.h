@@ -13,29 +13,92 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
+#include "BinaryStream.h"
 #include "Serializeable.h"
-#include "IdGenerator.h"
+#include "geometry/Rect.h"
 
-class DoodadLine : public Serializable {
+/**
+ * @brief A freehand stroke drawn on the map. The points of the polyline are
+ *        stored as x and y coordinates one after the other.
+ *
+ *        Complete strokes can be compacted, which drops the points that do
+ *        not change the shape of the line by more than a tolerance and stores
+ *        the rest as separate arrays of fixed point x and y coordinates.
+ */
+class Stroke : public Serializable {
  public:
-  DoodadLine(IdGenerator *idg);
+  Stroke();
 
   virtual nlohmann::json serialize() override;
   virtual void deserialize(const nlohmann::json &json) override;
 
+  /**
+   * @brief Appends points given as x and y coordinates one after the other.
+   *        A trailing single coordinate is ignored. Compacted strokes can not
+   *        be appended to.
+   */
+  void append(const std::vector<float> &points);
+
+  /**
+   * @brief Appends the points of other to this stroke if one of its ends
+   *        lies on one of the ends of this stroke. Other may be reversed for
+   *        that.
+   * @return False if the strokes do not touch.
+   */
+  bool join(const Stroke &other);
+  /**
+   * @brief Simplifies the polyline using Douglas-Peucker and stores the
+   *        remaining points quantized.
+   * @param tolerance The maximum distance of a dropped point from the
+   *                  simplified line.
+   */
+  void compact(float tolerance);
+
+  /**
+   * @brief Writes the stroke in the compact binary encoding used by the Init
+   *        packet: the id, whether the stroke is complete, the number of
+   *        points and the zig-zag varint deltas of the quantized x and then
+   *        the y coordinates.
+   */
+  void writeBinary(BinaryWriter *writer) const;
+  /**
+   * @brief Reads a stroke written by writeBinary. Complete strokes keep the
+   *        quantized coordinates, they are marked as compacted.
+   */
+  static Stroke fromBinary(BinaryReader *reader);
+
   uint64_t &id() { return _id; }
-  float &sx() { return _sx; }
-  float &sy() { return _sy; }
-  float &ex() { return _ex; }
-  float &ey() { return _ey; }
+  /**
+   * @return The number of coordinates, twice the number of points.
+   */
+  size_t size() const;
+  /**
+   * @return The coordinates starting at the coordinate with index from.
+   */
+  std::vector<float> points(size_t from = 0) const;
+  bool &isComplete() { return _is_complete; }
+  bool isCompacted() const { return _is_compacted; }
+  const Rect &bounds() const { return _bounds; }
+  Vector2f point(size_t i) const;
+
+  // The resolution of the coordinates of a compacted stroke
+  static constexpr float QUANTUM = 1.0f / 64;
 
  private:
+  void updateBounds();
+
   uint64_t _id;
-  float _sx, _sy;
-  float _ex, _ey;
+  // The coordinates while the stroke is not compacted
+  std::vector<float> _points;
+  // The coordinates in multiples of QUANTUM once it is
+  std::vector<int32_t> _xs, _ys;
+  // False while the stroke is still being drawn
+  bool _is_complete;
+  bool _is_compacted;
+  Rect _bounds;
 };
@@ -19,4 +19,19 @@ IdGenerator::IdGenerator() : _next_id(0) {}
 
 uint64_t IdGenerator::operator()() { return next(); }
 
-uint64_t IdGenerator::next() { return _next_id++; }
+uint64_t IdGenerator::next() {
+  return _next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t IdGenerator::highWaterMark() const {
+  return _next_id.load(std::memory_order_relaxed);
+}
+
+void IdGenerator::restore(uint64_t high_water_mark) {
+  // Never move backwards, ids may have been handed out already
+  uint64_t current = _next_id.load(std::memory_order_relaxed);
+  while (current < high_water_mark &&
+         !_next_id.compare_exchange_weak(current, high_water_mark,
+                                         std::memory_order_relaxed)) {
+  }
+}
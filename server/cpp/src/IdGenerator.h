@@ -15,15 +15,36 @@
  */
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 
+/**
+ * @brief Hands out unique ids. Taking an id is a single atomic increment, so
+ *        any number of threads can share a generator without a lock.
+ *
+ *        The high-water mark is saved with the state of the table, so ids
+ *        stay unique across restarts.
+ */
 class IdGenerator {
  public:
   IdGenerator();
 
+  IdGenerator(const IdGenerator &other) = delete;
+  IdGenerator &operator=(const IdGenerator &other) = delete;
+
   uint64_t operator()();
   uint64_t next();
 
+  /**
+   * @return An id larger than all ids handed out so far.
+   */
+  uint64_t highWaterMark() const;
+  /**
+   * @brief Continues with the high-water mark saved before a restart. Ids
+   *        below the mark are never handed out.
+   */
+  void restore(uint64_t high_water_mark);
+
  private:
-  uint64_t _next_id;
+  std::atomic<uint64_t> _next_id;
 };
@@ -0,0 +1,235 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "Journal.h"
+
+#include <chrono>
+
+#include "BinaryStream.h"
+#include "Logger.h"
+#include "Os.h"
+
+namespace {
+uint32_t checksum(const char *data, size_t size) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= uint8_t(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+}  // namespace
+
+Journal::Journal(const std::string &directory)
+    : _directory(directory),
+      _generation(0),
+      _log(nullptr),
+      _has_directory(false),
+      _stop(false) {
+  _thread = std::thread([this]() { run(); });
+}
+
+Journal::~Journal() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_one();
+  _thread.join();
+  if (_log != nullptr) {
+    std::fclose(_log);
+  }
+}
+
+bool Journal::load(std::string *snapshot, std::vector<std::string> *records) {
+  bool has_snapshot = false;
+  {
+    os::MappedFile file(snapshotPath());
+    if (file.isOpen()) {
+      try {
+        BinaryReader reader(file.data(), file.size());
+        if (reader.read<uint32_t>() != SNAPSHOT_MAGIC ||
+            reader.read<uint32_t>() != SNAPSHOT_VERSION) {
+          throw std::runtime_error("unknown format");
+        }
+        uint64_t generation = reader.read<uint64_t>();
+        uint32_t expected = reader.read<uint32_t>();
+        size_t offset = file.size() - reader.remaining();
+        if (checksum(file.data() + offset, reader.remaining()) != expected) {
+          throw std::runtime_error("checksum mismatch");
+        }
+        snapshot->assign(file.data() + offset, reader.remaining());
+        _generation = generation;
+        has_snapshot = true;
+      } catch (const std::exception &e) {
+        // Starting over would overwrite the snapshot, keep it for recovery.
+        LOG_ERROR << "The snapshot in " << _directory
+                  << " is unreadable: " << e.what() << LOG_END;
+        os::replaceFile(snapshotPath(), snapshotPath() + ".corrupt");
+      }
+    }
+  }
+
+  os::MappedFile log(logPath(_generation));
+  size_t offset = 0;
+  while (log.size() - offset >= 2 * sizeof(uint32_t)) {
+    BinaryReader reader(log.data() + offset, 2 * sizeof(uint32_t));
+    uint32_t size = reader.read<uint32_t>();
+    uint32_t expected = reader.read<uint32_t>();
+    const char *data = log.data() + offset + 2 * sizeof(uint32_t);
+    if (log.size() - offset - 2 * sizeof(uint32_t) < size ||
+        checksum(data, size) != expected) {
+      break;
+    }
+    records->emplace_back(data, size);
+    offset += 2 * sizeof(uint32_t) + size;
+  }
+  if (offset < log.size()) {
+    // A crash while writing leaves a partial record at the end. It is cut
+    // off, so that new records are not appended behind it.
+    LOG_WARN << "Dropped " << log.size() - offset
+             << " bytes of an incomplete record from the log in "
+             << _directory << LOG_END;
+    std::string valid(log.data(), offset);
+    std::FILE *file = std::fopen(logPath(_generation).c_str(), "wb");
+    if (file == nullptr ||
+        std::fwrite(valid.data(), 1, valid.size(), file) != valid.size() ||
+        !os::syncFile(file)) {
+      LOG_ERROR << "Unable to repair the log in " << _directory << LOG_END;
+    }
+    if (file != nullptr) {
+      std::fclose(file);
+    }
+  }
+  return has_snapshot;
+}
+
+void Journal::append(std::string record) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending.push_back({std::move(record), nullptr});
+  }
+  _cond.notify_one();
+}
+
+void Journal::snapshot(std::function<std::string()> write_state) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending.push_back({std::string(), std::move(write_state)});
+  }
+  _cond.notify_one();
+}
+
+void Journal::run() {
+  std::vector<Entry> entries;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cond.wait(lock, [this]() { return _stop || !_pending.empty(); });
+      if (_pending.empty()) {
+        return;
+      }
+      entries.swap(_pending);
+    }
+    // A table that never changes leaves nothing behind on the disk
+    if (!_has_directory) {
+      _has_directory = os::makeDirectories(_directory);
+      if (!_has_directory) {
+        LOG_ERROR << "Unable to create the directory " << _directory
+                  << LOG_END;
+      }
+    }
+    // Group commit: everything that piled up is written with one sync
+    BinaryWriter framed;
+    for (const Entry &entry : entries) {
+      if (entry.write_state) {
+        writeRecords(framed.data());
+        framed.data().clear();
+        writeSnapshot(entry.write_state());
+      } else {
+        framed.write(uint32_t(entry.data.size()));
+        framed.write(checksum(entry.data.data(), entry.data.size()));
+        framed.writeBytes(entry.data.data(), entry.data.size());
+      }
+    }
+    writeRecords(framed.data());
+    entries.clear();
+  }
+}
+
+void Journal::writeRecords(const std::string &framed) {
+  if (framed.empty()) {
+    return;
+  }
+  if (_log == nullptr) {
+    _log = std::fopen(logPath(_generation).c_str(), "ab");
+    if (_log == nullptr) {
+      LOG_ERROR << "Unable to open the log in " << _directory << LOG_END;
+      return;
+    }
+  }
+  if (std::fwrite(framed.data(), 1, framed.size(), _log) != framed.size() ||
+      !os::syncFile(_log)) {
+    LOG_ERROR << "Unable to write to the log in " << _directory << LOG_END;
+  }
+}
+
+void Journal::writeSnapshot(const std::string &state) {
+  auto start = std::chrono::steady_clock::now();
+  BinaryWriter header;
+  header.write(SNAPSHOT_MAGIC);
+  header.write(SNAPSHOT_VERSION);
+  header.write(_generation + 1);
+  header.write(checksum(state.data(), state.size()));
+
+  // The new snapshot only replaces the old one once it is complete
+  std::string path = snapshotPath() + ".tmp";
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  bool is_written =
+      file != nullptr &&
+      std::fwrite(header.data().data(), 1, header.data().size(), file) ==
+          header.data().size() &&
+      std::fwrite(state.data(), 1, state.size(), file) == state.size() &&
+      os::syncFile(file);
+  if (file != nullptr) {
+    std::fclose(file);
+  }
+  if (!is_written || !os::replaceFile(path, snapshotPath())) {
+    LOG_ERROR << "Unable to write a snapshot to " << _directory << LOG_END;
+    return;
+  }
+
+  if (_log != nullptr) {
+    std::fclose(_log);
+    _log = nullptr;
+  }
+  std::remove(logPath(_generation).c_str());
+  _generation++;
+  LOG_DEBUG << "Wrote a snapshot of " << state.size() << " bytes to "
+            << _directory << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << "ms" << LOG_END;
+}
+
+std::string Journal::snapshotPath() const {
+  return _directory + "/snapshot.bin";
+}
+
+std::string Journal::logPath(uint64_t generation) const {
+  return _directory + "/log-" + std::to_string(generation) + ".bin";
+}
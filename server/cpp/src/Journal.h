@@ -0,0 +1,98 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The saved state of a table: the latest snapshot of the state and a
+ *        log of the records appended since it was taken. What a record or a
+ *        snapshot contains is up to the user of the journal.
+ *
+ *        Records and snapshots are written on the journal's own thread. All
+ *        records appended while that thread was busy are written and synced
+ *        to the disk together, so appending never waits for the disk.
+ *        Snapshots are also serialized on that thread.
+ */
+class Journal {
+ public:
+  explicit Journal(const std::string &directory);
+  /**
+   * @brief Writes everything appended so far before returning.
+   */
+  ~Journal();
+
+  Journal(const Journal &other) = delete;
+  Journal &operator=(const Journal &other) = delete;
+
+  /**
+   * @brief Reads the latest snapshot and the records appended after it. A
+   *        record that was only partially written, and everything after it,
+   *        is dropped. Has to be called before anything is appended.
+   * @return False if there is no snapshot. The records are read either way.
+   */
+  bool load(std::string *snapshot, std::vector<std::string> *records);
+
+  void append(std::string record);
+  /**
+   * @brief Replaces the snapshot once the records appended before are
+   *        written, and starts a new log for the records appended after.
+   * @param write_state Called on the journal's thread, returns the state to
+   *                    save. It must not access anything the caller keeps
+   *                    modifying.
+   */
+  void snapshot(std::function<std::string()> write_state);
+
+ private:
+  // Either a record or, if write_state is set, a snapshot
+  struct Entry {
+    std::string data;
+    std::function<std::string()> write_state;
+  };
+
+  void run();
+  void writeRecords(const std::string &framed);
+  void writeSnapshot(const std::string &state);
+
+  std::string snapshotPath() const;
+  std::string logPath(uint64_t generation) const;
+
+  static const uint32_t SNAPSHOT_MAGIC = 0x534e5050;  // "PPNS"
+  static const uint32_t SNAPSHOT_VERSION = 1;
+
+  std::string _directory;
+  // Every snapshot starts a new generation. The log of a generation holds the
+  // records appended after its snapshot.
+  uint64_t _generation;
+  std::FILE *_log;
+  // The directory is created with the first record or snapshot. Only
+  // accessed on the journal's thread.
+  bool _has_directory;
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::vector<Entry> _pending;
+  bool _stop;
+
+  std::thread _thread;
+};
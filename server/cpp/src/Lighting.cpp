@@ -0,0 +1,270 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "Lighting.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Util.h"
+
+nlohmann::json Lighting::Light::toJson() const {
+  nlohmann::json j;
+  j["id"] = id;
+  j["position"] = position.toJson();
+  j["radius"] = radius;
+  j["token"] = token;
+  return j;
+}
+
+Lighting::Lighting() : _index(INDEX_CELL_SIZE), _has_stale_lights(false) {}
+
+const Lighting::Light &Lighting::addLight(const Vector2f &position,
+                                          float radius, uint64_t token) {
+  Light &light = _lights.create([&](uint64_t id) {
+    Light l;
+    l.id = id;
+    l.position = position;
+    l.radius = radius;
+    l.token = token;
+    l.is_stale = true;
+    return l;
+  });
+  _has_stale_lights = true;
+  return light;
+}
+
+bool Lighting::removeLight(uint64_t id) {
+  const Rect *lit = _index.bounds(id);
+  if (lit != nullptr) {
+    markTiles(*lit);
+    _index.remove(id);
+  }
+  return _lights.erase(id);
+}
+
+void Lighting::clear() {
+  for (const auto &tile : _tiles) {
+    _dirty_tiles.insert(tile.first);
+  }
+  _lights.clear();
+  _index.clear();
+}
+
+void Lighting::moveToken(uint64_t token, const Vector2f &position) {
+  for (Light &light : _lights) {
+    if (light.token == token) {
+      light.position = position;
+      light.is_stale = true;
+      _has_stale_lights = true;
+    }
+  }
+}
+
+std::vector<uint64_t> Lighting::removeToken(uint64_t token) {
+  std::vector<uint64_t> carried;
+  for (const Light &light : _lights) {
+    if (light.token == token) {
+      carried.push_back(light.id);
+    }
+  }
+  for (uint64_t id : carried) {
+    removeLight(id);
+  }
+  return carried;
+}
+
+void Lighting::invalidate(const Rect &area) {
+  for (uint64_t id : _index.query(area)) {
+    Light *light = _lights.get(id);
+    if (light != nullptr) {
+      light->is_stale = true;
+      _has_stale_lights = true;
+    }
+  }
+}
+
+nlohmann::json Lighting::update(BuildingManager *building_manager) {
+  using nlohmann::json;
+  if (_has_stale_lights) {
+    for (Light &light : _lights) {
+      if (!light.is_stale) {
+        continue;
+      }
+      // Both the tiles lit before and after the change have to be redrawn
+      const Rect *lit = _index.bounds(light.id);
+      if (lit != nullptr) {
+        markTiles(*lit);
+      }
+      light.visible =
+          building_manager->computeVisible(light.position, light.radius);
+      light.is_stale = false;
+      _index.insert(light.id, influence(light));
+      markTiles(influence(light));
+    }
+    _has_stale_lights = false;
+  }
+  if (_dirty_tiles.empty()) {
+    return json();
+  }
+
+  json tiles = json::array();
+  for (uint64_t key : _dirty_tiles) {
+    std::vector<uint8_t> levels;
+    rasterize(key, &levels);
+    if (levels.empty()) {
+      _tiles.erase(key);
+    } else {
+      _tiles[key] = std::move(levels);
+    }
+    tiles.push_back(tileJson(key));
+  }
+  _dirty_tiles.clear();
+
+  json data;
+  data["cell_size"] = float(CELL_SIZE);
+  data["tile_cells"] = int(TILE_CELLS);
+  data["tiles"] = tiles;
+  return data;
+}
+
+nlohmann::json Lighting::toJson() const {
+  using nlohmann::json;
+  json j;
+  j["lights"] = json::array();
+  for (const Light &light : _lights) {
+    j["lights"].push_back(light.toJson());
+  }
+  j["cell_size"] = float(CELL_SIZE);
+  j["tile_cells"] = int(TILE_CELLS);
+  j["tiles"] = json::array();
+  for (const auto &tile : _tiles) {
+    j["tiles"].push_back(tileJson(tile.first));
+  }
+  return j;
+}
+
+void Lighting::write(BinaryWriter *writer) {
+  _lights.write(writer, [](BinaryWriter *w, const Light &light) {
+    w->write(light.position.x());
+    w->write(light.position.y());
+    w->write(light.radius);
+    w->write(light.token);
+  });
+}
+
+void Lighting::read(BinaryReader *reader) {
+  clear();
+  _lights.read(reader, [](BinaryReader *r, uint64_t id) {
+    Light light;
+    light.id = id;
+    float x = r->read<float>();
+    float y = r->read<float>();
+    light.position = Vector2f(x, y);
+    light.radius = r->read<float>();
+    light.token = r->read<uint64_t>();
+    light.is_stale = true;
+    return light;
+  });
+  _has_stale_lights = !_lights.empty();
+}
+
+uint64_t Lighting::tileKey(int32_t x, int32_t y) {
+  return (uint64_t(uint32_t(x)) << 32) | uint32_t(y);
+}
+
+Rect Lighting::influence(const Light &light) {
+  return Rect::around(light.position, light.radius, light.radius);
+}
+
+void Lighting::markTiles(const Rect &area) {
+  float tile_size = CELL_SIZE * TILE_CELLS;
+  int32_t min_x = std::floor(area.minX() / tile_size);
+  int32_t min_y = std::floor(area.minY() / tile_size);
+  int32_t max_x = std::floor(area.maxX() / tile_size);
+  int32_t max_y = std::floor(area.maxY() / tile_size);
+  for (int32_t y = min_y; y <= max_y; ++y) {
+    for (int32_t x = min_x; x <= max_x; ++x) {
+      _dirty_tiles.insert(tileKey(x, y));
+    }
+  }
+}
+
+void Lighting::rasterize(uint64_t key, std::vector<uint8_t> *levels) {
+  int32_t tile_x = int32_t(key >> 32);
+  int32_t tile_y = int32_t(key);
+  float tile_size = CELL_SIZE * TILE_CELLS;
+  float origin_x = tile_x * tile_size;
+  float origin_y = tile_y * tile_size;
+  Rect area(origin_x, origin_y, origin_x + tile_size, origin_y + tile_size);
+
+  std::vector<float> light(TILE_CELLS * TILE_CELLS, 0.0f);
+  bool is_lit = false;
+  for (uint64_t id : _index.query(area)) {
+    const Light *l = _lights.get(id);
+    if (l == nullptr) {
+      continue;
+    }
+    // Only visit the cells within the radius of the light
+    Rect lit = influence(*l);
+    int32_t min_x = std::max<int32_t>(
+        0, std::floor((lit.minX() - origin_x) / CELL_SIZE));
+    int32_t min_y = std::max<int32_t>(
+        0, std::floor((lit.minY() - origin_y) / CELL_SIZE));
+    int32_t max_x = std::min<int32_t>(
+        TILE_CELLS - 1, std::floor((lit.maxX() - origin_x) / CELL_SIZE));
+    int32_t max_y = std::min<int32_t>(
+        TILE_CELLS - 1, std::floor((lit.maxY() - origin_y) / CELL_SIZE));
+    for (int32_t y = min_y; y <= max_y; ++y) {
+      for (int32_t x = min_x; x <= max_x; ++x) {
+        Vector2f center(origin_x + (x + 0.5f) * CELL_SIZE,
+                        origin_y + (y + 0.5f) * CELL_SIZE);
+        float distance = std::hypot(center.x() - l->position.x(),
+                                    center.y() - l->position.y());
+        if (distance >= l->radius || !l->visible.contains(center)) {
+          continue;
+        }
+        // The light falls off linearly towards its radius
+        light[y * TILE_CELLS + x] += 1 - distance / l->radius;
+        is_lit = true;
+      }
+    }
+  }
+
+  levels->clear();
+  if (!is_lit) {
+    return;
+  }
+  levels->resize(light.size());
+  for (size_t i = 0; i < light.size(); ++i) {
+    (*levels)[i] = uint8_t(std::min(1.0f, light[i]) * 255);
+  }
+}
+
+nlohmann::json Lighting::tileJson(uint64_t key) const {
+  nlohmann::json j;
+  j["x"] = int32_t(key >> 32);
+  j["y"] = int32_t(key);
+  // A tile without levels is no longer lit
+  auto it = _tiles.find(key);
+  if (it == _tiles.end()) {
+    j["levels"] = "";
+  } else {
+    std::vector<char> encoded =
+        util::base64Encode(it->second.data(), it->second.size());
+    j["levels"] = std::string(encoded.begin(), encoded.end());
+  }
+  return j;
+}
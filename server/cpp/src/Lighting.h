@@ -0,0 +1,120 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "SlotMap.h"
+#include "building/BuildingManager.h"
+#include "geometry/Rect.h"
+#include "geometry/SpatialGrid.h"
+#include "geometry/Vector.h"
+
+/**
+ * @brief The light sources of a table and the light map they produce. The
+ *        light map is a grid of light levels split into square tiles. Only
+ *        the lights affected by a change are recomputed, and only the tiles
+ *        they touch are rasterized again.
+ */
+class Lighting {
+ public:
+  struct Light {
+    uint64_t id;
+    Vector2f position;
+    float radius;
+    // The token carrying the light or 0
+    uint64_t token;
+    // The area lit by the light, blocked by walls and closed doors
+    Visible visible;
+    bool is_stale;
+
+    nlohmann::json toJson() const;
+  };
+
+  Lighting();
+
+  /**
+   * @return The new light. The reference is invalidated by the next change
+   *         of the lights.
+   */
+  const Light &addLight(const Vector2f &position, float radius,
+                        uint64_t token);
+  bool removeLight(uint64_t id);
+  void clear();
+
+  /**
+   * @brief Moves all lights carried by the token along with it.
+   */
+  void moveToken(uint64_t token, const Vector2f &position);
+  /**
+   * @brief Removes all lights carried by the token.
+   * @return The ids of the removed lights.
+   */
+  std::vector<uint64_t> removeToken(uint64_t token);
+
+  /**
+   * @brief Marks all lights reaching into area as stale, e.g. because a wall
+   *        within area changed.
+   */
+  void invalidate(const Rect &area);
+
+  /**
+   * @brief Recomputes all stale lights and rasterizes the tiles they touched.
+   * @return The changed tiles as the data of a LightTiles packet, or null if
+   *         no tile changed.
+   */
+  nlohmann::json update(BuildingManager *building_manager);
+
+  /**
+   * @return All lights and tiles, as part of the Init packet.
+   */
+  nlohmann::json toJson() const;
+
+  /**
+   * @brief Writes the lights for a snapshot of the table. The light map is
+   *        not saved, it is computed again after reading.
+   */
+  void write(BinaryWriter *writer);
+  void read(BinaryReader *reader);
+
+ private:
+  static uint64_t tileKey(int32_t x, int32_t y);
+  static Rect influence(const Light &light);
+
+  void markTiles(const Rect &area);
+  void rasterize(uint64_t key, std::vector<uint8_t> *levels);
+  nlohmann::json tileJson(uint64_t key) const;
+
+  // The edge length of a light map cell in world units
+  static constexpr float CELL_SIZE = 0.5;
+  // The number of cells along each edge of a tile
+  static const int32_t TILE_CELLS = 32;
+  static constexpr float INDEX_CELL_SIZE = 16;
+
+  SlotMap<Light> _lights;
+  // The influence areas of the lights
+  SpatialGrid _index;
+  // The tiles with any light in them
+  std::unordered_map<uint64_t, std::vector<uint8_t>> _tiles;
+  // The tiles that need to be rasterized again
+  std::unordered_set<uint64_t> _dirty_tiles;
+  bool _has_stale_lights;
+};
@@ -1,11 +1,19 @@
 #include "Os.h"
 
+#include <cerrno>
+
 #ifndef WIN32
+#include <fcntl.h>
 #include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #else
 #include <Windows.h>
 #include <direct.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include < Pathcch.h >
 #endif
 
@@ -44,4 +52,111 @@ namespace os {
 #endif
 
 	}
+
+	bool makeDirectories(const std::string& path) {
+		size_t pos = 0;
+		while (pos != std::string::npos) {
+			pos = path.find_first_of("/\\", pos + 1);
+			std::string prefix = path.substr(0, pos);
+#ifndef WIN32
+			int result = ::mkdir(prefix.c_str(), 0755);
+#else
+			int result = _mkdir(prefix.c_str());
+#endif
+			if (result != 0 && errno != EEXIST) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool syncFile(std::FILE* file) {
+		if (std::fflush(file) != 0) {
+			return false;
+		}
+#ifndef WIN32
+		return ::fsync(fileno(file)) == 0;
+#else
+		return _commit(_fileno(file)) == 0;
+#endif
+	}
+
+	bool replaceFile(const std::string& from, const std::string& to) {
+#ifndef WIN32
+		return std::rename(from.c_str(), to.c_str()) == 0;
+#else
+		return MoveFileExA(from.c_str(), to.c_str(),
+		                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#endif
+	}
+
+	int64_t modificationTime(const std::string& path) {
+#ifndef WIN32
+		struct stat info;
+		if (::stat(path.c_str(), &info) != 0) {
+			return -1;
+		}
+		return int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#else
+		struct _stat64 info;
+		if (_stat64(path.c_str(), &info) != 0) {
+			return -1;
+		}
+		return int64_t(info.st_mtime) * 1000000000;
+#endif
+	}
+
+	MappedFile::MappedFile(const std::string& path)
+	    : _is_open(false), _data(nullptr), _size(0) {
+#ifndef WIN32
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		struct stat info;
+		if (::fstat(fd, &info) == 0) {
+			_is_open = true;
+			_size = info.st_size;
+			if (_size > 0) {
+				void* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data == MAP_FAILED) {
+					_is_open = false;
+					_size = 0;
+				} else {
+					_data = static_cast<const char*>(data);
+				}
+			}
+		}
+		// The mapping stays valid after the descriptor is closed
+		::close(fd);
+#else
+		std::FILE* file = std::fopen(path.c_str(), "rb");
+		if (file == nullptr) {
+			return;
+		}
+		char buffer[65536];
+		size_t read;
+		while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+			_buffer.append(buffer, read);
+		}
+		std::fclose(file);
+		_is_open = true;
+		_data = _buffer.data();
+		_size = _buffer.size();
+#endif
+	}
+
+	MappedFile::~MappedFile() {
+#ifndef WIN32
+		if (_data != nullptr) {
+			::munmap(const_cast<char*>(_data), _size);
+		}
+#endif
+	}
+
+	bool MappedFile::isOpen() const { return _is_open; }
+
+	const char* MappedFile::data() const { return _data; }
+
+	size_t MappedFile::size() const { return _size; }
 }
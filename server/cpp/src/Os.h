@@ -1,8 +1,62 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <string>
 
 namespace os {
 	std::string realpath(const std::string& relpath);
 	std::string getcwd();
-}
\ No newline at end of file
+
+	/**
+	 * @brief Creates the directory and all of its missing parents.
+	 * @return False if the directory does not exist afterwards.
+	 */
+	bool makeDirectories(const std::string& path);
+
+	/**
+	 * @brief Flushes the file and waits until its contents reached the disk.
+	 */
+	bool syncFile(std::FILE* file);
+
+	/**
+	 * @brief Replaces the file at to with the one at from. On posix systems
+	 *        readers see either the old or the new file, never a mix.
+	 */
+	bool replaceFile(const std::string& from, const std::string& to);
+
+	/**
+	 * @return The time the file was last modified in nanoseconds, or -1 if it
+	 *         does not exist.
+	 */
+	int64_t modificationTime(const std::string& path);
+
+	/**
+	 * @brief A file mapped into memory for reading.
+	 */
+	class MappedFile {
+	public:
+		/**
+		 * @brief Maps the file. A file that can not be opened is empty.
+		 */
+		explicit MappedFile(const std::string& path);
+		~MappedFile();
+
+		MappedFile(const MappedFile& other) = delete;
+		MappedFile& operator=(const MappedFile& other) = delete;
+
+		bool isOpen() const;
+		const char* data() const;
+		size_t size() const;
+
+	private:
+		bool _is_open;
+		const char* _data;
+		size_t _size;
+#ifdef WIN32
+		// Windows reads the whole file instead of mapping it
+		std::string _buffer;
+#endif
+	};
+}
@@ -18,15 +18,41 @@
 #include "Player.h"
 #include "Simulation.h"
 
-Packet::Packet(nlohmann::json json, Simulation *simulation)
-    : _json(json), _simulation(simulation) {}
+namespace {
+// The json of binary packets
+const nlohmann::json NO_JSON;
+}  // namespace
 
-const nlohmann::json &Packet::json() const { return _json; }
+Packet::Packet(const nlohmann::json &json, Simulation *simulation,
+               WebSocketServer::Connection *connection)
+    : _json(&json), _simulation(simulation), _connection(connection) {
+  auto uid_it = json.find("uid");
+  if (uid_it != json.end()) {
+    _uid = uid_it->get<std::string>();
+  }
+}
+
+Packet::Packet(Simulation *simulation, WebSocketServer::Connection *connection)
+    : _json(&NO_JSON),
+      _uid(connection->uid),
+      _simulation(simulation),
+      _connection(connection) {}
+
+Packet::Packet(Simulation *simulation, const std::string &uid)
+    : _json(&NO_JSON),
+      _uid(uid),
+      _simulation(simulation),
+      _connection(nullptr) {}
+
+const nlohmann::json &Packet::json() const { return *_json; }
+
+const std::string &Packet::uid() const { return _uid; }
+
+WebSocketServer::Connection *Packet::connection() const { return _connection; }
 
 bool Packet::checkPermissions(Permissions min_perm) const {
-  if (_json.contains("uid")) {
-    std::string uid = json().at("uid");
-    Player *p = _simulation->getPlayer(uid);
+  if (!_uid.empty()) {
+    Player *p = _simulation->getPlayer(_uid);
     if (p != nullptr) {
       return p->permissions == min_perm;
     }
@@ -25,15 +25,38 @@ class Simulation;
 class Packet {
 public:
 
-  Packet(nlohmann::json json, Simulation *simulation);
+  /**
+   * @param json The parsed message. It is not copied and has to outlive the
+   *             packet.
+   * @param connection The connection the packet was received on. May be null.
+   */
+  Packet(const nlohmann::json &json, Simulation *simulation,
+         WebSocketServer::Connection *connection);
+
+  /**
+   * @brief Creates a packet for a binary message received on the connection.
+   *        The json of the packet is null, the uid is the one the connection
+   *        initialized its session with.
+   */
+  Packet(Simulation *simulation, WebSocketServer::Connection *connection);
+
+  /**
+   * @brief Creates a packet for a binary message sent by the player with the
+   *        uid, which is replayed without a connection.
+   */
+  Packet(Simulation *simulation, const std::string &uid);
 
   const nlohmann::json &json() const;
+  const std::string &uid() const;
+  WebSocketServer::Connection *connection() const;
 
 
   WebSocketServer::Response makeMissingPermissionsResponse() const;
   bool checkPermissions(Permissions min_perm) const;
 
 private:
-  nlohmann::json _json;
+  const nlohmann::json *_json;
+  std::string _uid;
   Simulation *_simulation;
+  WebSocketServer::Connection *_connection;
 };
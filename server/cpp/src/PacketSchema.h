@@ -0,0 +1,378 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "BinaryStream.h"
+#include "geometry/Vector.h"
+
+/**
+ * The schema of the packets sent by the clients. Every packet with a fixed
+ * layout is described once by its list of fields, from which a struct with
+ * json and binary codecs is generated. Packets whose data is free form
+ * (e.g. LoadBuilding) are listed as untyped and handled on the raw json.
+ *
+ * The order of the fields is the order of the binary encoding.
+ *
+ * Records are structs with the same codecs that are not packets on their
+ * own, but can be used as fields, e.g. in a std::vector.
+ */
+
+// FIELD(type, name)
+#define PACKET_FIELDS_EMPTY(FIELD)
+#define PACKET_FIELDS_ID(FIELD) FIELD(uint64_t, id)
+#define PACKET_FIELDS_CREATE_TOKEN(FIELD) FIELD(float, x) FIELD(float, y)
+#define PACKET_FIELDS_MOVE_TOKEN(FIELD) \
+  FIELD(uint64_t, id)                   \
+  FIELD(float, x)                       \
+  FIELD(float, y)                       \
+  FIELD(float, rotation)
+#define PACKET_FIELDS_CREATE_TOKENS(FIELD) \
+  FIELD(std::vector<Vector2f>, positions)
+#define PACKET_FIELDS_MOVE_TOKENS(FIELD) FIELD(std::vector<TokenMove>, moves)
+#define PACKET_FIELDS_DELETE_TOKENS(FIELD) FIELD(std::vector<uint64_t>, ids)
+#define PACKET_FIELDS_CREATE_DOODAD_LINE(FIELD) \
+  FIELD(float, sx) FIELD(float, sy) FIELD(float, ex) FIELD(float, ey)
+// stroke is chosen by the client to tell apart the strokes it is drawing,
+// points are x and y coordinates one after the other.
+#define PACKET_FIELDS_STROKE_POINTS(FIELD) \
+  FIELD(uint64_t, stroke) FIELD(std::vector<float>, points)
+#define PACKET_FIELDS_END_STROKE(FIELD) FIELD(uint64_t, stroke)
+#define PACKET_FIELDS_SET_USERNAME(FIELD) FIELD(std::string, name)
+#define PACKET_FIELDS_SET_VIEWPORT(FIELD) \
+  FIELD(float, min_x) FIELD(float, min_y) FIELD(float, max_x) FIELD(float, max_y)
+#define PACKET_FIELDS_CREATE_LIGHT(FIELD) \
+  FIELD(Vector2f, position) FIELD(float, radius) FIELD(uint64_t, token)
+#define PACKET_FIELDS_QUERY_MOVEMENT(FIELD) \
+  FIELD(uint64_t, id) FIELD(float, budget) FIELD(Vector2f, target)
+// A template for an area of effect. The circle is centered at origin and
+// reaches target. The cone has its tip at origin, points at target and opens
+// by angle radians. The line runs from origin to target and is width wide.
+// The rectangle is spanned by origin and target.
+#define PACKET_FIELDS_AREA_SHAPE(FIELD) \
+  FIELD(std::string, shape)             \
+  FIELD(Vector2f, origin)               \
+  FIELD(Vector2f, target)               \
+  FIELD(float, angle)                   \
+  FIELD(float, width)
+// filter is one of "all", "enemies" or "friends". With occlusion only tokens
+// that can be seen from the origin of an area are inside of it.
+#define PACKET_FIELDS_QUERY_AREAS(FIELD) \
+  FIELD(uint64_t, query)                 \
+  FIELD(std::vector<AreaShape>, areas)   \
+  FIELD(std::string, filter)             \
+  FIELD(bool, occlusion)
+#define PACKET_FIELDS_SET_DOOR_OPEN(FIELD) FIELD(uint64_t, id) FIELD(bool, open)
+#define PACKET_FIELDS_CREATE_ROOM(FIELD) \
+  FIELD(Vector2f, position) FIELD(Vector2f, size)
+#define PACKET_FIELDS_CREATE_WALL(FIELD) \
+  FIELD(Vector2f, start) FIELD(Vector2f, end)
+#define PACKET_FIELDS_CREATE_DOOR(FIELD) \
+  FIELD(Vector2f, position) FIELD(float, width) FIELD(float, rotation)
+#define PACKET_FIELDS_CREATE_FURNITURE(FIELD) \
+  FIELD(Vector2f, position) FIELD(Vector2f, size) FIELD(float, rotation)
+#define PACKET_FIELDS_MODIFY_ROOM(FIELD) \
+  FIELD(uint64_t, id)                    \
+  FIELD(Vector2f, position)              \
+  FIELD(Vector2f, size)                  \
+  FIELD(bool, is_visible)
+#define PACKET_FIELDS_MODIFY_WALL(FIELD) \
+  FIELD(uint64_t, id)                    \
+  FIELD(Vector2f, start)                 \
+  FIELD(Vector2f, end)                   \
+  FIELD(bool, is_visible)
+#define PACKET_FIELDS_MODIFY_DOOR(FIELD) \
+  FIELD(uint64_t, id)                    \
+  FIELD(Vector2f, position)              \
+  FIELD(float, width)                    \
+  FIELD(float, rotation)                 \
+  FIELD(bool, is_open)                   \
+  FIELD(bool, is_visible)
+#define PACKET_FIELDS_MODIFY_FURNITURE(FIELD) \
+  FIELD(uint64_t, id)                         \
+  FIELD(Vector2f, position)                   \
+  FIELD(Vector2f, size)                       \
+  FIELD(float, rotation)                      \
+  FIELD(bool, is_visible)
+
+// The records used as fields of packets.
+// RECORD(Name, FIELDS)
+#define PACKET_RECORDS(RECORD)                  \
+  RECORD(TokenMove, PACKET_FIELDS_MOVE_TOKEN) \
+  RECORD(AreaShape, PACKET_FIELDS_AREA_SHAPE)
+
+// The packets handled by the Simulation.
+// TYPED(Name, FIELDS) UNTYPED(Name)
+#define SIMULATION_PACKETS(TYPED, UNTYPED)                 \
+  TYPED(CreateToken, PACKET_FIELDS_CREATE_TOKEN)           \
+  TYPED(MoveToken, PACKET_FIELDS_MOVE_TOKEN)               \
+  TYPED(DeleteToken, PACKET_FIELDS_ID)                     \
+  TYPED(CreateTokens, PACKET_FIELDS_CREATE_TOKENS)         \
+  TYPED(MoveTokens, PACKET_FIELDS_MOVE_TOKENS)             \
+  TYPED(DeleteTokens, PACKET_FIELDS_DELETE_TOKENS)         \
+  TYPED(ClearTokens, PACKET_FIELDS_EMPTY)                  \
+  TYPED(TokenToggleFoe, PACKET_FIELDS_ID)                  \
+  TYPED(CreateDoodadLine, PACKET_FIELDS_CREATE_DOODAD_LINE) \
+  TYPED(BeginStroke, PACKET_FIELDS_STROKE_POINTS)          \
+  TYPED(AppendStroke, PACKET_FIELDS_STROKE_POINTS)         \
+  TYPED(EndStroke, PACKET_FIELDS_END_STROKE)               \
+  TYPED(ClearDoodads, PACKET_FIELDS_EMPTY)                 \
+  TYPED(SetUsername, PACKET_FIELDS_SET_USERNAME)           \
+  TYPED(SetViewport, PACKET_FIELDS_SET_VIEWPORT)           \
+  TYPED(CreateLight, PACKET_FIELDS_CREATE_LIGHT)           \
+  TYPED(DeleteLight, PACKET_FIELDS_ID)                     \
+  TYPED(ClearLights, PACKET_FIELDS_EMPTY)                  \
+  TYPED(QueryMovement, PACKET_FIELDS_QUERY_MOVEMENT)       \
+  TYPED(QueryAreas, PACKET_FIELDS_QUERY_AREAS)             \
+  UNTYPED(Chat)                                            \
+  UNTYPED(InitSession)
+
+// The packets handled by the BuildingManager.
+#define BUILDING_PACKETS(TYPED, UNTYPED)                 \
+  TYPED(SetDoorOpen, PACKET_FIELDS_SET_DOOR_OPEN)        \
+  TYPED(CreateRoom, PACKET_FIELDS_CREATE_ROOM)           \
+  TYPED(CreateWall, PACKET_FIELDS_CREATE_WALL)           \
+  TYPED(CreateDoor, PACKET_FIELDS_CREATE_DOOR)           \
+  TYPED(CreateFurniture, PACKET_FIELDS_CREATE_FURNITURE) \
+  TYPED(ModifyRoom, PACKET_FIELDS_MODIFY_ROOM)           \
+  TYPED(ModifyWall, PACKET_FIELDS_MODIFY_WALL)           \
+  TYPED(ModifyDoor, PACKET_FIELDS_MODIFY_DOOR)           \
+  TYPED(ModifyFurniture, PACKET_FIELDS_MODIFY_FURNITURE) \
+  TYPED(DeleteRoom, PACKET_FIELDS_ID)                    \
+  TYPED(DeleteWall, PACKET_FIELDS_ID)                    \
+  TYPED(DeleteDoor, PACKET_FIELDS_ID)                    \
+  TYPED(DeleteFurniture, PACKET_FIELDS_ID)               \
+  UNTYPED(ClearBuilding)                                 \
+  UNTYPED(LoadBuilding)
+
+#define ALL_PACKETS(TYPED, UNTYPED) \
+  SIMULATION_PACKETS(TYPED, UNTYPED) BUILDING_PACKETS(TYPED, UNTYPED)
+
+namespace packets {
+
+/**
+ * @brief Converts a single field between its c++, json and binary form.
+ *        minBytes is the smallest size of a field's binary encoding.
+ */
+template <typename T>
+struct FieldCodec {
+  static constexpr size_t minBytes() { return sizeof(T); }
+  static T fromJson(const nlohmann::json &j) { return j.get<T>(); }
+  static nlohmann::json toJson(const T &v) { return v; }
+  static T read(BinaryReader *reader) { return reader->read<T>(); }
+  static void write(const T &v, BinaryWriter *writer) { writer->write(v); }
+};
+
+template <>
+struct FieldCodec<bool> {
+  static constexpr size_t minBytes() { return 1; }
+  static bool fromJson(const nlohmann::json &j) { return j.get<bool>(); }
+  static nlohmann::json toJson(bool v) { return v; }
+  static bool read(BinaryReader *reader) {
+    return reader->read<uint8_t>() != 0;
+  }
+  static void write(bool v, BinaryWriter *writer) {
+    writer->write(uint8_t(v ? 1 : 0));
+  }
+};
+
+template <>
+struct FieldCodec<Vector2f> {
+  static constexpr size_t minBytes() { return 2 * sizeof(float); }
+  static Vector2f fromJson(const nlohmann::json &j) {
+    return Vector2f::fromJson(j);
+  }
+  static nlohmann::json toJson(const Vector2f &v) { return v.toJson(); }
+  static Vector2f read(BinaryReader *reader) {
+    float x = reader->read<float>();
+    float y = reader->read<float>();
+    return Vector2f(x, y);
+  }
+  static void write(const Vector2f &v, BinaryWriter *writer) {
+    writer->write(v.x());
+    writer->write(v.y());
+  }
+};
+
+template <>
+struct FieldCodec<std::string> {
+  static constexpr size_t minBytes() { return sizeof(uint32_t); }
+  static std::string fromJson(const nlohmann::json &j) {
+    return j.get<std::string>();
+  }
+  static nlohmann::json toJson(const std::string &v) { return v; }
+  static std::string read(BinaryReader *reader) {
+    return reader->readString();
+  }
+  static void write(const std::string &v, BinaryWriter *writer) {
+    writer->write(uint32_t(v.size()));
+    writer->writeBytes(v.data(), v.size());
+  }
+};
+
+template <typename T>
+struct FieldCodec<std::vector<T>> {
+  static constexpr size_t minBytes() { return sizeof(uint32_t); }
+  static std::vector<T> fromJson(const nlohmann::json &j) {
+    std::vector<T> v;
+    for (const nlohmann::json &e : j) {
+      v.push_back(FieldCodec<T>::fromJson(e));
+    }
+    return v;
+  }
+  static nlohmann::json toJson(const std::vector<T> &v) {
+    nlohmann::json j = nlohmann::json::array();
+    for (const T &e : v) {
+      j.push_back(FieldCodec<T>::toJson(e));
+    }
+    return j;
+  }
+  static std::vector<T> read(BinaryReader *reader) {
+    uint32_t size = reader->read<uint32_t>();
+    // The size is sent by the client. Nothing is allocated for elements that
+    // could not be in the remaining data.
+    size_t min_bytes = FieldCodec<T>::minBytes();
+    if (min_bytes > 0 && size > reader->remaining() / min_bytes) {
+      throw std::out_of_range("Unexpected end of a binary packet.");
+    }
+    std::vector<T> v;
+    v.reserve(size);
+    for (uint32_t i = 0; i < size; ++i) {
+      v.push_back(FieldCodec<T>::read(reader));
+    }
+    return v;
+  }
+  static void write(const std::vector<T> &v, BinaryWriter *writer) {
+    writer->write(uint32_t(v.size()));
+    for (const T &e : v) {
+      FieldCodec<T>::write(e, writer);
+    }
+  }
+};
+
+/**
+ * @brief Converts records using their generated codecs.
+ */
+template <typename T>
+struct RecordCodec {
+  static constexpr size_t minBytes() { return T::minBinaryBytes(); }
+  static T fromJson(const nlohmann::json &j) { return T::fromJson(j); }
+  static nlohmann::json toJson(const T &v) { return v.toJson(); }
+  static T read(BinaryReader *reader) { return T::fromBinary(reader); }
+  static void write(const T &v, BinaryWriter *writer) { v.toBinary(writer); }
+};
+
+#define PACKET_DECLARE_FIELD(type, name) type name;
+#define PACKET_FROM_JSON_FIELD(type, name) \
+  p.name = FieldCodec<type>::fromJson(data.at(#name));
+#define PACKET_TO_JSON_FIELD(type, name) \
+  data[#name] = FieldCodec<type>::toJson(name);
+#define PACKET_READ_FIELD(type, name) p.name = FieldCodec<type>::read(reader);
+#define PACKET_WRITE_FIELD(type, name) FieldCodec<type>::write(name, writer);
+#define PACKET_MIN_BYTES_FIELD(type, name) +FieldCodec<type>::minBytes()
+
+#define PACKET_DEFINE_STRUCT(Name, FIELDS)                      \
+  struct Name {                                                 \
+    FIELDS(PACKET_DECLARE_FIELD)                                \
+                                                                \
+    static const char *typeName() { return #Name; }            \
+                                                                \
+    /* @throws if a field is missing or has the wrong type */   \
+    static Name fromJson(const nlohmann::json &data) {          \
+      (void)data;                                               \
+      Name p;                                                   \
+      FIELDS(PACKET_FROM_JSON_FIELD)                            \
+      return p;                                                 \
+    }                                                           \
+                                                                \
+    nlohmann::json toJson() const {                             \
+      nlohmann::json data = nlohmann::json::object();           \
+      FIELDS(PACKET_TO_JSON_FIELD)                              \
+      return data;                                              \
+    }                                                           \
+                                                                \
+    static constexpr size_t minBinaryBytes() {                  \
+      return 0 FIELDS(PACKET_MIN_BYTES_FIELD);                  \
+    }                                                           \
+                                                                \
+    /* @throws std::out_of_range if the data ends prematurely */ \
+    static Name fromBinary(BinaryReader *reader) {              \
+      (void)reader;                                             \
+      Name p;                                                   \
+      FIELDS(PACKET_READ_FIELD)                                 \
+      return p;                                                 \
+    }                                                           \
+                                                                \
+    void toBinary(BinaryWriter *writer) const {                 \
+      (void)writer;                                             \
+      FIELDS(PACKET_WRITE_FIELD)                                \
+    }                                                           \
+  };
+#define PACKET_SKIP_UNTYPED(Name)
+#define PACKET_DEFINE_RECORD(Name, FIELDS) \
+  PACKET_DEFINE_STRUCT(Name, FIELDS)       \
+  template <>                              \
+  struct FieldCodec<Name> : RecordCodec<Name> {};
+
+PACKET_RECORDS(PACKET_DEFINE_RECORD)
+ALL_PACKETS(PACKET_DEFINE_STRUCT, PACKET_SKIP_UNTYPED)
+
+#define PACKET_ENUM_TYPED(Name, FIELDS) Name,
+#define PACKET_ENUM_UNTYPED(Name) Name,
+
+/**
+ * @brief Identifies every packet a client may send.
+ */
+enum class Id { ALL_PACKETS(PACKET_ENUM_TYPED, PACKET_ENUM_UNTYPED) UNKNOWN };
+
+#define PACKET_NAME_TYPED(Name, FIELDS) {#Name, Id::Name},
+#define PACKET_NAME_UNTYPED(Name) {#Name, Id::Name},
+
+/**
+ * @return The id of the packet with the given type name or Id::UNKNOWN
+ */
+inline Id idFromName(const std::string &name) {
+  static const std::unordered_map<std::string, Id> ids = {
+      ALL_PACKETS(PACKET_NAME_TYPED, PACKET_NAME_UNTYPED)};
+  auto it = ids.find(name);
+  if (it == ids.end()) {
+    return Id::UNKNOWN;
+  }
+  return it->second;
+}
+
+#undef PACKET_NAME_TYPED
+#undef PACKET_NAME_UNTYPED
+#undef PACKET_ENUM_TYPED
+#undef PACKET_ENUM_UNTYPED
+#undef PACKET_SKIP_UNTYPED
+#undef PACKET_DEFINE_RECORD
+#undef PACKET_DEFINE_STRUCT
+#undef PACKET_DECLARE_FIELD
+#undef PACKET_FROM_JSON_FIELD
+#undef PACKET_TO_JSON_FIELD
+#undef PACKET_READ_FIELD
+#undef PACKET_WRITE_FIELD
+#undef PACKET_MIN_BYTES_FIELD
+
+}  // namespace packets
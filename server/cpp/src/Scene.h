@@ -0,0 +1,96 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Doodad.h"
+#include "SlotMap.h"
+#include "Token.h"
+#include "building/Building.h"
+
+/**
+ * @brief An immutable copy of one part of the scene, e.g. all tokens. A
+ *        version can be read from any thread while the part it was copied
+ *        from keeps changing on the table's thread.
+ */
+template <typename T>
+class Version {
+ public:
+  explicit Version(const T &state) : _state(state) {}
+
+  Version(const Version &other) = delete;
+  Version &operator=(const Version &other) = delete;
+
+  const T &state() const { return _state; }
+
+  /**
+   * @param serialize A callable taking the state and returning its serialized
+   *                  form. Only called by the first caller, later callers
+   *                  share the result. Safe to call from any thread.
+   */
+  template <typename F>
+  const std::string &serialized(F serialize) const {
+    std::call_once(_serialized_once, [&]() { _text = serialize(_state); });
+    return _text;
+  }
+
+ private:
+  const T _state;
+  mutable std::once_flag _serialized_once;
+  mutable std::string _text;
+};
+
+/**
+ * @brief Hands out the current version of one part of the scene. A new copy
+ *        is only made if the part was invalidated since the last one, all
+ *        readers in between share the same version.
+ */
+template <typename T>
+class VersionedSection {
+ public:
+  VersionedSection() : _is_dirty(true) {}
+
+  void invalidate() { _is_dirty = true; }
+
+  /**
+   * @param state The current state of the part, copied if it changed.
+   */
+  std::shared_ptr<const Version<T>> current(const T &state) {
+    if (_is_dirty || !_version) {
+      _version = std::make_shared<const Version<T>>(state);
+      _is_dirty = false;
+    }
+    return _version;
+  }
+
+ private:
+  bool _is_dirty;
+  std::shared_ptr<const Version<T>> _version;
+};
+
+/**
+ * @brief A consistent view of the tokens, strokes and building of a table at
+ *        one point in time. The parts that did not change are shared with
+ *        earlier views.
+ */
+struct Scene {
+  std::shared_ptr<const Version<SlotMap<Token>>> tokens;
+  std::shared_ptr<const Version<SlotMap<Stroke>>> strokes;
+  std::shared_ptr<const Version<Building>> building;
+};
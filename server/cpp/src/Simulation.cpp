@@ -20,9 +20,56 @@
 #include <cstdlib>
 
 #include "Simulation.h"
+#include <chrono>
 #include <unordered_map>
 
+#include "Area.h"
+#include "BinaryProtocol.h"
 #include "Logger.h"
+#include "Util.h"
+
+namespace {
+// The kind of an element is part of its key in the spatial index
+enum class IndexKind : uint64_t { TOKEN = 1, DOODAD = 2 };
+
+uint64_t indexKey(IndexKind kind, uint64_t id) {
+  return (uint64_t(kind) << 56) | id;
+}
+
+IndexKind indexKind(uint64_t key) { return IndexKind(key >> 56); }
+
+uint64_t indexId(uint64_t key) { return key & ((uint64_t(1) << 56) - 1); }
+
+Rect boundsOf(Token &t) {
+  return Rect::around(Vector2f(t.x(), t.y()), t.radius(), t.radius());
+}
+
+// The messages in the journal are saved as they were received
+enum class RecordKind : uint8_t { JSON = 1, BINARY = 2, DISCONNECT = 3 };
+
+std::string encodeRecord(RecordKind kind, const std::string &uid,
+                         const std::string &msg) {
+  BinaryWriter writer;
+  writer.write(uint8_t(kind));
+  writer.writeString(uid);
+  writer.writeString(msg);
+  return std::move(writer.data());
+}
+
+// Whether a handled message has to be replayed to restore the state of the
+// table. Rejected messages and queries are answered with RETURN and change
+// nothing. Sessions are saved to restore the players.
+bool changesState(packets::Id id, const WebSocketServer::Response &r) {
+  if (id == packets::Id::InitSession) {
+    return true;
+  }
+  if (id == packets::Id::SetViewport) {
+    return false;
+  }
+  return r.type != WebSocketServer::ResponseType::RETURN;
+}
+
+}  // namespace
 
 const Simulation::Color Simulation::COLORS[Simulation::NUM_COLORS] = {
     {240, 50, 50},   // red
@@ -38,76 +85,442 @@ const Simulation::Color Simulation::COLORS[Simulation::NUM_COLORS] = {
     {201, 201, 30}   // yellow
 };
 
-Simulation::Simulation()
-    : _next_color(0),
-      _building_manager(&_id_generator),
-      web_socket_server_(nullptr) {
+Simulation::Simulation(const std::string &table)
+    : _table(table),
+      _next_color(0),
+      _index(INDEX_CELL_SIZE),
+      _table_queue(nullptr),
+      _serializer(nullptr),
+      _deltas(MAX_DELTA_ENTRIES, MAX_DELTA_BYTES),
+      _records_since_snapshot(0),
+      web_socket_server_(nullptr),
+      _building_manager(&_id_generator) {
   _rand_seed = time(NULL);
-  using std::placeholders::_1;
-  _msg_handlers = {
-      {"CreateToken", std::bind(&Simulation::onCreateToken, this, _1)},
-      {"MoveToken", std::bind(&Simulation::onMoveToken, this, _1)},
-      {"DeleteToken", std::bind(&Simulation::onDeleteToken, this, _1)},
-      {"Chat", std::bind(&Simulation::onChat, this, _1)},
-      {"CreateDoodadLine",
-       std::bind(&Simulation::onCreateDoodadLine, this, _1)},
-      {"ClearDoodads", std::bind(&Simulation::onClearDoodads, this, _1)},
-      {"ClearTokens", std::bind(&Simulation::onClearTokens, this, _1)},
-      {"TokenToggleFoe", std::bind(&Simulation::onTokenToggleFoe, this, _1)},
-      {"InitSession", std::bind(&Simulation::onInitSession, this, _1)},
-      {"SetUsername", std::bind(&Simulation::onSetUsername, this, _1)}};
-  _building_manager.registerPackets(&_msg_handlers);
 }
 
 void Simulation::setWebSocketServer(WebSocketServer *wss) {
   web_socket_server_ = wss;
 }
 
-Token *Simulation::tokenById(uint64_t id) {
-  for (Token &t : _tokens) {
-    if (t.id() == id) {
-      return &t;
+void Simulation::setExecutors(WorkQueue *table_queue, WorkQueue *serializer) {
+  std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
+  _table_queue = table_queue;
+  _serializer = serializer;
+}
+
+void Simulation::open(const std::string &directory) {
+  std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
+  auto start = std::chrono::steady_clock::now();
+  _journal = std::make_unique<Journal>(directory);
+  std::string snapshot;
+  std::vector<std::string> records;
+  if (_journal->load(&snapshot, &records)) {
+    try {
+      readSnapshot(snapshot);
+    } catch (const std::exception &e) {
+      // Saving the empty table would overwrite the saved state
+      LOG_ERROR << "Unable to restore the table '" << _table
+                << "', it will not be saved: " << e.what() << LOG_END;
+      _journal.reset();
+      return;
     }
   }
-  return nullptr;
+  // Nothing is sent to the clients while the state is restored
+  WebSocketServer *web_socket_server = web_socket_server_;
+  web_socket_server_ = nullptr;
+  for (const std::string &record : records) {
+    replay(record);
+  }
+  web_socket_server_ = web_socket_server;
+  // Clients receive the restored state with their Init packet
+  _moved_tokens.clear();
+  _moved_from.clear();
+  _changed_strokes.clear();
+  _sent_strokes.clear();
+  if (!records.empty()) {
+    // The next start does not have to replay the records again
+    _journal->snapshot(prepareSnapshot());
+  }
+  LOG_INFO << "Restored the table '" << _table << "' with " << _tokens.size()
+           << " tokens and " << _strokes.size() << " strokes, replaying "
+           << records.size() << " messages, in "
+           << std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count()
+           << "ms" << LOG_END;
 }
 
-WebSocketServer::Response Simulation::onNewClient() {
+bool Simulation::isPersistent() {
   std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
+  return _journal != nullptr;
+}
 
+void Simulation::replay(const std::string &record) {
   using nlohmann::json;
-  std::string answer_str;
   try {
-    // Assemble an init package
-    json answer;
-    answer["type"] = "Init";
-    json data;
+    BinaryReader reader(record);
+    RecordKind kind = RecordKind(reader.read<uint8_t>());
+    std::string uid = reader.readString();
+    std::string msg = reader.readString();
+    if (kind == RecordKind::BINARY) {
+      BinaryReader packet_reader(msg);
+      binary::PacketType type =
+          binary::PacketType(packet_reader.read<uint8_t>());
+      dispatchBinary(type, Packet(this, uid), &packet_reader);
+      return;
+    }
+    if (kind == RecordKind::DISCONNECT) {
+      endStrokes(uid);
+      return;
+    }
+    json j = json::parse(msg);
+    packets::Id id =
+        packets::idFromName(j.at("type").get_ref<const std::string &>());
+    if (id == packets::Id::InitSession) {
+      // The session itself ended with the restart, only the player remains
+      std::string player_uid = j.at("data").at("uid");
+      if (getPlayer(player_uid) == nullptr) {
+        addPlayer(player_uid);
+      }
+      return;
+    }
+    static const json EMPTY_DATA;
+    auto data_it = j.find("data");
+    dispatch(id, Packet(j, this, nullptr),
+             data_it != j.end() ? *data_it : EMPTY_DATA);
+  } catch (const std::exception &e) {
+    LOG_ERROR << "Unable to replay a message of the table '" << _table
+              << "': " << e.what() << LOG_END;
+  }
+}
+
+std::function<std::string()> Simulation::prepareSnapshot() {
+  // The tokens, strokes and building are written from their immutable
+  // versions, everything else is small enough to be written right away.
+  BinaryWriter head;
+  head.write(SNAPSHOT_VERSION);
+  head.write(_id_generator.highWaterMark());
+  head.write(uint32_t(_next_color));
+  head.writeString(tiles_path_);
 
-    std::vector<json> _encoded_tokens;
-    for (Token &t : _tokens) {
-      _encoded_tokens.emplace_back(t.serialize());
+  head.write(uint32_t(_players.size()));
+  for (const Player &p : _players) {
+    head.writeString(p.uid);
+    head.writeString(p.name);
+    head.write(uint8_t(p.permissions));
+    head.write(uint32_t(p.attributes.size()));
+    for (const auto &attribute : p.attributes) {
+      head.writeString(attribute.first);
+      head.write(attribute.second);
     }
-    data["tokens"] = _encoded_tokens;
+  }
+
+  BinaryWriter middle;
+  middle.write(uint32_t(_open_strokes.size()));
+  for (const auto &open : _open_strokes) {
+    middle.writeString(open.first.first);
+    middle.write(open.first.second);
+    middle.write(open.second);
+  }
+  _lighting.write(&middle);
+
+  Scene scene = captureScene();
+  std::string head_data = std::move(head.data());
+  std::string middle_data = std::move(middle.data());
+  return [scene, head_data, middle_data]() {
+    BinaryWriter writer;
+    writer.writeBytes(head_data.data(), head_data.size());
+    scene.tokens->state().write(&writer, [](BinaryWriter *w, Token t) {
+      w->write(t.x());
+      w->write(t.y());
+      w->write(t.radius());
+      w->write(t.r());
+      w->write(t.g());
+      w->write(t.b());
+      w->write(t.rotation());
+      w->write(uint8_t(t.is_enemy()));
+    });
+    scene.strokes->state().write(&writer, [](BinaryWriter *w, const Stroke &s) {
+      s.writeBinary(w);
+      w->write(uint8_t(s.isCompacted()));
+    });
+    writer.writeBytes(middle_data.data(), middle_data.size());
+    scene.building->state().write(&writer);
+    return std::move(writer.data());
+  };
+}
 
-    std::vector<json> _encoded_doodads;
-    for (DoodadLine &d : _doodad_lines) {
-      _encoded_doodads.emplace_back(d.serialize());
+void Simulation::readSnapshot(const std::string &snapshot) {
+  BinaryReader reader(snapshot);
+  uint32_t version = reader.read<uint32_t>();
+  if (version == 0 || version > SNAPSHOT_VERSION) {
+    throw std::runtime_error("The snapshot has an unknown version.");
+  }
+  // The first snapshots did not save the ids handed out, reading the building
+  // raises the mark above its id either way.
+  if (version >= 2) {
+    _id_generator.restore(reader.read<uint64_t>());
+  }
+  _next_color = reader.read<uint32_t>() % NUM_COLORS;
+  tiles_path_ = reader.readString();
+
+  _players.clear();
+  _player_ids.clear();
+  uint32_t num_players = reader.read<uint32_t>();
+  for (uint32_t i = 0; i < num_players; ++i) {
+    Player &p = addPlayer(reader.readString());
+    p.name = reader.readString();
+    p.permissions = Permissions(reader.read<uint8_t>());
+    uint32_t num_attributes = reader.read<uint32_t>();
+    for (uint32_t a = 0; a < num_attributes; ++a) {
+      std::string name = reader.readString();
+      p.attributes[name] = reader.read<double>();
     }
-    data["doodads"] = _encoded_doodads;
+  }
+
+  _index.clear();
+  _tokens.read(&reader, [](BinaryReader *r, uint64_t id) {
+    Token t;
+    t.id() = id;
+    t.x() = r->read<float>();
+    t.y() = r->read<float>();
+    t.radius() = r->read<float>();
+    t.r() = r->read<float>();
+    t.g() = r->read<float>();
+    t.b() = r->read<float>();
+    t.rotation() = r->read<float>();
+    t.is_enemy() = r->read<uint8_t>() != 0;
+    return t;
+  });
+  for (Token &t : _tokens) {
+    _index.insert(indexKey(IndexKind::TOKEN, t.id()), boundsOf(t));
+    invalidateVisibility(t.id());
+  }
 
-    data["building"] = _building_manager.toJson();
+  _uncompacted_strokes.clear();
+  _strokes.read(&reader, [this](BinaryReader *r, uint64_t id) {
+    Stroke s = Stroke::fromBinary(r);
+    s.id() = id;
+    bool is_compacted = r->read<uint8_t>() != 0;
+    if (s.isComplete() && !is_compacted) {
+      _uncompacted_strokes.push_back(id);
+    }
+    return s;
+  });
+  for (Stroke &s : _strokes) {
+    _index.insert(indexKey(IndexKind::DOODAD, s.id()), s.bounds());
+  }
+  _open_strokes.clear();
+  uint32_t num_open = reader.read<uint32_t>();
+  for (uint32_t i = 0; i < num_open; ++i) {
+    std::string uid = reader.readString();
+    uint64_t number = reader.read<uint64_t>();
+    _open_strokes[std::make_pair(uid, number)] = reader.read<uint64_t>();
+  }
 
-    data["nextColor"] = _next_color;
+  _lighting.read(&reader);
+  _building_manager.read(&reader);
 
-    data["tiles"] = tiles_path_;
-    answer["data"] = data;
-    answer_str = answer.dump();
-  } catch (const std::exception &e) {
-    LOG_ERROR << "Unable to assemble an init packet for the new client: "
-              << e.what() << LOG_END;
+  _tokens_cache.invalidate();
+  _doodads_cache.invalidate();
+  _tiles_cache.invalidate();
+  _lighting_cache.invalidate();
+}
+
+Token *Simulation::tokenById(uint64_t id) { return _tokens.get(id); }
+
+Scene Simulation::captureScene() {
+  Scene scene;
+  scene.tokens = _tokens_cache.current(_tokens);
+  scene.strokes = _doodads_cache.current(_strokes);
+  scene.building = _building_manager.version();
+  return scene;
+}
+
+Simulation::InitState Simulation::captureInit() {
+  using nlohmann::json;
+  InitState state;
+  state.scene = captureScene();
+  state.tiles = _tiles_cache.get([this]() { return json(tiles_path_).dump(); });
+  state.lighting =
+      _lighting_cache.get([this]() { return _lighting.toJson().dump(); });
+  state.next_color = _next_color;
+  state.epoch = _deltas.epoch();
+  state.seq = _deltas.lastSequence();
+  return state;
+}
+
+std::string Simulation::encodeInit(const InitState &state) {
+  using nlohmann::json;
+  // The sections are already serialized json, so the packet is assembled
+  // from the strings directly instead of building a json document.
+  const std::string &tokens =
+      state.scene.tokens->serialized([](const SlotMap<Token> &all) {
+        json encoded_tokens = json::array();
+        for (Token t : all) {
+          encoded_tokens.emplace_back(t.serialize());
+        }
+        return encoded_tokens.dump();
+      });
+  // Strokes make up most of the packet on tables that were drawn on, they
+  // are sent in their binary encoding instead of as json.
+  const std::string &doodads =
+      state.scene.strokes->serialized([](const SlotMap<Stroke> &all) {
+        BinaryWriter writer;
+        writer.write(uint32_t(all.size()));
+        for (const Stroke &s : all) {
+          s.writeBinary(&writer);
+        }
+        std::vector<char> encoded =
+            util::base64Encode(writer.data().data(), writer.data().size());
+        return json(std::string(encoded.begin(), encoded.end())).dump();
+      });
+  const std::string &building = state.scene.building->serialized(
+      [](const Building &b) { return b.toJson().dump(); });
+
+  std::string packet;
+  packet.reserve(tokens.size() + doodads.size() + state.tiles.size() +
+                 state.lighting.size() + building.size() + 128);
+  packet += "{\"type\":\"Init\",\"data\":{\"tokens\":";
+  packet += tokens;
+  packet += ",\"doodads\":";
+  packet += doodads;
+  packet += ",\"building\":";
+  packet += building;
+  packet += ",\"nextColor\":";
+  packet += std::to_string(state.next_color);
+  packet += ",\"tiles\":";
+  packet += state.tiles;
+  packet += ",\"lighting\":";
+  packet += state.lighting;
+  packet += ",\"epoch\":";
+  packet += std::to_string(state.epoch);
+  packet += "}}";
+  return DeltaLog::stamp(packet, state.seq);
+}
+
+std::string Simulation::initPacket() { return encodeInit(captureInit()); }
+
+void Simulation::sendInit(const WebSocketServer::ConnectionPtr &connection,
+                          std::string session) {
+  if (_serializer == nullptr) {
+    deliverInit(connection, session, _deltas.lastSequence(), initPacket());
+    return;
+  }
+  // Only a weak reference is kept, the client may leave before it is done
+  std::weak_ptr<WebSocketServer::Connection> target = connection;
+  InitState state = captureInit();
+  WorkQueue *table_queue = _table_queue;
+  _serializer->post([this, table_queue, target, session, state]() {
+    std::string init = encodeInit(state);
+    uint64_t seq = state.seq;
+    table_queue->post([this, target, session, seq, init]() {
+      std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
+      WebSocketServer::ConnectionPtr connection = target.lock();
+      if (connection != nullptr && web_socket_server_ != nullptr) {
+        deliverInit(connection, session, seq, init);
+      }
+    });
+  });
+}
+
+void Simulation::deliverInit(const WebSocketServer::ConnectionPtr &connection,
+                             const std::string &session, uint64_t seq,
+                             const std::string &init) {
+  std::string batch = "{\"type\":\"Batch\",\"data\":[";
+  batch += session;
+  if (web_socket_server_->isCongested(connection)) {
+    // The state is the largest packet there is. A client that falls behind
+    // gets it once it caught up, see checkSendQueues.
+    if (!session.empty()) {
+      web_socket_server_->send(connection, batch + "]}", false);
+    }
+    connection->is_stale = true;
+    return;
+  }
+  // The client already received the packets broadcast while the Init packet
+  // was serialized, but applied them to the state it had before. They are
+  // sent again after the Init packet.
+  if (!session.empty()) {
+    batch += ",";
+  }
+  size_t prefix = batch.size();
+  batch += init;
+  if (!_deltas.appendSince(seq, &batch)) {
+    LOG_DEBUG << "The table changed too much while the Init packet for "
+              << connection->uid << " was serialized" << LOG_END;
+    batch.resize(prefix);
+    batch += initPacket();
+  }
+  batch += "]}";
+  web_socket_server_->send(connection, batch, false,
+                           WebSocketServer::Lane::BULK);
+}
+
+WebSocketServer::ConnectionPtr Simulation::findConnection(
+    WebSocketServer::Connection *connection) {
+  WebSocketServer::ConnectionList connections =
+      web_socket_server_->tableConnections(_table);
+  for (const WebSocketServer::ConnectionPtr &c : *connections) {
+    if (c.get() == connection) {
+      return c;
+    }
   }
+  return nullptr;
+}
 
-  return {answer_str, WebSocketServer::ResponseType::RETURN};
+void Simulation::checkSendQueues() {
+  size_t max_queued = 0, num_congested = 0;
+  WebSocketServer::ConnectionList connections =
+      web_socket_server_->tableConnections(_table);
+  for (const WebSocketServer::ConnectionPtr &connection : *connections) {
+    web_socket_server_->pump(connection);
+    size_t queued = web_socket_server_->queuedBytes(connection);
+    max_queued = std::max(max_queued, queued);
+    if (queued > WebSocketServer::CONGESTED_QUEUED_BYTES ||
+        connection->is_stale) {
+      num_congested++;
+    }
+    if (connection->is_stale &&
+        queued <= WebSocketServer::CONGESTED_QUEUED_BYTES) {
+      // The client missed updates, it has to start over from the current
+      // state. Clients without a session did not ask for the state yet.
+      LOG_INFO << "A client of the table '" << _table
+               << "' caught up and is sent the state again" << LOG_END;
+      connection->is_stale = false;
+      _held_moves.erase(connection);
+      if (!connection->uid.empty()) {
+        sendInit(connection, "");
+      }
+    }
+  }
+  // Send the moves held for clients that caught up since no token moved,
+  // and forget those of clients that left.
+  std::vector<packets::MoveToken> held_moves;
+  for (auto it = _held_moves.begin(); it != _held_moves.end();) {
+    WebSocketServer::ConnectionPtr connection = it->first.lock();
+    if (connection != nullptr && web_socket_server_->isCongested(connection)) {
+      ++it;
+      continue;
+    }
+    if (connection != nullptr) {
+      held_moves.clear();
+      for (const auto &held : it->second) {
+        held_moves.push_back(held.second);
+      }
+      sendMoves(connection, held_moves, _deltas.lastSequence());
+    }
+    it = _held_moves.erase(it);
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (num_congested > 0 && now >= _next_queue_report) {
+    LOG_INFO << num_congested << " of " << connections->size()
+             << " clients of the table '" << _table
+             << "' fall behind, the longest send queue holds " << max_queued
+             << " bytes" << LOG_END;
+    _next_queue_report = now + std::chrono::seconds(int(QUEUE_REPORT_SECONDS));
+  }
 }
 
 void Simulation::broadcastClients() {
@@ -126,22 +539,30 @@ void Simulation::broadcastClients() {
     data.push_back(player);
   }
   r["data"] = data;
-  web_socket_server_->broadcast(r.dump());
+  web_socket_server_->broadcast(_table, r.dump());
 }
 
-WebSocketServer::Response Simulation::onMessage(const std::string &msg) {
+WebSocketServer::Response Simulation::onMessage(
+    WebSocketServer::Connection *connection, const std::string &msg,
+    const nlohmann::json &j) {
   std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
   using nlohmann::json;
   try {
-    json j = json::parse(msg);
-    std::string type = j.at("type");
-    LOG_DEBUG << "Received a message of type " << type << " : " << j.dump()
-              << LOG_END;
-    std::unordered_map<std::string, MemberMsgHandler_t>::const_iterator
-        handler_it = _msg_handlers.find(type);
-    if (handler_it != _msg_handlers.end()) {
-      // call the handler
-      return (handler_it->second)(Packet(j, this));
+    const std::string &type = j.at("type").get_ref<const std::string &>();
+    LOG_DEBUG << "Received a message of type " << type << LOG_END;
+    packets::Id id = packets::idFromName(type);
+    if (id != packets::Id::UNKNOWN) {
+      static const json EMPTY_DATA;
+      auto data_it = j.find("data");
+      WebSocketServer::Response r =
+          dispatch(id, Packet(j, this, connection),
+                   data_it != j.end() ? *data_it : EMPTY_DATA);
+      if (_journal != nullptr && changesState(id, r)) {
+        _journal->append(encodeRecord(RecordKind::JSON, "", msg));
+        _records_since_snapshot++;
+      }
+      sequenceResponse(msg, &r);
+      return r;
     }
 
     WebSocketServer::Response r;
@@ -160,6 +581,398 @@ WebSocketServer::Response Simulation::onMessage(const std::string &msg) {
   return r;
 }
 
+WebSocketServer::Response Simulation::dispatch(packets::Id id, const Packet &j,
+                                               const nlohmann::json &data) {
+  // Typed packets are decoded, and thereby validated, before the handler is
+  // called.
+#define DISPATCH_TYPED(Name, FIELDS) \
+  case packets::Id::Name:            \
+    return on##Name(j, packets::Name::fromJson(data));
+#define DISPATCH_UNTYPED(Name) \
+  case packets::Id::Name:      \
+    return on##Name(j);
+#define DISPATCH_BUILDING_TYPED(Name, FIELDS) \
+  case packets::Id::Name:                     \
+    return _building_manager.on##Name(j, packets::Name::fromJson(data));
+#define DISPATCH_BUILDING_UNTYPED(Name) \
+  case packets::Id::Name:               \
+    return _building_manager.on##Name(j);
+
+  switch (id) {
+    SIMULATION_PACKETS(DISPATCH_TYPED, DISPATCH_UNTYPED)
+    BUILDING_PACKETS(DISPATCH_BUILDING_TYPED, DISPATCH_BUILDING_UNTYPED)
+    case packets::Id::UNKNOWN:
+      break;
+  }
+
+#undef DISPATCH_TYPED
+#undef DISPATCH_UNTYPED
+#undef DISPATCH_BUILDING_TYPED
+#undef DISPATCH_BUILDING_UNTYPED
+  return {"Unknown message type", WebSocketServer::ResponseType::RETURN};
+}
+
+void Simulation::onTick() {
+  std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
+  if (web_socket_server_ == nullptr) {
+    return;
+  }
+  broadcastMoves();
+  broadcastStrokes();
+  compactStrokes();
+  // Both the visibility of the tokens and the lights depend on the walls
+  std::vector<Rect> occluder_changes =
+      _building_manager.takeOccluderChanges();
+  updateVisibility(occluder_changes);
+  updateLighting(occluder_changes);
+  checkSendQueues();
+  if (_journal != nullptr && _records_since_snapshot >= SNAPSHOT_INTERVAL) {
+    _journal->snapshot(prepareSnapshot());
+    _records_since_snapshot = 0;
+  }
+}
+
+void Simulation::broadcastMoves() {
+  if (_moved_tokens.empty()) {
+    return;
+  }
+  std::vector<packets::MoveToken> moves;
+  // The area covered by each token before and after its moves
+  std::vector<Rect> areas;
+  moves.reserve(_moved_tokens.size());
+  areas.reserve(_moved_tokens.size());
+  for (uint64_t id : _moved_tokens) {
+    Token *t = tokenById(id);
+    if (t != nullptr) {
+      moves.push_back({id, t->x(), t->y(), t->rotation()});
+      areas.push_back(_moved_from.at(id).united(boundsOf(*t)));
+    }
+  }
+  _moved_tokens.clear();
+  _moved_from.clear();
+  if (moves.empty()) {
+    // All moved tokens were deleted since the last tick
+    return;
+  }
+
+  std::string text, binary;
+  uint64_t seq = _deltas.lastSequence() + 1;
+  encodeMoves(moves, seq, &text, &binary);
+  text = _deltas.append(text);
+
+  // Clients only receive the moves of tokens within their viewport. Clients
+  // which see all moved tokens share the same message.
+  std::vector<WebSocketServer::ConnectionPtr> everything;
+  std::vector<packets::MoveToken> visible_moves;
+  WebSocketServer::ConnectionList connections =
+      web_socket_server_->tableConnections(_table);
+  for (const WebSocketServer::ConnectionPtr &connection : *connections) {
+    visible_moves.clear();
+    for (size_t i = 0; i < moves.size(); ++i) {
+      if (connection->viewport.intersects(areas[i])) {
+        visible_moves.push_back(moves[i]);
+      }
+    }
+    // A client that falls behind only gets the latest position of every
+    // token once it caught up, the moves in between are dropped.
+    auto held_it = _held_moves.find(connection);
+    if (web_socket_server_->isCongested(connection)) {
+      HeldMoves &held = _held_moves[connection];
+      for (const packets::MoveToken &move : visible_moves) {
+        held[move.id] = move;
+      }
+      continue;
+    }
+    if (held_it != _held_moves.end()) {
+      for (const packets::MoveToken &move : visible_moves) {
+        held_it->second[move.id] = move;
+      }
+      visible_moves.clear();
+      for (const auto &held : held_it->second) {
+        visible_moves.push_back(held.second);
+      }
+      _held_moves.erase(held_it);
+    } else if (visible_moves.size() == moves.size()) {
+      everything.push_back(connection);
+      continue;
+    }
+    sendMoves(connection, visible_moves, seq);
+  }
+  web_socket_server_->broadcast(everything, text, binary,
+                                WebSocketServer::Lane::INTERACTIVE);
+}
+
+void Simulation::sendMoves(const WebSocketServer::ConnectionPtr &connection,
+                           const std::vector<packets::MoveToken> &moves,
+                           uint64_t seq) {
+  if (moves.empty()) {
+    return;
+  }
+  std::string text, binary;
+  encodeMoves(moves, seq, &text, &binary);
+  if (connection->binary_protocol) {
+    web_socket_server_->send(connection, binary, true,
+                             WebSocketServer::Lane::INTERACTIVE);
+  } else {
+    web_socket_server_->send(connection, DeltaLog::stamp(text, seq), false,
+                             WebSocketServer::Lane::INTERACTIVE);
+  }
+}
+
+void Simulation::broadcastStrokes() {
+  if (_changed_strokes.empty()) {
+    return;
+  }
+  // Every change exists as the appended points and as the whole stroke, for
+  // the clients that have not seen the stroke before.
+  std::vector<std::string> appended, whole;
+  std::vector<Rect> before, after;
+  for (uint64_t id : _changed_strokes) {
+    Stroke *s = _strokes.get(id);
+    const SentStroke &sent = _sent_strokes.at(id);
+    nlohmann::json change;
+    change["id"] = id;
+    change["offset"] = sent.size / 2;
+    change["points"] = s->points(sent.size);
+    change["complete"] = s->isComplete();
+    appended.push_back(change.dump());
+    change["offset"] = 0;
+    change["points"] = s->points();
+    whole.push_back(change.dump());
+    before.push_back(sent.bounds);
+    after.push_back(s->bounds());
+  }
+  _changed_strokes.clear();
+  _sent_strokes.clear();
+
+  auto encode = [](const std::vector<const std::string *> &changes) {
+    std::string text = "{\"type\":\"AppendStrokes\",\"data\":[";
+    for (size_t i = 0; i < changes.size(); ++i) {
+      text += i > 0 ? "," : "";
+      text += *changes[i];
+    }
+    text += "]}";
+    return text;
+  };
+  std::vector<const std::string *> changes;
+  for (const std::string &change : appended) {
+    changes.push_back(&change);
+  }
+  uint64_t seq = _deltas.lastSequence() + 1;
+  std::string text = _deltas.append(encode(changes));
+
+  // Like moves, changes are only sent to the clients seeing the stroke. A
+  // client that did not see the stroke before gets all of it. There is no
+  // binary encoding, all clients receive json.
+  WebSocketServer::ConnectionList connections =
+      web_socket_server_->tableConnections(_table);
+  for (const WebSocketServer::ConnectionPtr &connection : *connections) {
+    changes.clear();
+    bool is_everything = true;
+    for (size_t i = 0; i < appended.size(); ++i) {
+      if (!connection->viewport.intersects(after[i])) {
+        is_everything = false;
+      } else if (connection->viewport.intersects(before[i])) {
+        changes.push_back(&appended[i]);
+      } else {
+        changes.push_back(&whole[i]);
+        is_everything = false;
+      }
+    }
+    if (is_everything) {
+      web_socket_server_->send(connection, text, false);
+    } else if (!changes.empty()) {
+      web_socket_server_->send(connection,
+                               DeltaLog::stamp(encode(changes), seq), false);
+    }
+  }
+}
+
+void Simulation::updateVisibility(const std::vector<Rect> &occluder_changes) {
+  using nlohmann::json;
+  // Changed walls and doors only affect the tokens that could see them
+  for (const Rect &change : occluder_changes) {
+    for (const auto &entry : _visible) {
+      if (entry.second.bounds().intersects(change)) {
+        _stale_visible.insert(entry.first);
+      }
+    }
+  }
+  if (_stale_visible.empty()) {
+    return;
+  }
+
+  json revealed = json::array();
+  for (uint64_t id : _stale_visible) {
+    Token *t = tokenById(id);
+    if (t == nullptr || t->is_enemy()) {
+      _visible.erase(id);
+      continue;
+    }
+    Visible &visible = _visible[id];
+    visible = _building_manager.computeVisible(Vector2f(t->x(), t->y()),
+                                               VISION_RANGE);
+    _building_manager.reveal(visible, &revealed);
+  }
+  _stale_visible.clear();
+  if (revealed.empty()) {
+    return;
+  }
+  json r;
+  r["type"] = "Batch";
+  r["data"] = revealed;
+  web_socket_server_->broadcast(_table, _deltas.append(r.dump()));
+}
+
+void Simulation::invalidateVisibility(uint64_t token_id) {
+  _stale_visible.insert(token_id);
+}
+
+void Simulation::updateLighting(const std::vector<Rect> &occluder_changes) {
+  using nlohmann::json;
+  for (const Rect &change : occluder_changes) {
+    _lighting.invalidate(change);
+  }
+  json tiles = _lighting.update(&_building_manager);
+  if (tiles.is_null()) {
+    return;
+  }
+  _lighting_cache.invalidate();
+  json r;
+  r["type"] = "LightTiles";
+  r["data"] = tiles;
+  web_socket_server_->broadcast(_table, _deltas.append(r.dump()));
+}
+
+void Simulation::encodeMoves(const std::vector<packets::MoveToken> &moves,
+                             uint64_t seq, std::string *text,
+                             std::string *binary) {
+  using nlohmann::json;
+  json encoded_moves = json::array();
+  for (const packets::MoveToken &move : moves) {
+    encoded_moves.push_back(move.toJson());
+  }
+  json r;
+  r["type"] = "MoveTokens";
+  r["data"] = encoded_moves;
+  *text = r.dump();
+
+  // The same moves for the clients using the binary protocol
+  BinaryWriter writer;
+  writer.write(uint8_t(binary::PacketType::MOVE_TOKENS));
+  writer.write(seq);
+  writer.write(uint32_t(moves.size()));
+  for (const packets::MoveToken &move : moves) {
+    move.toBinary(&writer);
+  }
+  *binary = std::move(writer.data());
+}
+
+WebSocketServer::Response Simulation::onBinaryMessage(
+    WebSocketServer::Connection *connection, const std::string &msg) {
+  std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
+  try {
+    BinaryReader reader(msg);
+    binary::PacketType type = binary::PacketType(reader.read<uint8_t>());
+    WebSocketServer::Response r =
+        dispatchBinary(type, Packet(this, connection), &reader);
+    if (_journal != nullptr &&
+        r.type != WebSocketServer::ResponseType::RETURN) {
+      _journal->append(encodeRecord(RecordKind::BINARY, connection->uid, msg));
+      _records_since_snapshot++;
+    }
+    if (r.type == WebSocketServer::ResponseType::FORWARD) {
+      // The clients expect json, a binary packet can't be forwarded as is.
+      LOG_ERROR << "A binary packet of type " << int(type)
+                << " can not be forwarded." << LOG_END;
+      r = {"", WebSocketServer::ResponseType::SILENCE};
+    }
+    sequenceResponse(msg, &r);
+    return r;
+  } catch (const std::exception &e) {
+    LOG_ERROR << "Error when handling a binary msg from a client " << e.what()
+              << LOG_END;
+  }
+  return {"Error handling a message.", WebSocketServer::ResponseType::RETURN};
+}
+
+void Simulation::onDisconnect(WebSocketServer::Connection *connection) {
+  std::lock_guard<std::mutex> simulation_mutex_lock(_simulation_mutex);
+  if (connection->uid.empty()) {
+    return;
+  }
+  // The player may still be drawing in another session
+  if (web_socket_server_ != nullptr) {
+    WebSocketServer::ConnectionList connections =
+        web_socket_server_->tableConnections(_table);
+    for (const WebSocketServer::ConnectionPtr &c : *connections) {
+      if (c.get() != connection && c->uid == connection->uid) {
+        return;
+      }
+    }
+  }
+  if (endStrokes(connection->uid) && _journal != nullptr) {
+    _journal->append(
+        encodeRecord(RecordKind::DISCONNECT, connection->uid, ""));
+    _records_since_snapshot++;
+  }
+}
+
+WebSocketServer::Response Simulation::dispatchBinary(
+    binary::PacketType type, const Packet &j, BinaryReader *reader) {
+  switch (type) {
+    case binary::PacketType::MOVE_TOKEN:
+      return onMoveToken(j, packets::MoveToken::fromBinary(reader));
+    case binary::PacketType::MOVE_TOKENS:
+      return onMoveTokens(j, packets::MoveTokens::fromBinary(reader));
+    case binary::PacketType::CREATE_DOODAD_LINE:
+      return onCreateDoodadLine(j,
+                                packets::CreateDoodadLine::fromBinary(reader));
+    case binary::PacketType::APPEND_STROKE:
+      return onAppendStroke(j, packets::AppendStroke::fromBinary(reader));
+    case binary::PacketType::MODIFY_ROOM:
+      return _building_manager.onModifyRoom(
+          j, packets::ModifyRoom::fromBinary(reader));
+    case binary::PacketType::MODIFY_WALL:
+      return _building_manager.onModifyWall(
+          j, packets::ModifyWall::fromBinary(reader));
+    case binary::PacketType::MODIFY_DOOR:
+      return _building_manager.onModifyDoor(
+          j, packets::ModifyDoor::fromBinary(reader));
+    case binary::PacketType::MODIFY_FURNITURE:
+      return _building_manager.onModifyFurniture(
+          j, packets::ModifyFurniture::fromBinary(reader));
+    default:
+      LOG_WARN << "Received a binary packet of unknown type " << int(type)
+               << LOG_END;
+      return {"Unknown packet type", WebSocketServer::ResponseType::RETURN};
+  }
+}
+
+void Simulation::sequenceResponse(const std::string &msg,
+                                  WebSocketServer::Response *response) {
+  if (response->type == WebSocketServer::ResponseType::FORWARD) {
+    response->text = msg;
+  }
+  if (response->type == WebSocketServer::ResponseType::FORWARD ||
+      response->type == WebSocketServer::ResponseType::BROADCAST) {
+    // Every state change sent to all clients gets a sequence number
+    response->text = _deltas.append(response->text);
+  }
+}
+
+Player &Simulation::addPlayer(const std::string &uid) {
+  _players.emplace_back();
+  Player &player = _players.back();
+  player.uid = uid;
+  player.id = _players.size() - 1;
+  _player_ids[uid] = player.id;
+  // The first player of a table is its game master
+  player.permissions =
+      _players.size() == 1 ? Permissions::GAMEMASTER : Permissions::PLAYER;
+  return player;
+}
+
 Simulation::Color Simulation::nextColor() {
   Color c = COLORS[_next_color];
   _next_color++;
@@ -167,23 +980,12 @@ Simulation::Color Simulation::nextColor() {
   return c;
 }
 
-WebSocketServer::Response Simulation::onCreateToken(const Packet &j) {
+WebSocketServer::Response Simulation::onCreateToken(
+    const Packet &j, const packets::CreateToken &p) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _tokens.emplace_back();
-  float x = j.json().at("data").at("x");
-  float y = j.json().at("data").at("y");
-  Token &t = _tokens.back();
-  t.x() = x;
-  t.y() = y;
-  t.id() = _id_generator();
-  t.radius() = 0.25;
-  t.is_enemy() = false;
-  Color c = nextColor();
-  t.r() = c.r;
-  t.g() = c.g;
-  t.b() = c.b;
+  Token &t = createToken(Vector2f(p.x, p.y));
 
   nlohmann::json response;
   response["type"] = "CreateToken";
@@ -192,42 +994,156 @@ WebSocketServer::Response Simulation::onCreateToken(const Packet &j) {
   return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
 }
 
-WebSocketServer::Response Simulation::onMoveToken(const Packet &j) {
-  nlohmann::json data = j.json().at("data");
-  uint64_t id = data.at("id").get<uint64_t>();
-  Token *t = tokenById(id);
+WebSocketServer::Response Simulation::onMoveToken(
+    const Packet &, const packets::MoveToken &p) {
+  Token *t = tokenById(p.id);
   if (t != nullptr) {
-    t->x() = data.at("x").get<float>();
-    t->y() = data.at("y").get<float>();
-    t->rotation() = data.at("rotation").get<float>();
+    moveToken(t, p.x, p.y, p.rotation);
+  }
+  return {"", WebSocketServer::ResponseType::SILENCE};
+}
+
+WebSocketServer::Response Simulation::onDeleteToken(
+    const Packet &j, const packets::DeleteToken &p) {
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  if (tokenById(p.id) != nullptr) {
+    deleteToken(p.id);
+  } else {
+    LOG_WARN << "A client requested deletion of token " << p.id
+             << " but no token with that id exists." << LOG_END;
   }
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
-WebSocketServer::Response Simulation::onDeleteToken(const Packet &j) {
+WebSocketServer::Response Simulation::onCreateTokens(
+    const Packet &j, const packets::CreateTokens &p) {
+  using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  bool did_delete = false;
-  nlohmann::json data = j.json().at("data");
-  uint64_t id = data.at("id").get<uint64_t>();
-  for (size_t i = 0; i < _tokens.size(); i++) {
-    if (_tokens[i].id() == id) {
-      LOG_DEBUG << "Deleted token with id " << id << LOG_END;
-      std::iter_swap(_tokens.begin() + i,
-                     _tokens.begin() + (_tokens.size() - 1));
-      _tokens.erase(_tokens.end());
-      did_delete = true;
-      break;
+  if (p.positions.size() > MAX_TOKENS_PER_PACKET) {
+    return {"At most " + std::to_string(MAX_TOKENS_PER_PACKET) +
+                " tokens can be created at once",
+            WebSocketServer::ResponseType::RETURN};
+  }
+  json tokens = json::array();
+  for (const Vector2f &position : p.positions) {
+    tokens.push_back(createToken(position).serialize());
+  }
+
+  json response;
+  response["type"] = "CreateTokens";
+  response["data"] = tokens;
+  return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
+}
+
+WebSocketServer::Response Simulation::onMoveTokens(
+    const Packet &, const packets::MoveTokens &p) {
+  if (p.moves.size() > MAX_TOKENS_PER_PACKET) {
+    return {"At most " + std::to_string(MAX_TOKENS_PER_PACKET) +
+                " tokens can be moved at once",
+            WebSocketServer::ResponseType::RETURN};
+  }
+  // Check all tokens first, so a group is never moved halfway
+  for (const packets::TokenMove &move : p.moves) {
+    if (tokenById(move.id) == nullptr) {
+      return {"There is no token with id " + std::to_string(move.id),
+              WebSocketServer::ResponseType::RETURN};
     }
   }
-  if (!did_delete) {
-    LOG_WARN << "A client requested deletion of token " << id
-             << " but no token with that id exists." << LOG_END;
+  // The moves are sent to the clients together on the next tick
+  for (const packets::TokenMove &move : p.moves) {
+    moveToken(tokenById(move.id), move.x, move.y, move.rotation);
+  }
+  return {"", WebSocketServer::ResponseType::SILENCE};
+}
+
+WebSocketServer::Response Simulation::onDeleteTokens(
+    const Packet &j, const packets::DeleteTokens &p) {
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  if (p.ids.size() > MAX_TOKENS_PER_PACKET) {
+    return {"At most " + std::to_string(MAX_TOKENS_PER_PACKET) +
+                " tokens can be deleted at once",
+            WebSocketServer::ResponseType::RETURN};
+  }
+  for (uint64_t id : p.ids) {
+    if (tokenById(id) == nullptr) {
+      return {"There is no token with id " + std::to_string(id),
+              WebSocketServer::ResponseType::RETURN};
+    }
+  }
+  for (uint64_t id : p.ids) {
+    // The same id may be listed twice
+    if (tokenById(id) != nullptr) {
+      deleteToken(id);
+    }
   }
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
+Token &Simulation::createToken(const Vector2f &position) {
+  Token &t = _tokens.create([](uint64_t id) {
+    Token token;
+    token.id() = id;
+    return token;
+  });
+  _tokens_cache.invalidate();
+  t.x() = position.x();
+  t.y() = position.y();
+  t.radius() = 0.25;
+  _index.insert(indexKey(IndexKind::TOKEN, t.id()), boundsOf(t));
+  t.is_enemy() = false;
+  invalidateVisibility(t.id());
+  Color c = nextColor();
+  t.r() = c.r;
+  t.g() = c.g;
+  t.b() = c.b;
+  return t;
+}
+
+void Simulation::moveToken(Token *t, float x, float y, float rotation) {
+  uint64_t id = t->id();
+  // Only the latest position is sent out on the next tick
+  if (_moved_from.emplace(id, boundsOf(*t)).second) {
+    _moved_tokens.push_back(id);
+  }
+  t->x() = x;
+  t->y() = y;
+  t->rotation() = rotation;
+  _index.insert(indexKey(IndexKind::TOKEN, id), boundsOf(*t));
+  invalidateVisibility(id);
+  _lighting.moveToken(id, Vector2f(x, y));
+  _tokens_cache.invalidate();
+}
+
+void Simulation::deleteToken(uint64_t id) {
+  _tokens.erase(id);
+  LOG_DEBUG << "Deleted token with id " << id << LOG_END;
+  _index.remove(indexKey(IndexKind::TOKEN, id));
+  _visible.erase(id);
+  _stale_visible.erase(id);
+  broadcastDeletedLights(_lighting.removeToken(id));
+  _lighting_cache.invalidate();
+  _tokens_cache.invalidate();
+}
+
+void Simulation::broadcastDeletedLights(const std::vector<uint64_t> &ids) {
+  using nlohmann::json;
+  if (ids.empty() || web_socket_server_ == nullptr) {
+    return;
+  }
+  for (uint64_t id : ids) {
+    json r;
+    r["type"] = "DeleteLight";
+    r["data"]["id"] = id;
+    web_socket_server_->broadcast(_table, _deltas.append(r.dump()));
+  }
+}
+
 WebSocketServer::Response Simulation::onChat(const Packet &j) {
   using nlohmann::json;
   std::string uid = j.json().at("uid");
@@ -243,6 +1159,7 @@ WebSocketServer::Response Simulation::onChat(const Packet &j) {
     json resp_json = j.json();
     resp_json["data"]["sender"] = "The Server";
     resp.type = WebSocketServer::ResponseType::BROADCAST;
+    resp.lane = WebSocketServer::Lane::INTERACTIVE;
 
     // The message is a command
     std::vector<std::string> parts = splitWs(msg);
@@ -269,6 +1186,7 @@ WebSocketServer::Response Simulation::onChat(const Packet &j) {
       if (parts.size() == 2) {
         const std::string &path = parts[1];
         tiles_path_ = path;
+        _tiles_cache.invalidate();
         json r;
         r["type"] = "SetTiles";
         r["data"]["path"] = path;
@@ -281,6 +1199,7 @@ WebSocketServer::Response Simulation::onChat(const Packet &j) {
         return j.makeMissingPermissionsResponse();
       }
       tiles_path_ = "";
+      _tiles_cache.invalidate();
       json r;
       r["type"] = "ClearTiles";
       r["data"] = {};
@@ -300,51 +1219,282 @@ WebSocketServer::Response Simulation::onChat(const Packet &j) {
   } else {
     json modified = j.json();
     modified["data"]["sender"] = sender;
-    return {modified.dump(), WebSocketServer::ResponseType::BROADCAST};
+    return {modified.dump(), WebSocketServer::ResponseType::BROADCAST,
+            Rect::everything(), WebSocketServer::Lane::INTERACTIVE};
   }
 }
 
-WebSocketServer::Response Simulation::onCreateDoodadLine(const Packet &j) {
+WebSocketServer::Response Simulation::onCreateDoodadLine(
+    const Packet &j, const packets::CreateDoodadLine &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _doodad_lines.emplace_back(&_id_generator);
-  DoodadLine &d = _doodad_lines.back();
-  d.deserialize(j.json().at("data"));
+  Stroke &s = _strokes.create([](uint64_t id) {
+    Stroke stroke;
+    stroke.id() = id;
+    return stroke;
+  });
+  s.append({p.sx, p.sy, p.ex, p.ey});
+  s.isComplete() = true;
+  _index.insert(indexKey(IndexKind::DOODAD, s.id()), s.bounds());
+  _uncompacted_strokes.push_back(s.id());
+  _doodads_cache.invalidate();
 
   json response;
-  response["type"] = "CreateDoodadLine";
-  response["data"] = d.serialize();
+  response["type"] = "CreateStroke";
+  response["data"] = s.serialize();
 
-  return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
+  return {response.dump(), WebSocketServer::ResponseType::BROADCAST,
+          s.bounds()};
+}
+
+WebSocketServer::Response Simulation::onBeginStroke(
+    const Packet &j, const packets::BeginStroke &p) {
+  using nlohmann::json;
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  if (p.points.size() < 2 || p.points.size() > MAX_STROKE_SIZE) {
+    return {"A stroke has to start with at least one point",
+            WebSocketServer::ResponseType::RETURN};
+  }
+  // A client reusing the number of a stroke it did not end is done with it
+  Stroke *previous = openStroke(j, p.stroke);
+  if (previous != nullptr) {
+    changeStroke(*previous);
+    previous->isComplete() = true;
+    _uncompacted_strokes.push_back(previous->id());
+  }
+  Stroke &s = _strokes.create([](uint64_t id) {
+    Stroke stroke;
+    stroke.id() = id;
+    return stroke;
+  });
+  s.append(p.points);
+  _open_strokes[std::make_pair(j.uid(), p.stroke)] = s.id();
+  _index.insert(indexKey(IndexKind::DOODAD, s.id()), s.bounds());
+  _doodads_cache.invalidate();
+
+  json response;
+  response["type"] = "CreateStroke";
+  response["data"] = s.serialize();
+
+  return {response.dump(), WebSocketServer::ResponseType::BROADCAST,
+          s.bounds()};
+}
+
+WebSocketServer::Response Simulation::onAppendStroke(
+    const Packet &j, const packets::AppendStroke &p) {
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  Stroke *s = openStroke(j, p.stroke);
+  if (s == nullptr) {
+    // The stroke may have been cleared while it was drawn
+    return {"", WebSocketServer::ResponseType::SILENCE};
+  }
+  if (s->size() + p.points.size() > MAX_STROKE_SIZE) {
+    return {"The stroke is too long", WebSocketServer::ResponseType::RETURN};
+  }
+  changeStroke(*s);
+  s->append(p.points);
+  _index.insert(indexKey(IndexKind::DOODAD, s->id()), s->bounds());
+  _doodads_cache.invalidate();
+  return {"", WebSocketServer::ResponseType::SILENCE};
+}
+
+WebSocketServer::Response Simulation::onEndStroke(
+    const Packet &j, const packets::EndStroke &p) {
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  Stroke *s = openStroke(j, p.stroke);
+  if (s == nullptr) {
+    return {"", WebSocketServer::ResponseType::SILENCE};
+  }
+  _open_strokes.erase(std::make_pair(j.uid(), p.stroke));
+  changeStroke(*s);
+  s->isComplete() = true;
+  _uncompacted_strokes.push_back(s->id());
+  _doodads_cache.invalidate();
+  return {"", WebSocketServer::ResponseType::SILENCE};
+}
+
+bool Simulation::endStrokes(const std::string &uid) {
+  auto it = _open_strokes.lower_bound(std::make_pair(uid, uint64_t(0)));
+  if (it == _open_strokes.end() || it->first.first != uid) {
+    return false;
+  }
+  while (it != _open_strokes.end() && it->first.first == uid) {
+    Stroke *s = _strokes.get(it->second);
+    if (s != nullptr) {
+      changeStroke(*s);
+      s->isComplete() = true;
+      _uncompacted_strokes.push_back(s->id());
+    }
+    it = _open_strokes.erase(it);
+  }
+  _doodads_cache.invalidate();
+  return true;
+}
+
+Stroke *Simulation::openStroke(const Packet &j, uint64_t stroke) {
+  auto it = _open_strokes.find(std::make_pair(j.uid(), stroke));
+  if (it == _open_strokes.end()) {
+    return nullptr;
+  }
+  return _strokes.get(it->second);
+}
+
+void Simulation::changeStroke(Stroke &stroke) {
+  SentStroke sent = {stroke.size(), stroke.bounds()};
+  if (_sent_strokes.emplace(stroke.id(), sent).second) {
+    _changed_strokes.push_back(stroke.id());
+  }
+}
+
+void Simulation::compactStrokes() {
+  size_t count =
+      std::min(_uncompacted_strokes.size(), size_t(COMPACTION_BATCH));
+  if (count == 0) {
+    return;
+  }
+  std::vector<uint64_t> batch(_uncompacted_strokes.begin(),
+                              _uncompacted_strokes.begin() + count);
+  _uncompacted_strokes.erase(_uncompacted_strokes.begin(),
+                             _uncompacted_strokes.begin() + count);
+  std::vector<uint64_t> absorbed, joined;
+  for (uint64_t id : batch) {
+    Stroke *s = _strokes.get(id);
+    // The stroke may have been joined to another one already
+    if (s == nullptr || !s->isComplete()) {
+      continue;
+    }
+    // Join the strokes that continue at either end, e.g. the segments of a
+    // line drawn with CreateDoodadLine.
+    size_t num_absorbed = absorbed.size();
+    bool is_joined = true;
+    while (is_joined) {
+      is_joined = false;
+      Vector2f ends[] = {s->point(0), s->point(s->size() / 2 - 1)};
+      for (const Vector2f &end : ends) {
+        for (uint64_t key : _index.query(
+                 Rect::around(end, Stroke::QUANTUM, Stroke::QUANTUM))) {
+          Stroke *other = _strokes.get(indexId(key));
+          if (indexKind(key) != IndexKind::DOODAD || other == nullptr ||
+              other == s || !other->isComplete() ||
+              _sent_strokes.count(other->id()) > 0 ||
+              s->size() + other->size() > MAX_STROKE_SIZE ||
+              !s->join(*other)) {
+            continue;
+          }
+          uint64_t other_id = other->id();
+          _index.remove(key);
+          _strokes.erase(other_id);
+          absorbed.push_back(other_id);
+          s = _strokes.get(id);
+          is_joined = true;
+          break;
+        }
+        if (is_joined) {
+          break;
+        }
+      }
+    }
+    if (absorbed.size() > num_absorbed) {
+      joined.push_back(id);
+    }
+    s->compact(float(SIMPLIFY_TOLERANCE));
+    _index.insert(indexKey(IndexKind::DOODAD, id), s->bounds());
+  }
+  _doodads_cache.invalidate();
+  broadcastJoinedStrokes(absorbed, joined);
 }
 
-WebSocketServer::Response Simulation::onClearDoodads(const Packet &j) {
+void Simulation::broadcastJoinedStrokes(const std::vector<uint64_t> &absorbed,
+                                        const std::vector<uint64_t> &joined) {
+  using nlohmann::json;
+  if (absorbed.empty() || web_socket_server_ == nullptr) {
+    return;
+  }
+  // The clients drop the absorbed strokes and replace the ones they were
+  // joined to in one step, so they never draw a joined line twice.
+  json deleted;
+  deleted["type"] = "DeleteStrokes";
+  deleted["data"]["ids"] = absorbed;
+  json replaced;
+  replaced["type"] = "AppendStrokes";
+  replaced["data"] = json::array();
+  for (uint64_t id : joined) {
+    // A stroke may have been absorbed after others were joined to it
+    Stroke *s = _strokes.get(id);
+    if (s == nullptr) {
+      continue;
+    }
+    json change;
+    change["id"] = id;
+    change["offset"] = 0;
+    change["points"] = s->points();
+    change["complete"] = s->isComplete();
+    replaced["data"].push_back(change);
+  }
+  json r;
+  r["type"] = "Batch";
+  r["data"] = json::array({deleted, replaced});
+  web_socket_server_->broadcast(_table, _deltas.append(r.dump()));
+}
+
+WebSocketServer::Response Simulation::onClearDoodads(
+    const Packet &j, const packets::ClearDoodads &) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _doodad_lines.clear();
+  for (Stroke &s : _strokes) {
+    _index.remove(indexKey(IndexKind::DOODAD, s.id()));
+  }
+  _strokes.clear();
+  _open_strokes.clear();
+  _changed_strokes.clear();
+  _sent_strokes.clear();
+  _uncompacted_strokes.clear();
+  _doodads_cache.invalidate();
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
-WebSocketServer::Response Simulation::onClearTokens(const Packet &j) {
+WebSocketServer::Response Simulation::onClearTokens(
+    const Packet &j, const packets::ClearTokens &) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
+  std::vector<uint64_t> removed_lights;
+  for (Token &t : _tokens) {
+    _index.remove(indexKey(IndexKind::TOKEN, t.id()));
+    std::vector<uint64_t> carried = _lighting.removeToken(t.id());
+    removed_lights.insert(removed_lights.end(), carried.begin(),
+                          carried.end());
+  }
+  broadcastDeletedLights(removed_lights);
+  _lighting_cache.invalidate();
   _tokens.clear();
+  _tokens_cache.invalidate();
+  _moved_tokens.clear();
+  _moved_from.clear();
+  _visible.clear();
+  _stale_visible.clear();
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
-WebSocketServer::Response Simulation::onTokenToggleFoe(const Packet &j) {
+WebSocketServer::Response Simulation::onTokenToggleFoe(
+    const Packet &j, const packets::TokenToggleFoe &p) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  nlohmann::json data = j.json().at("data");
-  uint64_t id = data.at("id").get<uint64_t>();
-  Token *t = tokenById(id);
+  Token *t = tokenById(p.id);
   if (t != nullptr) {
     t->is_enemy() = !t->is_enemy();
+    invalidateVisibility(p.id);
+    _tokens_cache.invalidate();
   }
 
   return {"", WebSocketServer::ResponseType::FORWARD};
@@ -352,25 +1502,25 @@ WebSocketServer::Response Simulation::onTokenToggleFoe(const Packet &j) {
 
 WebSocketServer::Response Simulation::onInitSession(const Packet &j) {
   using nlohmann::json;
-  json req_data = j.json().at("data");
+  const json &req_data = j.json().at("data");
   std::string uid = req_data.at("uid");
   Player *player = getPlayer(uid);
 
   if (player == nullptr) {
     LOG_INFO << "A new player with uid " << uid << " connected." << LOG_END;
-    // A new player connected
-    _players.emplace_back();
-    player = &_players.back();
-    player->uid = uid;
-    player->id = _players.size() - 1;
-    player->permissions =
-        _players.size() == 1 ? Permissions::GAMEMASTER : Permissions::PLAYER;
+    player = &addPlayer(uid);
   } else {
     LOG_INFO << "A player with uid " << uid << " and name " << player->name
              << " reconnected." << LOG_END;
   }
   broadcastClients();
 
+  bool use_binary = req_data.value("protocol", "json") == "binary";
+  if (j.connection() != nullptr) {
+    j.connection()->uid = uid;
+    j.connection()->binary_protocol = use_binary;
+  }
+
   // encode the player
   json response;
   response["type"] = "Session";
@@ -379,15 +1529,43 @@ WebSocketServer::Response Simulation::onInitSession(const Packet &j) {
   resp_data["id"] = player->id;
   resp_data["name"] = player->name;
   resp_data["permissions"] = (int)player->permissions;
+  resp_data["protocol"] = use_binary ? "binary" : "json";
 
   response["data"] = resp_data;
 
-  return {response.dump(), WebSocketServer::ResponseType::RETURN};
+  // Send the session and the state in one batch. A client that was connected
+  // before only receives the packets it missed, if they are still known.
+  std::string session = response.dump();
+  bool resumed = false;
+  std::string batch = "{\"type\":\"Batch\",\"data\":[";
+  batch += session;
+  if (req_data.contains("last_seq") && req_data.contains("epoch") &&
+      req_data.at("epoch").get<uint64_t>() == _deltas.epoch()) {
+    uint64_t last_seq = req_data.at("last_seq").get<uint64_t>();
+    resumed = _deltas.appendSince(last_seq, &batch);
+    if (resumed) {
+      LOG_DEBUG << "Resumed the session of " << uid << " after sequence "
+                << last_seq << LOG_END;
+    }
+  }
+  if (!resumed) {
+    if (_serializer != nullptr && j.connection() != nullptr &&
+        web_socket_server_ != nullptr) {
+      sendInit(findConnection(j.connection()), std::move(session));
+      return {"", WebSocketServer::ResponseType::SILENCE};
+    }
+    batch += ",";
+    batch += initPacket();
+  }
+  batch += "]}";
+
+  return {batch, WebSocketServer::ResponseType::RETURN};
 }
 
-WebSocketServer::Response Simulation::onSetUsername(const Packet &j) {
-  std::string uid = j.json().at("uid");
-  std::string newname = j.json().at("data").at("name");
+WebSocketServer::Response Simulation::onSetUsername(
+    const Packet &j, const packets::SetUsername &p) {
+  const std::string &uid = j.uid();
+  std::string newname = p.name;
   if (newname == "The Server") {
     newname = "not The Server";
   }
@@ -395,14 +1573,224 @@ WebSocketServer::Response Simulation::onSetUsername(const Packet &j) {
   LOG_INFO << "The player with uid " << uid << " is now called " << newname
            << LOG_END;
 
-  Player *p = getPlayer(uid);
-  if (p) {
-    p->name = newname;
+  Player *player = getPlayer(uid);
+  if (player) {
+    player->name = newname;
   }
   broadcastClients();
   return {"", WebSocketServer::ResponseType::SILENCE};
 }
 
+WebSocketServer::Response Simulation::onSetViewport(
+    const Packet &j, const packets::SetViewport &p) {
+  using nlohmann::json;
+  WebSocketServer::Connection *connection = j.connection();
+  if (connection == nullptr) {
+    return {"", WebSocketServer::ResponseType::SILENCE};
+  }
+  Rect viewport =
+      Rect(p.min_x, p.min_y, p.max_x, p.max_y).expanded(VIEWPORT_MARGIN);
+  Rect old_viewport = connection->viewport;
+  bool had_viewport = connection->has_viewport;
+  connection->viewport = viewport;
+  connection->has_viewport = true;
+  if (had_viewport && old_viewport.contains(viewport)) {
+    return {"", WebSocketServer::ResponseType::SILENCE};
+  }
+
+  // The client has the current state of everything within its old viewport.
+  // Everything else that is now visible may have changed without the client
+  // being told. Without a previous viewport, e.g. after a resumed session,
+  // nothing can be assumed.
+  const Rect *known = had_viewport ? &old_viewport : nullptr;
+  json data;
+  data["tokens"] = json::array();
+  data["doodads"] = json::array();
+  for (uint64_t key : _index.query(viewport)) {
+    if (known != nullptr && _index.bounds(key)->intersects(*known)) {
+      continue;
+    }
+    if (indexKind(key) == IndexKind::TOKEN) {
+      Token *t = tokenById(indexId(key));
+      if (t != nullptr) {
+        data["tokens"].push_back(t->serialize());
+      }
+    } else if (indexKind(key) == IndexKind::DOODAD) {
+      Stroke *s = _strokes.get(indexId(key));
+      if (s != nullptr) {
+        data["doodads"].push_back(s->serialize());
+      }
+    }
+  }
+  _building_manager.syncArea(viewport, known, &data);
+
+  json response;
+  response["type"] = "Sync";
+  response["data"] = data;
+  return {response.dump(), WebSocketServer::ResponseType::RETURN,
+          Rect::everything(), WebSocketServer::Lane::BULK};
+}
+
+WebSocketServer::Response Simulation::onCreateLight(
+    const Packet &j, const packets::CreateLight &p) {
+  using nlohmann::json;
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  Vector2f position = p.position;
+  if (p.token != 0) {
+    // A carried light starts at the position of its token
+    Token *t = tokenById(p.token);
+    if (t == nullptr) {
+      return {"", WebSocketServer::ResponseType::SILENCE};
+    }
+    position = Vector2f(t->x(), t->y());
+  }
+  if (!(p.radius > 0 && p.radius <= MAX_LIGHT_RADIUS)) {
+    return {"The radius of a light has to be in (0, " +
+                std::to_string(MAX_LIGHT_RADIUS) + "]",
+            WebSocketServer::ResponseType::RETURN};
+  }
+  const Lighting::Light &light = _lighting.addLight(position, p.radius, p.token);
+  _lighting_cache.invalidate();
+
+  json response;
+  response["type"] = "CreateLight";
+  response["data"] = light.toJson();
+  return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
+}
+
+WebSocketServer::Response Simulation::onDeleteLight(
+    const Packet &j, const packets::DeleteLight &p) {
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  if (!_lighting.removeLight(p.id)) {
+    return {"", WebSocketServer::ResponseType::SILENCE};
+  }
+  _lighting_cache.invalidate();
+  return {"", WebSocketServer::ResponseType::FORWARD};
+}
+
+WebSocketServer::Response Simulation::onClearLights(
+    const Packet &j, const packets::ClearLights &) {
+  if (!j.checkPermissions(Permissions::GAMEMASTER)) {
+    return j.makeMissingPermissionsResponse();
+  }
+  _lighting.clear();
+  _lighting_cache.invalidate();
+  return {"", WebSocketServer::ResponseType::FORWARD};
+}
+
+WebSocketServer::Response Simulation::onQueryMovement(
+    const Packet &, const packets::QueryMovement &p) {
+  using nlohmann::json;
+  Token *t = tokenById(p.id);
+  if (t == nullptr) {
+    return {"", WebSocketServer::ResponseType::SILENCE};
+  }
+  if (!(p.budget >= 0 && p.budget <= MAX_MOVEMENT_BUDGET)) {
+    return {"The movement budget has to be in [0, " +
+                std::to_string(MAX_MOVEMENT_BUDGET) + "]",
+            WebSocketServer::ResponseType::RETURN};
+  }
+  NavGrid &nav_grid = _building_manager.navGrid();
+  Vector2f start(t->x(), t->y());
+
+  json data;
+  data["id"] = p.id;
+  data["cell_size"] = float(NavGrid::CELL_SIZE);
+  data["reachable"] = json::array();
+  for (const NavGrid::Span &span : nav_grid.reachable(start, p.budget)) {
+    data["reachable"].push_back({span.y, span.min_x, span.max_x});
+  }
+  // An empty path means the target can not be reached at all
+  std::vector<Vector2f> path;
+  float cost = 0;
+  data["path"] = json::array();
+  if (nav_grid.findPath(start, p.target, &path, &cost)) {
+    for (const Vector2f &point : path) {
+      data["path"].push_back(point.toJson());
+    }
+  }
+  data["cost"] = cost;
+
+  json response;
+  response["type"] = "Movement";
+  response["data"] = data;
+  return {response.dump(), WebSocketServer::ResponseType::RETURN};
+}
+
+WebSocketServer::Response Simulation::onQueryAreas(
+    const Packet &, const packets::QueryAreas &p) {
+  using nlohmann::json;
+  if (p.areas.size() > MAX_AREAS_PER_QUERY) {
+    return {"At most " + std::to_string(MAX_AREAS_PER_QUERY) +
+                " areas can be queried at once",
+            WebSocketServer::ResponseType::RETURN};
+  }
+  if (p.filter != "all" && p.filter != "enemies" && p.filter != "friends") {
+    return {"Unknown token filter " + p.filter,
+            WebSocketServer::ResponseType::RETURN};
+  }
+  std::vector<Area> areas;
+  for (const packets::AreaShape &shape : p.areas) {
+    float length = std::hypot(shape.target.x() - shape.origin.x(),
+                              shape.target.y() - shape.origin.y());
+    if (!(length <= MAX_AREA_SIZE && shape.width >= 0 &&
+          shape.width <= MAX_AREA_SIZE)) {
+      return {"Areas can be at most " + std::to_string(MAX_AREA_SIZE) +
+                  " across",
+              WebSocketServer::ResponseType::RETURN};
+    }
+    if (shape.shape == "circle") {
+      areas.push_back(Area::circle(shape.origin, length));
+    } else if (shape.shape == "cone") {
+      areas.push_back(Area::cone(shape.origin, shape.target, shape.angle));
+    } else if (shape.shape == "line") {
+      areas.push_back(Area::line(shape.origin, shape.target, shape.width));
+    } else if (shape.shape == "rectangle") {
+      areas.push_back(Area::rectangle(shape.origin, shape.target));
+    } else {
+      return {"Unknown area shape " + shape.shape,
+              WebSocketServer::ResponseType::RETURN};
+    }
+  }
+
+  json results = json::array();
+  for (const Area &area : areas) {
+    json ids = json::array();
+    // Tokens are indexed by their bounds, so every token touching the area
+    // is among the candidates.
+    for (uint64_t key : _index.query(area.bounds())) {
+      if (indexKind(key) != IndexKind::TOKEN) {
+        continue;
+      }
+      Token *t = tokenById(indexId(key));
+      if (t == nullptr || (p.filter == "enemies" && !t->is_enemy()) ||
+          (p.filter == "friends" && t->is_enemy())) {
+        continue;
+      }
+      Vector2f center(t->x(), t->y());
+      if (!area.touches(center, t->radius())) {
+        continue;
+      }
+      if (p.occlusion &&
+          _building_manager.isBlocked(area.origin(), center)) {
+        continue;
+      }
+      ids.push_back(t->id());
+    }
+    results.push_back(ids);
+  }
+
+  json response;
+  response["type"] = "AreaTokens";
+  response["data"]["query"] = p.query;
+  response["data"]["tokens"] = results;
+  return {response.dump(), WebSocketServer::ResponseType::RETURN};
+}
+
 std::string Simulation::cmdRollDice(const std::string &who,
                                     const std::vector<std::string> &cmd) {
   std::ostringstream out;
@@ -514,10 +1902,9 @@ std::vector<std::string> Simulation::splitWs(const std::string &s) {
 }
 
 Player *Simulation::getPlayer(const std::string &uid) {
-  for (Player &p : _players) {
-    if (p.uid == uid) {
-      return &p;
-    }
+  auto it = _player_ids.find(uid);
+  if (it == _player_ids.end()) {
+    return nullptr;
   }
-  return nullptr;
+  return &_players[it->second];
 }
@@ -16,35 +16,97 @@
 
 #pragma once
 
+#include <chrono>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "CachedSection.h"
+#include "BinaryStream.h"
+#include "DeltaLog.h"
 #include "Doodad.h"
+#include "BinaryProtocol.h"
 #include "IdGenerator.h"
+#include "Journal.h"
+#include "Lighting.h"
 #include "Packet.h"
+#include "PacketSchema.h"
 #include "Player.h"
+#include "Scene.h"
+#include "SlotMap.h"
 #include "Token.h"
 #include "WebSocketServer.h"
+#include "WorkQueue.h"
 #include "building/BuildingManager.h"
+#include "geometry/SpatialGrid.h"
 
 class Simulation {
-  using MemberMsgHandler_t =
-      std::function<WebSocketServer::Response(const Packet &)>;
-  //      WebSocketServer::Response (Simulation::*)(const nlohmann::json &);
-
   struct Color {
     uint8_t r, g, b;
   };
 
  public:
-  Simulation();
+  /**
+   * @param table The name of the table this simulation is running.
+   */
+  Simulation(const std::string &table);
 
   void setWebSocketServer(WebSocketServer *wss);
 
-  WebSocketServer::Response onNewClient();
-  WebSocketServer::Response onMessage(const std::string &msg);
+  /**
+   * @brief Moves the serialization of Init packets off the table's thread.
+   * @param table_queue The queue the simulation is accessed from.
+   * @param serializer Serializes immutable versions of the scene. Both queues
+   *                   have to outlive the tasks posted to them. Without a
+   *                   call to setExecutors Init packets are built in place.
+   */
+  void setExecutors(WorkQueue *table_queue, WorkQueue *serializer);
+
+  /**
+   * @brief Restores the state of the table saved in the directory and saves
+   *        every change from now on to it. Without a call to open the table
+   *        is not saved.
+   */
+  void open(const std::string &directory);
+  /**
+   * @return Whether the state of the table is saved, i.e. it was opened and
+   *         its saved state could be restored.
+   */
+  bool isPersistent();
+
+  /**
+   * @param msg The message as received, saved and forwarded as is.
+   * @param j The parsed message. It is parsed by the caller, so that only
+   *          applying the message is serialized on the table's thread.
+   */
+  WebSocketServer::Response onMessage(WebSocketServer::Connection *connection,
+                                      const std::string &msg,
+                                      const nlohmann::json &j);
+
+  /**
+   * @brief Handles a message using the binary protocol described in
+   *        BinaryProtocol.h
+   */
+  WebSocketServer::Response onBinaryMessage(
+      WebSocketServer::Connection *connection, const std::string &msg);
+
+  /**
+   * @brief Ends the strokes the player of the connection was still drawing,
+   *        unless the player is connected to the table in another session.
+   */
+  void onDisconnect(WebSocketServer::Connection *connection);
+
+  /**
+   * @brief Called at the broadcast tick rate. Sends the latest position of
+   *        every token moved since the last tick to the clients, as a single
+   *        MoveTokens packet, and reveals what the tokens can see now.
+   */
+  void onTick();
 
   /**
    * @return  The player with the uid or nullptr if no such player exists.
@@ -54,18 +116,231 @@ class Simulation {
  private:
   void broadcastClients();
 
-  WebSocketServer::Response onCreateToken(const Packet &j);
-  WebSocketServer::Response onMoveToken(const Packet &j);
-  WebSocketServer::Response onDeleteToken(const Packet &j);
+  /**
+   * @brief Fills in the text of forwarded responses and adds a sequence number
+   *        to responses that are sent to all clients.
+   */
+  void sequenceResponse(const std::string &msg,
+                        WebSocketServer::Response *response);
+
+  /**
+   * @brief Calls the handler of the packet with the given id, see
+   *        PacketSchema.h
+   * @param data The data member of the packet.
+   */
+  WebSocketServer::Response dispatch(packets::Id id, const Packet &j,
+                                     const nlohmann::json &data);
+  /**
+   * @brief Decodes the binary packet and calls its handler.
+   */
+  WebSocketServer::Response dispatchBinary(binary::PacketType type,
+                                           const Packet &j,
+                                           BinaryReader *reader);
+
+  /**
+   * @brief Applies a message saved in the journal again, without sending
+   *        anything to the clients.
+   */
+  void replay(const std::string &record);
+  /**
+   * @return A function returning the current state of the table in a compact
+   *         binary encoding, which can be called on any thread. The state only
+   *         sent to the clients, like the light map, is left out.
+   */
+  std::function<std::string()> prepareSnapshot();
+  /**
+   * @brief Replaces the state with one written by prepareSnapshot.
+   * @throws std::exception if the snapshot can not be read.
+   */
+  void readSnapshot(const std::string &snapshot);
+
+  WebSocketServer::Response onCreateToken(const Packet &j,
+                                          const packets::CreateToken &p);
+  WebSocketServer::Response onMoveToken(const Packet &j,
+                                        const packets::MoveToken &p);
+  WebSocketServer::Response onDeleteToken(const Packet &j,
+                                          const packets::DeleteToken &p);
+  /**
+   * @brief The bulk versions of the token packets. They are applied
+   *        completely or not at all, and sent to the clients as one packet.
+   */
+  WebSocketServer::Response onCreateTokens(const Packet &j,
+                                           const packets::CreateTokens &p);
+  WebSocketServer::Response onMoveTokens(const Packet &j,
+                                         const packets::MoveTokens &p);
+  WebSocketServer::Response onDeleteTokens(const Packet &j,
+                                           const packets::DeleteTokens &p);
   WebSocketServer::Response onChat(const Packet &j);
-  WebSocketServer::Response onCreateDoodadLine(const Packet &j);
-  WebSocketServer::Response onClearDoodads(const Packet &j);
-  WebSocketServer::Response onClearTokens(const Packet &j);
-  WebSocketServer::Response onTokenToggleFoe(const Packet &j);
+  /**
+   * @brief Creates a complete stroke with a single segment.
+   */
+  WebSocketServer::Response onCreateDoodadLine(
+      const Packet &j, const packets::CreateDoodadLine &p);
+  /**
+   * @brief Starts a stroke and sends it to the clients right away. The points
+   *        appended until it ends are sent on the following ticks.
+   */
+  WebSocketServer::Response onBeginStroke(const Packet &j,
+                                          const packets::BeginStroke &p);
+  WebSocketServer::Response onAppendStroke(const Packet &j,
+                                           const packets::AppendStroke &p);
+  WebSocketServer::Response onEndStroke(const Packet &j,
+                                        const packets::EndStroke &p);
+  WebSocketServer::Response onClearDoodads(const Packet &j,
+                                           const packets::ClearDoodads &p);
+  WebSocketServer::Response onClearTokens(const Packet &j,
+                                          const packets::ClearTokens &p);
+  WebSocketServer::Response onTokenToggleFoe(
+      const Packet &j, const packets::TokenToggleFoe &p);
   WebSocketServer::Response onInitSession(const Packet &j);
-  WebSocketServer::Response onSetUsername(const Packet &j);
+  WebSocketServer::Response onSetUsername(const Packet &j,
+                                          const packets::SetUsername &p);
+  /**
+   * @brief Stores the viewport of the client and sends it the current state
+   *        of everything that became visible.
+   */
+  WebSocketServer::Response onSetViewport(const Packet &j,
+                                          const packets::SetViewport &p);
+  WebSocketServer::Response onCreateLight(const Packet &j,
+                                          const packets::CreateLight &p);
+  WebSocketServer::Response onDeleteLight(const Packet &j,
+                                          const packets::DeleteLight &p);
+  WebSocketServer::Response onClearLights(const Packet &j,
+                                          const packets::ClearLights &p);
+  /**
+   * @brief Answers with the cells the token can reach within the budget and
+   *        the shortest path from the token to the target.
+   */
+  WebSocketServer::Response onQueryMovement(const Packet &j,
+                                            const packets::QueryMovement &p);
+  /**
+   * @brief Answers with the ids of the tokens inside of every area, in the
+   *        order of the areas.
+   */
+  WebSocketServer::Response onQueryAreas(const Packet &j,
+                                         const packets::QueryAreas &p);
+
+  void broadcastMoves();
+  /**
+   * @brief Sends the points appended to strokes, and the strokes that ended,
+   *        since the last tick as a single AppendStrokes packet.
+   */
+  void broadcastStrokes();
+  /**
+   * @brief Joins and compacts up to COMPACTION_BATCH of the strokes completed
+   *        since, so that a table with many strokes does not stall a tick.
+   *        Clients keep compacted strokes as they received them, but are
+   *        told about joined ones.
+   */
+  void compactStrokes();
+  /**
+   * @brief Tells all clients which strokes were absorbed by others and sends
+   *        the strokes they were joined to in full.
+   */
+  void broadcastJoinedStrokes(const std::vector<uint64_t> &absorbed,
+                              const std::vector<uint64_t> &joined);
+
+  /**
+   * @brief Recomputes the visible area of every stale token and broadcasts
+   *        the building elements they newly revealed.
+   * @param occluder_changes The areas in which walls or doors changed.
+   */
+  void updateVisibility(const std::vector<Rect> &occluder_changes);
+  void invalidateVisibility(uint64_t token_id);
+
+  /**
+   * @brief Recomputes the lights affected by changes and broadcasts the
+   *        changed light map tiles.
+   */
+  void updateLighting(const std::vector<Rect> &occluder_changes);
+
+  /**
+   * @brief Encodes the moves as a MoveTokens packet, as json without a
+   *        sequence number and for the binary protocol.
+   */
+  void encodeMoves(const std::vector<packets::MoveToken> &moves, uint64_t seq,
+                   std::string *text, std::string *binary);
 
   Token *tokenById(uint64_t id);
+  Token &createToken(const Vector2f &position);
+  void moveToken(Token *t, float x, float y, float rotation);
+  void deleteToken(uint64_t id);
+  /**
+   * @brief Tells all clients about lights that were removed along with the
+   *        tokens carrying them.
+   */
+  void broadcastDeletedLights(const std::vector<uint64_t> &ids);
+
+  /**
+   * @return The stroke the player is drawing under the number or nullptr.
+   */
+  Stroke *openStroke(const Packet &j, uint64_t stroke);
+  /**
+   * @brief Remembers what the clients know of the stroke before it changes
+   *        for the first time since the last tick.
+   */
+  void changeStroke(Stroke &stroke);
+  /**
+   * @brief Ends all strokes the player is drawing.
+   * @return Whether the player was drawing any stroke.
+   */
+  bool endStrokes(const std::string &uid);
+
+  /**
+   * @brief Everything sent with an Init packet, as it was at one sequence
+   *        number.
+   */
+  struct InitState {
+    Scene scene;
+    std::string tiles;
+    std::string lighting;
+    size_t next_color;
+    uint64_t epoch;
+    uint64_t seq;
+  };
+
+  /**
+   * @return The current versions of the tokens, strokes and building. Only
+   *         the parts modified since the last call are copied.
+   */
+  Scene captureScene();
+  InitState captureInit();
+  /**
+   * @return The serialized Init packet. The sections of the scene are only
+   *         serialized once per version. Safe to call from any thread.
+   */
+  static std::string encodeInit(const InitState &state);
+  /**
+   * @return The current Init packet, built on the calling thread.
+   */
+  std::string initPacket();
+  /**
+   * @brief Serializes the Init packet, on the serializer if there is one, and
+   *        sends it with the session and the packets broadcast in the
+   *        meantime once done.
+   * @param session The Session packet sent first, may be empty.
+   */
+  void sendInit(const WebSocketServer::ConnectionPtr &connection,
+                std::string session);
+  /**
+   * @param seq The sequence number the Init packet was built at.
+   */
+  void deliverInit(const WebSocketServer::ConnectionPtr &connection,
+                   const std::string &session, uint64_t seq,
+                   const std::string &init);
+  /**
+   * @brief Sends the moves to a single client, in the protocol it uses.
+   */
+  void sendMoves(const WebSocketServer::ConnectionPtr &connection,
+                 const std::vector<packets::MoveToken> &moves, uint64_t seq);
+  WebSocketServer::ConnectionPtr findConnection(
+      WebSocketServer::Connection *connection);
+  /**
+   * @brief Sends the state again to the clients that missed updates because
+   *        they fell behind and caught up since, and reports clients which
+   *        fall behind.
+   */
+  void checkSendQueues();
 
   std::vector<std::string> splitWs(const std::string &s);
 
@@ -79,27 +354,119 @@ class Simulation {
                       const std::vector<std::string> &cmd);
 
   Color nextColor();
+  Player &addPlayer(const std::string &uid);
+
+  std::string _table;
 
   size_t _next_color;
 
   unsigned int _rand_seed;
 
-  std::vector<Token> _tokens;
-  std::vector<DoodadLine> _doodad_lines;
+  // The id of a token is its handle
+  SlotMap<Token> _tokens;
+  // The id of a stroke is its handle
+  SlotMap<Stroke> _strokes;
+  // The strokes being drawn, by the uid of the player and the number the
+  // client gave the stroke.
+  std::map<std::pair<std::string, uint64_t>, uint64_t> _open_strokes;
+
+  // The ids of the tokens moved since the last tick, in the order of their
+  // first move.
+  std::vector<uint64_t> _moved_tokens;
+  // The bounds of the moved tokens at the last tick
+  std::unordered_map<uint64_t, Rect> _moved_from;
+
+  // The number of coordinates and the bounds of a stroke at the last tick
+  struct SentStroke {
+    size_t size;
+    Rect bounds;
+  };
+  // The ids of the strokes changed since the last tick, in the order of their
+  // first change.
+  std::vector<uint64_t> _changed_strokes;
+  std::unordered_map<uint64_t, SentStroke> _sent_strokes;
+  // The complete strokes that were not compacted yet, oldest first
+  std::vector<uint64_t> _uncompacted_strokes;
 
+  // The bounds of all tokens and doodads
+  SpatialGrid _index;
+
+  // The area visible to every friendly token, and the tokens whose area has
+  // to be recomputed on the next tick.
+  std::unordered_map<uint64_t, Visible> _visible;
+  std::unordered_set<uint64_t> _stale_visible;
+
+  Lighting _lighting;
+
+  // Players are never removed, their id is their index in _players
   std::vector<Player> _players;
+  std::unordered_map<std::string, size_t> _player_ids;
+
+  // The latest versions of the tokens and strokes handed out, and the
+  // serialized sections of the init packet that are not part of the scene.
+  VersionedSection<SlotMap<Token>> _tokens_cache;
+  VersionedSection<SlotMap<Stroke>> _doodads_cache;
+  CachedSection _tiles_cache;
+  CachedSection _lighting_cache;
+
+  // The latest move of every token, held back for clients that fall behind
+  typedef std::unordered_map<uint64_t, packets::MoveToken> HeldMoves;
+  std::map<std::weak_ptr<WebSocketServer::Connection>, HeldMoves,
+           std::owner_less<std::weak_ptr<WebSocketServer::Connection>>>
+      _held_moves;
+  std::chrono::steady_clock::time_point _next_queue_report;
+
+  // Null unless setExecutors was called
+  WorkQueue *_table_queue;
+  WorkQueue *_serializer;
+
+  // The recent state changing packets, used to resume sessions
+  DeltaLog _deltas;
 
+  // Saves the messages that changed the state and snapshots of the state,
+  // null if the table is not saved.
+  std::unique_ptr<Journal> _journal;
+  size_t _records_since_snapshot;
+
+  // Guards the state of this table only, other tables have their own
+  // simulation.
   std::mutex _simulation_mutex;
 
   std::string tiles_path_;
 
+  static const size_t MAX_DELTA_ENTRIES = 4096;
+  static const size_t MAX_DELTA_BYTES = 4 * 1024 * 1024;
+  // A snapshot is taken once this many messages were saved since the last,
+  // which bounds the time needed to replay them on the next start.
+  static const size_t SNAPSHOT_INTERVAL = 20000;
+  static const uint32_t SNAPSHOT_VERSION = 2;
+  // Clients falling behind are reported at most this often
+  static const int QUEUE_REPORT_SECONDS = 60;
+
+  // Clients receive updates up to this distance outside of their viewport
+  static constexpr float VIEWPORT_MARGIN = 10;
+  static constexpr float INDEX_CELL_SIZE = 8;
+  // How far tokens can see when nothing blocks their view
+  static constexpr float VISION_RANGE = 30;
+  static constexpr float MAX_LIGHT_RADIUS = 50;
+  static constexpr float MAX_MOVEMENT_BUDGET = 60;
+  // Limits for area queries, a template is at most this far across
+  static constexpr float MAX_AREA_SIZE = 200;
+  static const size_t MAX_AREAS_PER_QUERY = 64;
+  static const size_t MAX_TOKENS_PER_PACKET = 1024;
+  // The maximum number of coordinates of a stroke
+  static const size_t MAX_STROKE_SIZE = 1 << 16;
+  // Compacting a stroke drops points closer than this to the simplified line
+  static constexpr float SIMPLIFY_TOLERANCE = 0.02;
+  static const size_t COMPACTION_BATCH = 32;
+
   static const int NUM_COLORS = 11;
   static const Color COLORS[NUM_COLORS];
 
-  std::unordered_map<std::string, MemberMsgHandler_t> _msg_handlers;
-
   WebSocketServer *web_socket_server_;
 
-  BuildingManager _building_manager;
+  // Declared before the building manager, which takes an id for its building
+  // when it is constructed.
   IdGenerator _id_generator;
+  BuildingManager _building_manager;
 };
@@ -0,0 +1,236 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "BinaryStream.h"
+
+/**
+ * @brief A container with O(1) insertion, lookup and removal by handle. The
+ *        values are kept densely packed in a single vector, which makes
+ *        iterating over them as fast as iterating over a std::vector.
+ *
+ *        A handle consists of the index of a slot and the generation of that
+ *        slot. Removing a value increments the generation of its slot, which
+ *        invalidates all old handles referring to it. Handles stay below 2^53
+ *        so they can be used as ids by the javascript client.
+ *
+ *        Maps with different tags never hand out the same handle, so several
+ *        maps can share one space of ids.
+ */
+template <typename T>
+class SlotMap {
+  struct Slot {
+    uint32_t dense_index;
+    uint32_t generation;
+  };
+
+ public:
+  using iterator = typename std::vector<T>::iterator;
+  using const_iterator = typename std::vector<T>::const_iterator;
+
+  /**
+   * @param tag A number up to MAX_TAG, stored in every handle.
+   */
+  explicit SlotMap(uint32_t tag = 0) : _tag(tag & MAX_TAG) {}
+
+  /**
+   * @param make A callable taking the handle of the new value and returning
+   *             the value.
+   * @return The inserted value. The reference is invalidated by the next
+   *         insertion or removal.
+   */
+  template <typename F>
+  T &create(F make) {
+    uint32_t index;
+    if (_free_slots.empty()) {
+      if (_slots.size() > INDEX_MASK) {
+        throw std::length_error("A slot map ran out of slots.");
+      }
+      index = _slots.size();
+      _slots.push_back({0, 1});
+    } else {
+      index = _free_slots.back();
+      _free_slots.pop_back();
+    }
+    Slot &slot = _slots[index];
+    slot.dense_index = _values.size();
+    uint64_t handle = makeHandle(index, slot.generation);
+    _values.emplace_back(make(handle));
+    _handles.push_back(handle);
+    return _values.back();
+  }
+
+  /**
+   * @return The value with the given handle or nullptr if the handle is
+   *         invalid or the value was removed.
+   */
+  T *get(uint64_t handle) {
+    const Slot *slot = findSlot(handle);
+    if (slot == nullptr) {
+      return nullptr;
+    }
+    return &_values[slot->dense_index];
+  }
+
+  const T *get(uint64_t handle) const {
+    return const_cast<SlotMap<T> *>(this)->get(handle);
+  }
+
+  /**
+   * @return True if a value with the handle existed.
+   */
+  bool erase(uint64_t handle) {
+    Slot *slot = findSlot(handle);
+    if (slot == nullptr) {
+      return false;
+    }
+    uint32_t dense_index = slot->dense_index;
+    // Move the last value into the gap to keep the values dense
+    if (dense_index + 1 < _values.size()) {
+      _values[dense_index] = std::move(_values.back());
+      _handles[dense_index] = _handles.back();
+      _slots[slotIndex(_handles[dense_index])].dense_index = dense_index;
+    }
+    _values.pop_back();
+    _handles.pop_back();
+
+    release(slotIndex(handle));
+    return true;
+  }
+
+  /**
+   * @brief Removes all values. Their slots keep counting generations, so the
+   *        handles of the removed values stay invalid.
+   */
+  void clear() {
+    for (uint64_t handle : _handles) {
+      release(slotIndex(handle));
+    }
+    _values.clear();
+    _handles.clear();
+  }
+
+  /**
+   * @brief Writes the values together with the state of the slots, so that
+   *        read restores the same handles and hands out the same handles for
+   *        new values afterwards.
+   * @param write_value Called with the writer and every value.
+   */
+  template <typename F>
+  void write(BinaryWriter *writer, F write_value) const {
+    writer->write(uint32_t(_slots.size()));
+    for (const Slot &slot : _slots) {
+      writer->write(slot.dense_index);
+      writer->write(slot.generation);
+    }
+    writer->write(uint32_t(_free_slots.size()));
+    for (uint32_t index : _free_slots) {
+      writer->write(index);
+    }
+    writer->write(uint32_t(_values.size()));
+    for (size_t i = 0; i < _values.size(); ++i) {
+      writer->write(_handles[i]);
+      write_value(writer, _values[i]);
+    }
+  }
+
+  /**
+   * @brief Replaces the contents with those written by write.
+   * @param read_value Called with the reader and the handle of every value,
+   *                   returns the value.
+   * @throws std::out_of_range if the data ends early or is inconsistent.
+   */
+  template <typename F>
+  void read(BinaryReader *reader, F read_value) {
+    clear();
+    _slots.resize(reader->read<uint32_t>());
+    for (Slot &slot : _slots) {
+      slot.dense_index = reader->read<uint32_t>();
+      slot.generation = reader->read<uint32_t>();
+    }
+    _free_slots.resize(reader->read<uint32_t>());
+    for (uint32_t &index : _free_slots) {
+      index = reader->read<uint32_t>();
+    }
+    uint32_t count = reader->read<uint32_t>();
+    for (uint32_t i = 0; i < count; ++i) {
+      uint64_t handle = reader->read<uint64_t>();
+      if (slotIndex(handle) >= _slots.size()) {
+        throw std::out_of_range("A handle refers to a missing slot.");
+      }
+      _handles.push_back(handle);
+      _values.emplace_back(read_value(reader, handle));
+    }
+  }
+
+  size_t size() const { return _values.size(); }
+  bool empty() const { return _values.empty(); }
+
+  static const uint32_t MAX_TAG = 3;
+
+  iterator begin() { return _values.begin(); }
+  iterator end() { return _values.end(); }
+  const_iterator begin() const { return _values.begin(); }
+  const_iterator end() const { return _values.end(); }
+
+ private:
+  // 2 bits of tag, 30 bits of slot index and 21 bits of generation fit into
+  // 53 bits
+  static const uint32_t MAX_GENERATION = (1u << 21) - 1;
+  static const uint32_t INDEX_MASK = (1u << 30) - 1;
+
+  uint64_t makeHandle(uint32_t index, uint32_t generation) const {
+    return (uint64_t(generation) << 32) | (uint64_t(_tag) << 30) | index;
+  }
+
+  static uint32_t slotIndex(uint64_t handle) {
+    return uint32_t(handle) & INDEX_MASK;
+  }
+
+  /**
+   * @brief Invalidates all handles of the slot and makes it available again.
+   */
+  void release(uint32_t index) {
+    Slot &slot = _slots[index];
+    slot.generation = (slot.generation + 1) & MAX_GENERATION;
+    if (slot.generation == 0) {
+      slot.generation = 1;
+    }
+    _free_slots.push_back(index);
+  }
+
+  Slot *findSlot(uint64_t handle) {
+    uint32_t index = slotIndex(handle);
+    if (index >= _slots.size() ||
+        _slots[index].generation != uint32_t(handle >> 32)) {
+      return nullptr;
+    }
+    return &_slots[index];
+  }
+
+  std::vector<T> _values;
+  // The handle of every value, in the same order as _values
+  std::vector<uint64_t> _handles;
+  std::vector<Slot> _slots;
+  std::vector<uint32_t> _free_slots;
+  uint32_t _tag;
+};
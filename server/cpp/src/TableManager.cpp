@@ -0,0 +1,212 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "TableManager.h"
+
+#include <algorithm>
+#include <cctype>
+
+#include "Logger.h"
+
+namespace {
+// Table names are chosen by the clients. Everything but letters, digits, '-'
+// and '_' is escaped, so that a name can not point outside of the state
+// directory.
+std::string directoryName(const std::string &table) {
+  static const char *HEX = "0123456789abcdef";
+  std::string name;
+  for (char c : table) {
+    if (std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_') {
+      name += c;
+    } else {
+      name += '%';
+      name += HEX[static_cast<unsigned char>(c) >> 4];
+      name += HEX[static_cast<unsigned char>(c) & 0xf];
+    }
+  }
+  return name;
+}
+
+// Returns once the tasks posted to the queue so far ran
+void drain(WorkQueue *queue) {
+  std::promise<void> done;
+  queue->post([&done]() { done.set_value(); });
+  done.get_future().wait();
+}
+}  // namespace
+
+TableManager::Table::Table(const std::string &name,
+                          std::chrono::milliseconds tick_interval,
+                          WorkQueue *serializer)
+    : name(name), simulation(name) {
+  simulation.setExecutors(&queue, serializer);
+  queue.setTick(tick_interval, [this]() { simulation.onTick(); });
+}
+
+TableManager::TableManager(int tick_rate, const std::string &state_dir,
+                           size_t max_tables)
+    : _web_socket_server(nullptr),
+      _tick_interval(std::max(1, 1000 / std::max(1, tick_rate))),
+      _state_dir(state_dir),
+      _max_tables(max_tables) {
+  _closer.setTick(std::chrono::seconds(int(CLOSE_CHECK_SECONDS)),
+                  [this]() { closeIdleTables(); });
+}
+
+void TableManager::setWebSocketServer(WebSocketServer *wss) {
+  std::lock_guard<std::mutex> lock(_tables_mutex);
+  _web_socket_server = wss;
+  for (auto &it : _tables) {
+    it.second->simulation.setWebSocketServer(wss);
+  }
+}
+
+TableManager::Table *TableManager::table(const std::string &name) {
+  std::unique_ptr<Table> &t = _tables[name];
+  if (!t) {
+    LOG_INFO << "Opening the table '" << name << "'" << LOG_END;
+    t = std::make_unique<Table>(name, _tick_interval, &_serializer);
+    t->simulation.setWebSocketServer(_web_socket_server);
+    if (!_state_dir.empty()) {
+      // Restoring the table is the first task of its queue, the messages of
+      // the clients are handled after it.
+      Table *restored = t.get();
+      std::string directory = _state_dir + "/" + directoryName(name);
+      // The journal may still be written by the table's previous instance
+      std::shared_future<void> closed;
+      auto closing = _closing.find(name);
+      if (closing != _closing.end()) {
+        closed = closing->second;
+      }
+      t->queue.post([restored, directory, closed]() {
+        if (closed.valid()) {
+          closed.wait();
+        }
+        restored->simulation.open(directory);
+      });
+    }
+  }
+  t->last_used = std::chrono::steady_clock::now();
+  return t.get();
+}
+
+void TableManager::post(const std::string &name,
+                        std::function<void(Table *)> task) {
+  std::lock_guard<std::mutex> lock(_tables_mutex);
+  Table *t = table(name);
+  t->queue.post([t, task]() { task(t); });
+}
+
+void TableManager::closeIdleTables() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<std::pair<std::unique_ptr<Table>, std::promise<void>>> idle;
+  {
+    std::lock_guard<std::mutex> lock(_tables_mutex);
+    for (auto it = _tables.begin(); it != _tables.end();) {
+      if (now - it->second->last_used <
+              std::chrono::seconds(int(TABLE_IDLE_SECONDS)) ||
+          (_web_socket_server != nullptr &&
+           !_web_socket_server->tableConnections(it->first)->empty()) ||
+          !it->second->simulation.isPersistent()) {
+        // Closing a table that is not saved would lose its state
+        ++it;
+        continue;
+      }
+      idle.emplace_back(std::move(it->second), std::promise<void>());
+      _closing[it->first] = idle.back().second.get_future().share();
+      it = _tables.erase(it);
+    }
+  }
+  for (auto &closed : idle) {
+    std::string name = closed.first->name;
+    LOG_INFO << "Closing the idle table '" << name << "'" << LOG_END;
+    closeTable(std::move(closed.first));
+    closed.second.set_value();
+    std::lock_guard<std::mutex> lock(_tables_mutex);
+    auto it = _closing.find(name);
+    if (it != _closing.end() &&
+        it->second.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready) {
+      _closing.erase(it);
+    }
+  }
+}
+
+void TableManager::closeTable(std::unique_ptr<Table> table) {
+  // Without ticks the table does not start any work on its own
+  table->queue.setTick(_tick_interval, nullptr);
+  // The tasks posted before the table was closed may hand work to the
+  // serializer, which posts the result back to the table's queue.
+  drain(&table->queue);
+  drain(&_serializer);
+  drain(&table->queue);
+  table.reset();
+}
+
+bool TableManager::onNewClient(WebSocketServer::ConnectionPtr connection) {
+  // The client receives the state of the table once it sent an InitSession.
+  // Opening the table now allows it to start working on that right away.
+  std::lock_guard<std::mutex> lock(_tables_mutex);
+  // Tables that are still closing hold on to their threads as well
+  if (_tables.find(connection->table) == _tables.end() &&
+      _tables.size() + _closing.size() >= _max_tables) {
+    LOG_WARN << "Not opening the table '" << connection->table << "', "
+             << _tables.size() << " tables are open already" << LOG_END;
+    return false;
+  }
+  table(connection->table);
+  return true;
+}
+
+void TableManager::onClientLeft(WebSocketServer::ConnectionPtr connection) {
+  std::lock_guard<std::mutex> lock(_tables_mutex);
+  auto it = _tables.find(connection->table);
+  if (it == _tables.end()) {
+    return;
+  }
+  Table *t = it->second.get();
+  t->queue.post([t, connection]() {
+    t->simulation.onDisconnect(connection.get());
+  });
+}
+
+void TableManager::onMessage(WebSocketServer::ConnectionPtr connection,
+                             const std::string &msg, bool is_binary) {
+  if (is_binary) {
+    // Binary packets have a fixed layout and are decoded in place
+    post(connection->table, [this, connection, msg](Table *t) {
+      _web_socket_server->handleResponse(
+          t->simulation.onBinaryMessage(connection.get(), msg), connection);
+    });
+    return;
+  }
+  // Parsing is done on the io thread that received the message, the
+  // table's queue only applies it.
+  nlohmann::json j;
+  try {
+    j = nlohmann::json::parse(msg);
+  } catch (const std::exception &e) {
+    LOG_ERROR << "Unable to parse a msg from a client " << e.what() << "\n"
+              << msg << LOG_END;
+    _web_socket_server->handleResponse(
+        {"Error handling a message.", WebSocketServer::ResponseType::RETURN},
+        connection);
+    return;
+  }
+  post(connection->table, [this, connection, msg, j](Table *t) {
+    _web_socket_server->handleResponse(
+        t->simulation.onMessage(connection.get(), msg, j), connection);
+  });
+}
@@ -0,0 +1,128 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "Simulation.h"
+#include "WebSocketServer.h"
+#include "WorkQueue.h"
+
+/**
+ * @brief Hosts the independent game tables of the server. Every table has its
+ *        own Simulation which is only ever accessed from the table's
+ *        WorkQueue, so the tables never wait on each other. The Init packets
+ *        of all tables are serialized on a shared queue, from immutable
+ *        versions of the scene, so a table keeps handling messages meanwhile.
+ *
+ *        Tables are opened by the first client that connects to them, and
+ *        closed once they had no clients for TABLE_IDLE_SECONDS, unless their
+ *        state can not be saved. Every table runs its own threads, so at most
+ *        max_tables are open at once.
+ */
+class TableManager {
+  struct Table {
+    Table(const std::string &name, std::chrono::milliseconds tick_interval,
+          WorkQueue *serializer);
+
+    std::string name;
+    Simulation simulation;
+    // When a client last connected or sent a message. Guarded by
+    // _tables_mutex.
+    std::chrono::steady_clock::time_point last_used;
+    // Declared last, so the queue's thread is joined before the simulation
+    // is destroyed.
+    WorkQueue queue;
+  };
+
+ public:
+  /**
+   * @param tick_rate The number of times per second the tables send batched
+   *                  updates, like token moves, to their clients. Rates
+   *                  above 1000 are treated as 1000.
+   * @param state_dir Every table saves its state in a directory below this
+   *                  one. Tables are not saved if it is empty.
+   * @param max_tables The number of tables that may be open, or still be
+   *                   closing, at the same time.
+   */
+  TableManager(int tick_rate, const std::string &state_dir,
+               size_t max_tables);
+
+  void setWebSocketServer(WebSocketServer *wss);
+
+  /**
+   * @brief Opens the client's table, unless that would exceed max_tables.
+   * @return Whether the client may join its table.
+   */
+  bool onNewClient(WebSocketServer::ConnectionPtr connection);
+  /**
+   * @brief Lets the client's table clean up after it, e.g. end the strokes it
+   *        was still drawing. A table that was closed meanwhile is not
+   *        opened again for that.
+   */
+  void onClientLeft(WebSocketServer::ConnectionPtr connection);
+  void onMessage(WebSocketServer::ConnectionPtr connection,
+                 const std::string &msg, bool is_binary);
+
+ private:
+  /**
+   * @return The table with the given name. The table is created if it does
+   *         not exist yet. Has to be called with the _tables_mutex held.
+   */
+  Table *table(const std::string &name);
+  /**
+   * @brief Runs task on the queue of the table with the given name. The task
+   *        is posted with the tables locked, so no task reaches a table
+   *        after it started closing.
+   */
+  void post(const std::string &name, std::function<void(Table *)> task);
+
+  /**
+   * @brief Closes the saved tables that had no clients for
+   *        TABLE_IDLE_SECONDS. Runs on the _closer.
+   */
+  void closeIdleTables();
+  /**
+   * @brief Waits for the work the table handed to the serializer and
+   *        destroys the table, which writes everything it journaled.
+   */
+  void closeTable(std::unique_ptr<Table> table);
+
+  static const int TABLE_IDLE_SECONDS = 10 * 60;
+  static const int CLOSE_CHECK_SECONDS = 60;
+
+  std::mutex _tables_mutex;
+  std::unordered_map<std::string, std::unique_ptr<Table>> _tables;
+  // The tables being closed. A table that is opened again meanwhile waits
+  // for this before it reads its journal.
+  std::unordered_map<std::string, std::shared_future<void>> _closing;
+  // Declared after the tables, so it is drained while their queues still
+  // accept the finished packets.
+  WorkQueue _serializer;
+  // Declared last, it waits for the serializer while closing tables
+  WorkQueue _closer;
+
+  WebSocketServer *_web_socket_server;
+  std::chrono::milliseconds _tick_interval;
+  std::string _state_dir;
+  size_t _max_tables;
+};
@@ -17,7 +17,15 @@
 #include "Token.h"
 
 Token::Token()
-    : _id(0), _x(0), _y(0), _radius(0), _r(1), _g(1), _b(1), _is_enemy(false) {}
+    : _id(0),
+      _x(0),
+      _y(0),
+      _radius(0),
+      _r(1),
+      _g(1),
+      _b(1),
+      _is_enemy(false),
+      _rotation(0) {}
 
 nlohmann::json Token::serialize() {
   using nlohmann::json;
@@ -16,21 +16,56 @@
 
 #include "WebSocketServer.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <memory>
 #include <thread>
 
+#include <openssl/ssl.h>
+
+#include "BinaryProtocol.h"
 #include "Logger.h"
+#include "Os.h"
+
+const std::string WebSocketServer::DEFAULT_TABLE = "default";
+
+WebSocketServer::Connection::Connection(websocketpp::connection_hdl hdl,
+                                        const std::string &table)
+    : hdl(hdl),
+      table(table),
+      binary_protocol(false),
+      viewport(Rect::everything()),
+      has_viewport(false),
+      is_stale(false),
+      uses_deflate(false),
+      num_unstarted(0) {}
 
 WebSocketServer::WebSocketServer(std::shared_ptr<Authenticator> authenticator,
                                  OnMsgHandler_t on_msg,
                                  OnConnectHandler_t on_connect,
-                                 std::string base_dir)
+                                 OnDisconnectHandler_t on_disconnect,
+                                 std::string base_dir, size_t num_io_threads,
+                                 const DeflateSettings &deflate_settings)
     : _authenticator(authenticator),
+      _msg_manager(std::make_shared<ServerConfig::con_msg_manager_type>()),
       _on_msg(on_msg),
       _on_connect(on_connect),
+      _on_disconnect(on_disconnect),
       _do_key_check(true),
-      _base_dir(base_dir) {
+      _base_dir(base_dir),
+      _num_io_threads(std::max<size_t>(1, num_io_threads)),
+      _next_tls_check(0),
+      _deflate_settings(deflate_settings),
+      _deflated_messages(0),
+      _deflate_bytes_in(0),
+      _deflate_bytes_out(0),
+      _deflate_nanoseconds(0),
+      _next_deflate_report(
+          std::chrono::duration_cast<std::chrono::seconds>(
+              std::chrono::steady_clock::now().time_since_epoch())
+              .count() +
+          DEFLATE_REPORT_SECONDS) {
   std::thread t(&WebSocketServer::run, this);
   t.detach();
 }
@@ -54,9 +89,30 @@ void WebSocketServer::run() {
                                                       "Not Authenticated.");
             return;
           }
-          _connections.push_back(conn_hdl);
-          Response resp = _on_connect();
-          handleResponse(resp, conn_hdl);
+          std::string table = tableFromResource(
+              _socket.get_con_from_hdl(conn_hdl)->get_resource());
+          ConnectionPtr connection =
+              std::make_shared<Connection>(conn_hdl, table);
+          bool context_takeover = _deflate_settings.context_takeover;
+          if (_deflate_settings.level > 0 &&
+              acceptsDeflate(_socket.get_con_from_hdl(conn_hdl)
+                                 ->get_response_header(
+                                     "Sec-WebSocket-Extensions"),
+                             &context_takeover)) {
+            connection->uses_deflate = true;
+            if (context_takeover) {
+              connection->deflater = std::unique_ptr<Deflater>(
+                  new Deflater(_deflate_settings.level, true));
+            }
+          }
+          if (!_on_connect(connection)) {
+            // 1013 is "Try Again Later"
+            _socket.get_con_from_hdl(conn_hdl)->close(
+                1013, "The table can not be opened.");
+            return;
+          }
+          _socket.get_con_from_hdl(conn_hdl)->state = connection;
+          _connections.insert(connection);
         } catch (const std::exception &e) {
           LOG_ERROR << "Error while handling a new client: " << e.what()
                     << LOG_END;
@@ -67,25 +123,29 @@ void WebSocketServer::run() {
 
       _socket.set_close_handler([this](websocketpp::connection_hdl conn_hdl) {
         LOG_DEBUG << "A client disconnected" << LOG_END;
-        for (int64_t i = 0; i < _connections.size(); i++) {
-          websocketpp::connection_hdl hdl = _connections[i];
-          if (_socket.get_con_from_hdl(conn_hdl) ==
-              _socket.get_con_from_hdl(hdl)) {
-            LOG_DEBUG << "Removing a connection" << LOG_END;
-            _connections.erase(_connections.begin() + i);
-            i--;
-          }
+        // A client that never got past authentication was not registered
+        ConnectionPtr connection =
+            std::move(_socket.get_con_from_hdl(conn_hdl)->state);
+        if (connection != nullptr) {
+          LOG_DEBUG << "Removing a connection" << LOG_END;
+          _connections.remove(connection);
+          _on_disconnect(connection);
         }
       });
 
       _socket.set_message_handler([this](websocketpp::connection_hdl conn_hdl,
                                          Server::message_ptr msg) {
         try {
-          Response resp = _on_msg(msg->get_payload());
-          if (resp.type == ResponseType::FORWARD) {
-            resp.text = msg->get_payload();
+          // The state is kept with the socket, so finding it does not
+          // synchronize the io threads
+          ConnectionPtr connection = _socket.get_con_from_hdl(conn_hdl)->state;
+          if (connection == nullptr) {
+            LOG_WARN << "Dropping a message of an unknown connection."
+                     << LOG_END;
+            return;
           }
-          handleResponse(resp, conn_hdl);
+          _on_msg(connection, msg->get_payload(),
+                  msg->get_opcode() == websocketpp::frame::opcode::binary);
         } catch (const std::exception &e) {
           LOG_ERROR << "Error while handling a message: " << e.what()
                     << LOG_END;
@@ -94,30 +154,26 @@ void WebSocketServer::run() {
         }
       });
 
-      _socket.set_tls_init_handler([this](websocketpp::connection_hdl conn)
-                                       -> ssl_ctx_pt {
-        ssl_ctx_pt ctx =
-            std::make_shared<asio::ssl::context>(asio::ssl::context::sslv23);
-        try {
-          ctx->set_options(
-              asio::ssl::context::default_workarounds |
-              asio::ssl::context::no_sslv2 | asio::ssl::context::no_sslv3 |
-              asio::ssl::context::no_tlsv1 | asio::ssl::context::single_dh_use);
-          ctx->use_certificate_chain_file(_base_dir + "/cert/certificate.pem");
-          ctx->use_private_key_file(_base_dir + "/cert/key.pem", asio::ssl::context::pem);
-          ctx->use_tmp_dh_file(_base_dir + "/cert/dh1024.pem");
-        } catch (const std::exception &e) {
-          LOG_ERROR << "Error during tls initializtion " << e.what() << LOG_END;
-        }
-        LOG_DEBUG << "Initialized the ssl context for the web _socket server"
-                  << LOG_END;
-        return ctx;
-      });
+      _socket.set_tls_init_handler(
+          [this](websocketpp::connection_hdl conn) -> ssl_ctx_pt {
+            return tlsContext();
+          });
 
       _socket.listen(8081);
       _socket.start_accept();
-      LOG_INFO << "Starting the wss server on 8081" << LOG_END;
-      _socket.run();
+      LOG_INFO << "Starting the wss server on 8081 with " << _num_io_threads
+               << " io threads" << LOG_END;
+      // The transport runs all handlers of a connection, including its tls
+      // handshake, on the connection's strand. The threads share the
+      // connections without ever handling one of them concurrently.
+      std::vector<std::thread> io_threads;
+      for (size_t i = 1; i < _num_io_threads; ++i) {
+        io_threads.emplace_back(&WebSocketServer::runIoThread, this);
+      }
+      runIoThread();
+      for (std::thread &t : io_threads) {
+        t.join();
+      }
       std::this_thread::sleep_for(std::chrono::seconds(15));
     } catch (const std::exception &e) {
       LOG_ERROR << "A socket error occured in the wss server: " << e.what()
@@ -127,41 +183,414 @@ void WebSocketServer::run() {
   }
 }
 
+void WebSocketServer::runIoThread() {
+  while (true) {
+    try {
+      _socket.run();
+      return;
+    } catch (const std::exception &e) {
+      // The other threads keep running, this one rejoins them
+      LOG_ERROR << "A socket error occured in the wss server: " << e.what()
+                << LOG_END;
+    }
+  }
+}
+
+WebSocketServer::ssl_ctx_pt WebSocketServer::tlsContext() {
+  int64_t seconds = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count();
+  ssl_ctx_pt ctx = std::atomic_load(&_tls_context);
+  if (ctx != nullptr && seconds < _next_tls_check) {
+    return ctx;
+  }
+  // Only one thread checks the files, the others keep using the current
+  // context meanwhile
+  std::unique_lock<std::mutex> lock(_tls_mutex, std::defer_lock);
+  if (ctx != nullptr && !lock.try_lock()) {
+    return ctx;
+  }
+  if (ctx == nullptr) {
+    lock.lock();
+    ctx = std::atomic_load(&_tls_context);
+    if (ctx != nullptr) {
+      return ctx;
+    }
+  }
+  _next_tls_check = seconds + TLS_CHECK_SECONDS;
+  std::vector<int64_t> file_times = tlsFileTimes();
+  if (ctx != nullptr && file_times == _tls_file_times) {
+    return ctx;
+  }
+  try {
+    ssl_ctx_pt loaded = buildTlsContext();
+    std::atomic_store(&_tls_context, loaded);
+    _tls_file_times = file_times;
+    if (ctx != nullptr) {
+      LOG_INFO << "Reloaded the changed tls certificate" << LOG_END;
+    }
+    return loaded;
+  } catch (const std::exception &e) {
+    LOG_ERROR << "Error during tls initialization " << e.what() << LOG_END;
+  }
+  if (ctx == nullptr) {
+    // The handshakes fail until the files can be loaded
+    ctx = std::make_shared<asio::ssl::context>(asio::ssl::context::sslv23);
+  }
+  return ctx;
+}
+
+WebSocketServer::ssl_ctx_pt WebSocketServer::buildTlsContext() {
+  ssl_ctx_pt ctx =
+      std::make_shared<asio::ssl::context>(asio::ssl::context::sslv23);
+  ctx->set_options(
+      asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 |
+      asio::ssl::context::no_sslv3 | asio::ssl::context::no_tlsv1 |
+      asio::ssl::context::single_dh_use);
+  ctx->use_certificate_chain_file(_base_dir + "/cert/certificate.pem");
+  ctx->use_private_key_file(_base_dir + "/cert/key.pem",
+                            asio::ssl::context::pem);
+  ctx->use_tmp_dh_file(_base_dir + "/cert/dh1024.pem");
+
+  // Sessions are resumed from the server's cache, or from the tickets of
+  // clients that support them. Both only live as long as the context, a
+  // reloaded certificate starts with fresh sessions.
+  SSL_CTX *native = ctx->native_handle();
+  static const unsigned char SESSION_ID_CONTEXT[] = "penandpaper";
+  SSL_CTX_set_session_id_context(native, SESSION_ID_CONTEXT,
+                                 sizeof(SESSION_ID_CONTEXT) - 1);
+  SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(native, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(native, TLS_SESSION_SECONDS);
+  SSL_CTX_clear_options(native, SSL_OP_NO_TICKET);
+  LOG_DEBUG << "Initialized the ssl context for the web socket server"
+            << LOG_END;
+  return ctx;
+}
+
+std::vector<int64_t> WebSocketServer::tlsFileTimes() {
+  return {os::modificationTime(_base_dir + "/cert/certificate.pem"),
+          os::modificationTime(_base_dir + "/cert/key.pem"),
+          os::modificationTime(_base_dir + "/cert/dh1024.pem")};
+}
+
+std::string WebSocketServer::tableFromResource(const std::string &resource) {
+  // Strip the leading slash and any query string
+  size_t begin = resource.find_first_not_of('/');
+  if (begin == std::string::npos) {
+    return DEFAULT_TABLE;
+  }
+  size_t end = resource.find_first_of("?#", begin);
+  std::string table = resource.substr(begin, end - begin);
+  if (table.empty()) {
+    return DEFAULT_TABLE;
+  }
+  return table;
+}
+
 void WebSocketServer::handleResponse(const Response &response,
-                                     websocketpp::connection_hdl &initiator) {
+                                     const ConnectionPtr &initiator) {
   switch (response.type) {
     case ResponseType::FORWARD:
-    case ResponseType::BROADCAST: {
-      for (websocketpp::connection_hdl other : _connections) {
-        try {
-          _socket.send(other, response.text, websocketpp::frame::opcode::text);
-        } catch (const websocketpp::exception &e) {
-          LOG_WARN << "Unable to forward a message to one of the clients."
-                   << e.what() << LOG_END;
-        }
-      }
-    } break;
-    case ResponseType::RETURN: {
-      try {
-        _socket.send(initiator, response.text,
-                     websocketpp::frame::opcode::text);
-      } catch (const websocketpp::exception &e) {
-        LOG_WARN << "Unable to send a reply." << LOG_END;
-      }
-    } break;
+    case ResponseType::BROADCAST:
+      broadcast(initiator->table, response.text, response.area,
+                response.lane);
+      break;
+    case ResponseType::RETURN:
+      send(initiator, response.text, false, response.lane);
+      break;
     case ResponseType::SILENCE:
       // Do nothing
       break;
   }
 }
 
-void WebSocketServer::broadcast(const std::string &data) {
-  for (websocketpp::connection_hdl other : _connections) {
-    try {
-      _socket.send(other, data, websocketpp::frame::opcode::text);
-    } catch (const websocketpp::exception &e) {
-      LOG_WARN << "Unable to forward a message to one of the clients."
-               << e.what() << LOG_END;
+bool WebSocketServer::acceptsDeflate(const std::string &extensions,
+                                     bool *context_takeover) {
+  // Only the first accepted extension is of interest, e.g.
+  // 'permessage-deflate; server_no_context_takeover'
+  std::string extension = extensions.substr(0, extensions.find(','));
+  size_t end = extension.find(';');
+  std::string name = extension.substr(0, end);
+  name.erase(0, name.find_first_not_of(' '));
+  name.erase(name.find_last_not_of(' ') + 1);
+  if (name != "permessage-deflate") {
+    return false;
+  }
+  while (end != std::string::npos) {
+    size_t begin = end + 1;
+    end = extension.find(';', begin);
+    std::string param = extension.substr(begin, end - begin);
+    param.erase(0, param.find_first_not_of(' '));
+    param.erase(param.find_last_not_of(' ') + 1);
+    if (param == "server_no_context_takeover") {
+      *context_takeover = false;
+    } else if (param.compare(0, 22, "server_max_window_bits") == 0) {
+      size_t equals = param.find('=');
+      if (equals != std::string::npos &&
+          std::atoi(param.c_str() + equals + 1) < 15) {
+        // The client could not decompress what the server's compressor
+        // refers back to
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+std::string WebSocketServer::deflate(Deflater *deflater,
+                                     const std::string &data) {
+  auto start = std::chrono::steady_clock::now();
+  std::string compressed = deflater->compress(data);
+  auto now = std::chrono::steady_clock::now();
+  _deflated_messages++;
+  _deflate_bytes_in += data.size();
+  _deflate_bytes_out += compressed.size();
+  _deflate_nanoseconds +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - start)
+          .count();
+
+  int64_t seconds = std::chrono::duration_cast<std::chrono::seconds>(
+                        now.time_since_epoch())
+                        .count();
+  int64_t next_report = _next_deflate_report;
+  if (seconds >= next_report &&
+      _next_deflate_report.compare_exchange_strong(
+          next_report, seconds + DEFLATE_REPORT_SECONDS)) {
+    uint64_t messages = _deflated_messages.exchange(0);
+    uint64_t bytes_in = _deflate_bytes_in.exchange(0);
+    uint64_t bytes_out = _deflate_bytes_out.exchange(0);
+    uint64_t nanoseconds = _deflate_nanoseconds.exchange(0);
+    LOG_INFO << "Compressed " << messages << " messages from " << bytes_in
+             << " to " << bytes_out << " bytes ("
+             << (bytes_in > 0 ? 100 * bytes_out / bytes_in : 100)
+             << "%) in " << nanoseconds / 1000000 << "ms in the last "
+             << int(DEFLATE_REPORT_SECONDS) << "s" << LOG_END;
+  }
+  return compressed;
+}
+
+WebSocketServer::Server::message_ptr WebSocketServer::prepareMessage(
+    const std::string &data, websocketpp::frame::opcode::value op,
+    bool is_compressed) {
+  Server::message_ptr msg = _msg_manager->get_message(op, data.size());
+  // The first reserved bit marks the compressed messages
+  websocketpp::frame::basic_header header(op, data.size(), true, false,
+                                          is_compressed);
+  websocketpp::frame::extended_header extended_header(data.size());
+  msg->set_header(websocketpp::frame::prepare_header(header, extended_header));
+  msg->set_payload(data);
+  msg->set_prepared(true);
+  return msg;
+}
+
+std::vector<WebSocketServer::Prepared> WebSocketServer::prepareMessages(
+    const std::string &data, websocketpp::frame::opcode::value op,
+    Lane lane) {
+  std::vector<Prepared> msgs;
+  if (lane != Lane::BULK || data.size() <= CHUNK_BYTES) {
+    msgs.push_back({prepareMessage(data, op), nullptr});
+  } else {
+    // Websocket fragments of one message can not be interleaved with other
+    // messages, so the parts are separate messages the client puts
+    // together.
+    for (size_t offset = 0; offset < data.size(); offset += CHUNK_BYTES) {
+      size_t size = std::min(size_t(CHUNK_BYTES), data.size() - offset);
+      uint8_t flags = 0;
+      if (offset + size == data.size()) {
+        flags |= binary::CHUNK_LAST;
+      }
+      if (op == websocketpp::frame::opcode::binary) {
+        flags |= binary::CHUNK_BINARY;
+      }
+      std::string part;
+      part.reserve(size + 2);
+      part += char(binary::PacketType::CHUNK);
+      part += char(flags);
+      part.append(data, offset, size);
+      msgs.push_back(
+          {prepareMessage(part, websocketpp::frame::opcode::binary), nullptr});
+    }
+  }
+  if (_deflate_settings.level == 0 || _deflate_settings.context_takeover) {
+    return msgs;
+  }
+  // Every message is compressed on its own, so one compressor per thread
+  // serves all clients
+  thread_local std::unique_ptr<Deflater> deflater;
+  if (deflater == nullptr) {
+    deflater = std::unique_ptr<Deflater>(
+        new Deflater(_deflate_settings.level, false));
+  }
+  for (Prepared &msg : msgs) {
+    const std::string &payload = msg.plain->get_payload();
+    if (payload.size() < _deflate_settings.min_bytes) {
+      continue;
+    }
+    std::string compressed = deflate(deflater.get(), payload);
+    if (compressed.size() < payload.size()) {
+      msg.deflated =
+          prepareMessage(compressed, msg.plain->get_opcode(), true);
+    }
+  }
+  return msgs;
+}
+
+void WebSocketServer::send(const ConnectionPtr &connection,
+                           const std::string &data, bool is_binary,
+                           Lane lane) {
+  deliver(connection,
+          prepareMessages(data,
+                          is_binary ? websocketpp::frame::opcode::binary
+                                    : websocketpp::frame::opcode::text,
+                          lane),
+          lane);
+}
+
+size_t WebSocketServer::queuedBytes(const ConnectionPtr &connection) {
+  size_t queued = 0;
+  try {
+    queued = _socket.get_con_from_hdl(connection->hdl)->get_buffered_amount();
+  } catch (const websocketpp::exception &e) {
+    // The client is gone, nothing will be sent to it
+  }
+  return queued;
+}
+
+bool WebSocketServer::isCongested(const ConnectionPtr &connection) {
+  return connection->is_stale ||
+         queuedBytes(connection) > CONGESTED_QUEUED_BYTES;
+}
+
+void WebSocketServer::pump(const ConnectionPtr &connection) {
+  size_t queued = queuedBytes(connection);
+  std::lock_guard<std::mutex> lock(connection->lane_mutex);
+  pumpLocked(connection.get(), queued);
+}
+
+void WebSocketServer::deliver(const ConnectionPtr &connection,
+                              const std::vector<Prepared> &msgs, Lane lane) {
+  if (connection->is_stale) {
+    return;
+  }
+  size_t queued = queuedBytes(connection);
+  std::lock_guard<std::mutex> lock(connection->lane_mutex);
+  // A client that falls behind does not need the state in bulk payloads,
+  // it is sent the whole state once it caught up
+  if (queued > MAX_QUEUED_BYTES ||
+      (lane == Lane::BULK && queued > CONGESTED_QUEUED_BYTES)) {
+    markStale(connection.get(), queued);
+    return;
+  }
+  bool is_bulk = msgs.size() > 1;
+  // Interactive packets only overtake the rest of a payload that was
+  // started. The client holds them back until the payload is complete, so
+  // they are applied in order with all other packets.
+  bool may_send = lane == Lane::INTERACTIVE ? connection->num_unstarted == 0
+                                            : connection->lane.empty();
+  if (!is_bulk && may_send) {
+    sendNow(connection.get(), msgs.front());
+    return;
+  }
+  for (size_t i = 0; i < msgs.size(); ++i) {
+    connection->lane.push_back({msgs[i], i == 0});
+  }
+  connection->num_unstarted++;
+  pumpLocked(connection.get(), queued);
+}
+
+void WebSocketServer::pumpLocked(Connection *connection, size_t queued) {
+  while (!connection->lane.empty() && queued < BULK_WINDOW_BYTES) {
+    Connection::Waiting waiting = std::move(connection->lane.front());
+    connection->lane.pop_front();
+    if (waiting.starts_message) {
+      connection->num_unstarted--;
+    }
+    queued += sendNow(connection, waiting.msg);
+  }
+}
+
+void WebSocketServer::markStale(Connection *connection, size_t queued) {
+  connection->is_stale = true;
+  // The rest of a payload the client already receives is still sent, the
+  // client could not tell its parts from those of the next payload otherwise
+  auto started_end = std::find_if(
+      connection->lane.begin(), connection->lane.end(),
+      [](const Connection::Waiting &w) { return w.starts_message; });
+  connection->lane.erase(started_end, connection->lane.end());
+  connection->num_unstarted = 0;
+  LOG_WARN << "A client of the table '" << connection->table << "' has "
+           << queued << " bytes waiting, it is sent the state again once "
+           << "it caught up" << LOG_END;
+}
+
+size_t WebSocketServer::sendNow(Connection *connection,
+                                const Prepared &prepared) {
+  Server::message_ptr msg = prepared.plain;
+  if (connection->deflater != nullptr) {
+    const std::string &payload = msg->get_payload();
+    if (payload.size() >= _deflate_settings.min_bytes) {
+      // Once compressed the message is part of the client's window, so it
+      // has to be sent compressed even if that is larger
+      msg = prepareMessage(deflate(connection->deflater.get(), payload),
+                           msg->get_opcode(), true);
+    }
+  } else if (connection->uses_deflate && prepared.deflated != nullptr) {
+    msg = prepared.deflated;
+  }
+  try {
+    _socket.send(connection->hdl, msg);
+  } catch (const websocketpp::exception &e) {
+    LOG_WARN << "Unable to send a message to a client." << e.what() << LOG_END;
+  }
+  return msg->get_payload().size();
+}
+
+WebSocketServer::ConnectionList WebSocketServer::tableConnections(
+    const std::string &table) {
+  return _connections.table(table);
+}
+
+void WebSocketServer::broadcast(const std::string &table,
+                                const std::string &data, const Rect &area,
+                                Lane lane) {
+  ConnectionList connections = tableConnections(table);
+  // Frame the message once and share it between all connections
+  std::vector<Prepared> msgs;
+  for (const ConnectionPtr &other : *connections) {
+    if (!other->viewport.intersects(area)) {
+      continue;
+    }
+    if (msgs.empty()) {
+      msgs = prepareMessages(data, websocketpp::frame::opcode::text, lane);
+    }
+    deliver(other, msgs, lane);
+  }
+}
+
+void WebSocketServer::broadcast(const std::string &table,
+                                const std::string &data,
+                                const std::string &binary_data) {
+  broadcast(*tableConnections(table), data, binary_data);
+}
+
+void WebSocketServer::broadcast(const std::vector<ConnectionPtr> &connections,
+                                const std::string &data,
+                                const std::string &binary_data, Lane lane) {
+  std::vector<Prepared> text_msgs;
+  std::vector<Prepared> binary_msgs;
+  for (const ConnectionPtr &other : connections) {
+    std::vector<Prepared> *msgs = &text_msgs;
+    if (other->binary_protocol) {
+      msgs = &binary_msgs;
+      if (binary_msgs.empty()) {
+        binary_msgs = prepareMessages(
+            binary_data, websocketpp::frame::opcode::binary, lane);
+      }
+    } else if (text_msgs.empty()) {
+      text_msgs =
+          prepareMessages(data, websocketpp::frame::opcode::text, lane);
     }
+    deliver(other, *msgs, lane);
   }
 }
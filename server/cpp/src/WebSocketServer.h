@@ -16,21 +16,86 @@
 
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <functional>
+#include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define ASIO_STANDALONE
 #include <memory>
 #include <websocketpp/config/asio.hpp>
+#include <websocketpp/extensions/permessage_deflate/enabled.hpp>
 #include <websocketpp/server.hpp>
 
 #include "Authenticator.h"
+#include "ConnectionRegistry.h"
+#include "Deflater.h"
+#include "geometry/Rect.h"
 
 class WebSocketServer {
-  typedef websocketpp::config::asio_tls ServerConfig;
-  typedef websocketpp::server<websocketpp::config::asio_tls> Server;
+ public:
+  struct Connection;
+
+ private:
+  /**
+   * @brief The tls config of websocketpp with the permessage-deflate
+   *        extension enabled. The extension negotiates compression and
+   *        inflates the messages of the clients, the messages sent to them
+   *        are compressed by the server itself. Every websocketpp connection
+   *        carries the state of its client.
+   */
+  struct ServerConfig : public websocketpp::config::asio_tls {
+    typedef ServerConfig type;
+    typedef websocketpp::config::asio_tls base;
+
+    typedef base::concurrency_type concurrency_type;
+    typedef base::request_type request_type;
+    typedef base::response_type response_type;
+    typedef base::message_type message_type;
+    typedef base::con_msg_manager_type con_msg_manager_type;
+    typedef base::endpoint_msg_manager_type endpoint_msg_manager_type;
+    typedef base::alog_type alog_type;
+    typedef base::elog_type elog_type;
+    typedef base::rng_type rng_type;
+
+    struct transport_config : public base::transport_config {
+      typedef type::concurrency_type concurrency_type;
+      typedef type::alog_type alog_type;
+      typedef type::elog_type elog_type;
+      typedef type::request_type request_type;
+      typedef type::response_type response_type;
+      typedef websocketpp::transport::asio::tls_socket::endpoint socket_type;
+    };
+    typedef websocketpp::transport::asio::endpoint<transport_config>
+        transport_type;
+
+    struct connection_base {
+      // Set once the client is authenticated. Only accessed by the
+      // handlers of the connection, which never run concurrently.
+      std::shared_ptr<Connection> state;
+    };
+
+    struct permessage_deflate_config {};
+    typedef websocketpp::extensions::permessage_deflate::enabled<
+        permessage_deflate_config>
+        permessage_deflate_type;
+  };
+  typedef websocketpp::server<ServerConfig> Server;
   typedef std::shared_ptr<asio::ssl::context> ssl_ctx_pt;
+  typedef ServerConfig::con_msg_manager_type::ptr MsgManager_t;
+
+  /**
+   * @brief A framed message, and the same message compressed for the clients
+   *        that negotiated permessage-deflate if that makes it smaller.
+   */
+  struct Prepared {
+    Server::message_ptr plain;
+    Server::message_ptr deflated;
+  };
 
  public:
   enum class ResponseType {
@@ -40,36 +105,323 @@ class WebSocketServer {
     SILENCE
   };
 
+  /**
+   * @brief How urgently a packet is sent, relative to the others sent to the
+   *        same client.
+   */
+  enum class Lane {
+    // Sent before the remaining parts of the bulk payload the client is
+    // receiving, e.g. token moves and chat messages. Never overtakes a
+    // payload that was not started yet, the client applies the packets it
+    // receives in between once the payload is complete.
+    INTERACTIVE,
+    // Sent in order with everything but interactive packets
+    ORDERED,
+    // Large payloads, e.g. the Init packet. Split into parts which are sent
+    // as the client's socket drains, in order with ordered packets.
+    BULK
+  };
+
+  /**
+   * @brief How the messages sent to clients that negotiated
+   *        permessage-deflate are compressed.
+   */
+  struct DeflateSettings {
+    // The zlib compression level from 1 to 9, 0 to not compress at all
+    int level = 6;
+    // If true, every client gets its own compressor that remembers the
+    // messages sent before. That compresses small packets much better, but
+    // costs memory for every client and compresses broadcasts once per
+    // client instead of once.
+    bool context_takeover = false;
+    // Messages smaller than this are sent uncompressed
+    size_t min_bytes = 256;
+  };
+
   struct Response {
     std::string text;
     ResponseType type;
+    // Broadcasts are only sent to clients whose viewport intersects this area
+    Rect area = Rect::everything();
+    Lane lane = Lane::ORDERED;
+  };
+
+  /**
+   * @brief The state kept for every connected client.
+   */
+  struct Connection {
+    Connection(websocketpp::connection_hdl hdl, const std::string &table);
+
+    websocketpp::connection_hdl hdl;
+    std::string table;
+    // The uid of the player, set once the client initialized its session.
+    // Only accessed from the thread of the connection's table.
+    std::string uid;
+    // True if the client negotiated the binary protocol for the high
+    // frequency packets.
+    std::atomic<bool> binary_protocol;
+    // The part of the map the client shows, including a margin. Until the
+    // client reports it, the viewport is the whole map. Only accessed from
+    // the thread of the connection's table.
+    Rect viewport;
+    bool has_viewport;
+    // Set once the send buffer overflowed, or a bulk payload was sent to the
+    // client while it was congested. Nothing is sent to the client until its
+    // table sends it the current state again.
+    std::atomic<bool> is_stale;
+
+    // True if the client negotiated permessage-deflate with a window the
+    // server's compressor can use
+    bool uses_deflate;
+    // The compressor of the client if context takeover is used. Guarded by
+    // lane_mutex, as the messages have to be compressed in the order they
+    // are sent.
+    std::unique_ptr<Deflater> deflater;
+
+    struct Waiting {
+      Prepared msg;
+      // False for the parts of a bulk payload after its first one
+      bool starts_message;
+    };
+    // The messages waiting for the socket's buffer to drain, oldest first.
+    // Guarded by lane_mutex.
+    std::mutex lane_mutex;
+    std::deque<Waiting> lane;
+    // The number of messages in lane of which nothing was sent yet. If it is
+    // zero, lane only holds the rest of the payload the client is receiving.
+    size_t num_unstarted;
   };
+  typedef std::shared_ptr<Connection> ConnectionPtr;
+  // An immutable list of connections, safe to iterate on any thread
+  typedef ConnectionRegistry<Connection>::List ConnectionList;
 
-  typedef std::function<Response(const std::string &)> OnMsgHandler_t;
-  typedef std::function<Response()> OnConnectHandler_t;
+  typedef std::function<void(ConnectionPtr, const std::string &msg,
+                             bool is_binary)>
+      OnMsgHandler_t;
+  typedef std::function<bool(ConnectionPtr)> OnConnectHandler_t;
+  typedef std::function<void(ConnectionPtr)> OnDisconnectHandler_t;
 
  public:
+  /**
+   * @param on_msg Called on the io thread that received the message. The
+   *               messages of one connection are never handled concurrently.
+   * @param on_connect Called for every authenticated client before it joins
+   *                   its table. The client is turned away if it returns
+   *                   false.
+   * @param on_disconnect Called once a client that connected successfully
+   *                      disconnected and was removed from its table.
+   * @param num_io_threads The number of threads running the sockets. At least
+   *                       one thread is used.
+   */
   WebSocketServer(std::shared_ptr<Authenticator> authenticator,
                   OnMsgHandler_t on_msg, OnConnectHandler_t on_connect,
-                  std::string base_dir);
+                  OnDisconnectHandler_t on_disconnect, std::string base_dir,
+                  size_t num_io_threads,
+                  const DeflateSettings &deflate_settings);
 
   void disableKeyCheck();
-  void broadcast(const std::string &data);
+
+  /**
+   * @brief Sends data to every client connected to the given table whose
+   *        viewport intersects area.
+   */
+  void broadcast(const std::string &table, const std::string &data,
+                 const Rect &area = Rect::everything(),
+                 Lane lane = Lane::ORDERED);
+
+  /**
+   * @brief Sends data to every client connected to the given table. Clients
+   *        which negotiated the binary protocol receive binary_data instead.
+   */
+  void broadcast(const std::string &table, const std::string &data,
+                 const std::string &binary_data);
+
+  /**
+   * @brief Sends data to the given connections, or binary_data to those using
+   *        the binary protocol.
+   */
+  void broadcast(const std::vector<ConnectionPtr> &connections,
+                 const std::string &data, const std::string &binary_data,
+                 Lane lane = Lane::ORDERED);
+
+  /**
+   * @brief Sends data to a single client, e.g. a packet filtered for its
+   *        viewport.
+   */
+  void send(const ConnectionPtr &connection, const std::string &data,
+            bool is_binary, Lane lane = Lane::ORDERED);
+
+  /**
+   * @brief Sends the messages waiting for the client while its socket holds
+   *        less than BULK_WINDOW_BYTES. Has to be called regularly, e.g. on
+   *        every tick of the client's table.
+   */
+  void pump(const ConnectionPtr &connection);
+
+  /**
+   * @return The bytes waiting in the client's socket.
+   */
+  size_t queuedBytes(const ConnectionPtr &connection);
+  /**
+   * @return True if the client falls behind and should only receive what
+   *         can not be held back.
+   */
+  bool isCongested(const ConnectionPtr &connection);
+
+  // A client with more bytes than this waiting only receives the updates
+  // that can not be merged or postponed. Bulk payloads are dropped for it,
+  // it is sent the whole state once it caught up instead.
+  static const size_t CONGESTED_QUEUED_BYTES = 256 * 1024;
+  // A client with more bytes than this waiting is dropped from the updates
+  // and sent the whole state once it caught up.
+  static const size_t MAX_QUEUED_BYTES = 8 * 1024 * 1024;
+  // Bulk payloads are split into parts of this size. At most
+  // BULK_WINDOW_BYTES of them are in the socket's buffer at once, which
+  // bounds the time an interactive packet waits behind them.
+  static const size_t CHUNK_BYTES = 32 * 1024;
+  static const size_t BULK_WINDOW_BYTES = 128 * 1024;
+
+  /**
+   * @return The connections of the given table. Does not wait for clients
+   *         that connect or disconnect meanwhile.
+   */
+  ConnectionList tableConnections(const std::string &table);
+
+  /**
+   * @brief Delivers the response of a message sent by initiator to the
+   *        clients of the initiator's table. Safe to call from any thread.
+   */
+  void handleResponse(const Response &response, const ConnectionPtr &initiator);
 
  private:
   void run();
+  /**
+   * @brief Runs the handlers of the sockets until the server stops.
+   */
+  void runIoThread();
+
+  /**
+   * @brief Builds a complete, already framed websocket message. Server frames
+   *        are not masked, so the same message can be handed to any number
+   *        of connections without being copied or framed again.
+   */
+  Server::message_ptr prepareMessage(const std::string &data,
+                                     websocketpp::frame::opcode::value op,
+                                     bool is_compressed = false);
+  /**
+   * @return The message, split into CHUNK packets if it is a large bulk
+   *         payload. Without context takeover every message is also
+   *         compressed once for all clients that negotiated compression.
+   */
+  std::vector<Prepared> prepareMessages(
+      const std::string &data, websocketpp::frame::opcode::value op,
+      Lane lane);
+
+  /**
+   * @brief Sends the message to the client, or queues it in the client's
+   *        lane if it has to wait for others. Nothing is queued if the send
+   *        buffer overflows, or if the message is a bulk payload and the
+   *        client is congested. The client is marked stale then, and later
+   *        messages are dropped until it is sent a fresh state.
+   * @param msgs The message, or the parts of a bulk payload.
+   */
+  void deliver(const ConnectionPtr &connection,
+               const std::vector<Prepared> &msgs, Lane lane);
+  /**
+   * @brief Sends waiting messages while the socket holds less than
+   *        BULK_WINDOW_BYTES. Has to be called with the lane_mutex held.
+   */
+  void pumpLocked(Connection *connection, size_t queued);
+  /**
+   * @brief Sends the message in the form the client negotiated. Has to be
+   *        called with the lane_mutex held.
+   * @return The number of bytes sent.
+   */
+  size_t sendNow(Connection *connection, const Prepared &msg);
+  /**
+   * @brief Drops the messages waiting for the client, but the rest of a
+   *        payload it already receives, and marks it stale. Has to be called
+   *        with the lane_mutex held.
+   */
+  void markStale(Connection *connection, size_t queued);
+
+  /**
+   * @brief Compresses data and records the compression statistics, which are
+   *        logged every DEFLATE_REPORT_SECONDS.
+   */
+  std::string deflate(Deflater *deflater, const std::string &data);
+  /**
+   * @return True if the response to the handshake of the client, as given by
+   *         its Sec-WebSocket-Extensions header, accepted permessage-deflate
+   *         with the full window. Sets context_takeover to false if the
+   *         client asked the server to compress every message on its own.
+   */
+  static bool acceptsDeflate(const std::string &extensions,
+                             bool *context_takeover);
+
+  /**
+   * @return The tls context shared by all connections. It is built again
+   *         once the certificate files changed, which is checked at most
+   *         every TLS_CHECK_SECONDS. If the new files can not be loaded, e.g.
+   *         because only some of them were replaced yet, the old context is
+   *         kept and loading is tried again on the next check.
+   */
+  ssl_ctx_pt tlsContext();
+  /**
+   * @brief Loads the certificate, the key and the dh parameters into a new
+   *        context. Its session cache and session tickets let clients that
+   *        reconnect resume their session without a full handshake.
+   * @throws std::exception if the files can not be loaded.
+   */
+  ssl_ctx_pt buildTlsContext();
+  /**
+   * @return The modification times of the certificate files.
+   */
+  std::vector<int64_t> tlsFileTimes();
 
-  void handleResponse(const Response &response,
-                      websocketpp::connection_hdl &initiator);
+  /**
+   * @return The name of the table requested by the resource the client
+   *         connected to, e.g. 'dungeon' for wss://host:8081/dungeon
+   */
+  static std::string tableFromResource(const std::string &resource);
+
+  static const std::string DEFAULT_TABLE;
+  static const int DEFLATE_REPORT_SECONDS = 60;
+  static const int TLS_CHECK_SECONDS = 10;
+  static const long TLS_SESSION_SECONDS = 60 * 60;
+  static const long TLS_SESSION_CACHE_SIZE = 16 * 1024;
 
   std::shared_ptr<Authenticator> _authenticator;
-  std::vector<websocketpp::connection_hdl> _connections;
+
+  // Modified on the io threads, read by the tables' threads
+  ConnectionRegistry<Connection> _connections;
 
   Server _socket;
+  MsgManager_t _msg_manager;
 
   OnMsgHandler_t _on_msg;
   OnConnectHandler_t _on_connect;
+  OnDisconnectHandler_t _on_disconnect;
 
   bool _do_key_check;
   std::string _base_dir;
+  size_t _num_io_threads;
+
+  // Read and replaced with std::atomic_load and std::atomic_store. The
+  // connections keep the context they were created with.
+  ssl_ctx_pt _tls_context;
+  // Guards reloading the context and _tls_file_times
+  std::mutex _tls_mutex;
+  std::vector<int64_t> _tls_file_times;
+  // The next check of the files, in seconds of the steady clock
+  std::atomic<int64_t> _next_tls_check;
+
+  DeflateSettings _deflate_settings;
+  // The compression statistics since they were last reported
+  std::atomic<uint64_t> _deflated_messages;
+  std::atomic<uint64_t> _deflate_bytes_in;
+  std::atomic<uint64_t> _deflate_bytes_out;
+  std::atomic<uint64_t> _deflate_nanoseconds;
+  // The next report, in seconds of the steady clock
+  std::atomic<int64_t> _next_deflate_report;
 };
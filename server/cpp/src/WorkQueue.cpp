@@ -0,0 +1,91 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "WorkQueue.h"
+
+#include "Logger.h"
+
+WorkQueue::WorkQueue()
+    : _stop(false), _tick_interval(0), _thread(&WorkQueue::run, this) {}
+
+WorkQueue::~WorkQueue() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_all();
+  _thread.join();
+}
+
+void WorkQueue::post(Task_t task) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tasks.emplace_back(std::move(task));
+  }
+  _cond.notify_one();
+}
+
+void WorkQueue::setTick(std::chrono::milliseconds interval, Task_t tick) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tick = std::move(tick);
+    _tick_interval = interval;
+    _next_tick = std::chrono::steady_clock::now() + interval;
+  }
+  _cond.notify_one();
+}
+
+void WorkQueue::run() {
+  while (true) {
+    Task_t task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (!_stop && _tasks.empty()) {
+        if (!_tick) {
+          _cond.wait(lock);
+        } else if (_cond.wait_until(lock, _next_tick) ==
+                   std::cv_status::timeout) {
+          break;
+        }
+      }
+      if (!_tasks.empty()) {
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      } else if (_stop) {
+        // There is no work left
+        return;
+      }
+      if (_tick && std::chrono::steady_clock::now() >= _next_tick) {
+        if (task) {
+          // Run the tick after the task, as part of the next iteration.
+          _tasks.emplace_front(std::move(task));
+        }
+        task = _tick;
+        _next_tick += _tick_interval;
+        if (_next_tick < std::chrono::steady_clock::now()) {
+          // Don't try to catch up on missed ticks
+          _next_tick = std::chrono::steady_clock::now() + _tick_interval;
+        }
+      }
+    }
+    try {
+      task();
+    } catch (const std::exception &e) {
+      LOG_ERROR << "Error while running a task: " << e.what() << LOG_END;
+    } catch (...) {
+      LOG_ERROR << "Unknown error while running a task." << LOG_END;
+    }
+  }
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief A single threaded executor. Tasks posted to the queue are run in
+ *        order on the queue's own thread, so everything posted to one queue is
+ *        serialized without blocking the threads that post to other queues.
+ */
+class WorkQueue {
+ public:
+  typedef std::function<void()> Task_t;
+
+  WorkQueue();
+  virtual ~WorkQueue();
+
+  WorkQueue(const WorkQueue &other) = delete;
+  WorkQueue &operator=(const WorkQueue &other) = delete;
+
+  void post(Task_t task);
+
+  /**
+   * @brief Runs tick on the queue's thread every interval, interleaved with
+   *        the posted tasks. Replaces any previously set tick.
+   */
+  void setTick(std::chrono::milliseconds interval, Task_t tick);
+
+ private:
+  void run();
+
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::deque<Task_t> _tasks;
+  bool _stop;
+
+  Task_t _tick;
+  std::chrono::milliseconds _tick_interval;
+  std::chrono::steady_clock::time_point _next_tick;
+
+  std::thread _thread;
+};
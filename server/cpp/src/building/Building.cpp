@@ -16,158 +16,151 @@
 
 #include "Building.h"
 
-#include "Util.h"
+namespace {
+// The elements are written as their json in CBOR, a binary encoding of json
+void writeJson(BinaryWriter *writer, const nlohmann::json &j) {
+  std::vector<uint8_t> encoded = nlohmann::json::to_cbor(j);
+  writer->write(uint32_t(encoded.size()));
+  writer->writeBytes(encoded.data(), encoded.size());
+}
+
+nlohmann::json readJson(BinaryReader *reader) {
+  std::vector<uint8_t> encoded(reader->read<uint32_t>());
+  reader->readBytes(encoded.data(), encoded.size());
+  return nlohmann::json::from_cbor(encoded);
+}
+}  // namespace
 
 Building::Building(IdGenerator *id_generator)
-    : _id(id_generator->next()), _id_generator(id_generator) {}
+    : _id(id_generator->next()),
+      _rooms(0),
+      _walls(1),
+      _doors(2),
+      _furniture(3),
+      _id_generator(id_generator) {}
 
 nlohmann::json Building::toJson() const {
   using nlohmann::json;
   json j;
   j["id"] = _id;
-  j["rooms"] = util::map<std::shared_ptr<Room>, json>(
-      _rooms,
-      [](const std::shared_ptr<Room> &r) -> json { return r->toJson(); });
-
-  j["walls"] = util::map<std::shared_ptr<Wall>, json>(
-      _walls,
-      [](const std::shared_ptr<Wall> &w) -> json { return w->toJson(); });
-
-  j["doors"] = util::map<std::shared_ptr<Door>, json>(
-      _doors,
-      [](const std::shared_ptr<Door> &d) -> json { return d->toJson(); });
-
-  j["furniture"] = util::map<std::shared_ptr<Furniture>, json>(
-      _furniture,
-      [](const std::shared_ptr<Furniture> &d) -> json { return d->toJson(); });
-
+  j["rooms"] = json::array();
+  for (const Room &r : _rooms) {
+    j["rooms"].push_back(r.toJson());
+  }
+  j["walls"] = json::array();
+  for (const Wall &w : _walls) {
+    j["walls"].push_back(w.toJson());
+  }
+  j["doors"] = json::array();
+  for (const Door &d : _doors) {
+    j["doors"].push_back(d.toJson());
+  }
+  j["furniture"] = json::array();
+  for (const Furniture &f : _furniture) {
+    j["furniture"].push_back(f.toJson());
+  }
   return j;
 }
 
 void Building::fromJson(const nlohmann::json &j) {
   using nlohmann::json;
   for (const json &room : j.at("rooms")) {
-    _rooms.emplace_back(
-        std::make_shared<Room>(Room::fromJson(room, _id_generator->next())));
+    _rooms.create([&room](uint64_t id) { return Room::fromJson(room, id); });
   }
-  for (const json &room : j.at("walls")) {
-    _walls.emplace_back(
-        std::make_shared<Wall>(Wall::fromJson(room, _id_generator->next())));
+  for (const json &wall : j.at("walls")) {
+    _walls.create([&wall](uint64_t id) { return Wall::fromJson(wall, id); });
   }
-  for (const json &room : j.at("doors")) {
-    _doors.emplace_back(
-        std::make_shared<Door>(Door::fromJson(room, _id_generator->next())));
+  for (const json &door : j.at("doors")) {
+    _doors.create([&door](uint64_t id) { return Door::fromJson(door, id); });
   }
-  for (const json &room : j.at("furniture")) {
-    _furniture.emplace_back(std::make_shared<Furniture>(
-        Furniture::fromJson(room, _id_generator->next())));
+  for (const json &furniture : j.at("furniture")) {
+    _furniture.create([&furniture](uint64_t id) {
+      return Furniture::fromJson(furniture, id);
+    });
   }
 }
 
-std::shared_ptr<Room> Building::addRoom(const Vector2f &pos,
-                                        const Vector2f &size) {
-  _rooms.emplace_back(std::make_shared<Room>(_id_generator->next(), pos, size));
-  return _rooms.back();
+void Building::clear() {
+  _id = _id_generator->next();
+  _rooms.clear();
+  _walls.clear();
+  _doors.clear();
+  _furniture.clear();
 }
 
-std::shared_ptr<Wall> Building::addWall(const Vector2f &start,
-                                        const Vector2f &end) {
-  _walls.emplace_back(
-      std::make_shared<Wall>(_id_generator->next(), start, end));
-  return _walls.back();
+void Building::write(BinaryWriter *writer) const {
+  writer->write(_id);
+  _rooms.write(writer, [](BinaryWriter *w, const Room &r) {
+    writeJson(w, r.toJson());
+  });
+  _walls.write(writer, [](BinaryWriter *w, const Wall &wall) {
+    writeJson(w, wall.toJson());
+  });
+  _doors.write(writer, [](BinaryWriter *w, const Door &d) {
+    writeJson(w, d.toJson());
+  });
+  _furniture.write(writer, [](BinaryWriter *w, const Furniture &f) {
+    writeJson(w, f.toJson());
+  });
 }
 
-std::shared_ptr<Door> Building::addDoor(const Vector2f &position, float width,
-                                        float rotation) {
-  _doors.emplace_back(
-      std::make_shared<Door>(_id_generator->next(), position, width, rotation));
-  return _doors.back();
+void Building::read(BinaryReader *reader) {
+  _id = reader->read<uint64_t>();
+  _id_generator->restore(_id + 1);
+  _rooms.read(reader, [](BinaryReader *r, uint64_t id) {
+    return Room::fromJson(readJson(r), id);
+  });
+  _walls.read(reader, [](BinaryReader *r, uint64_t id) {
+    return Wall::fromJson(readJson(r), id);
+  });
+  _doors.read(reader, [](BinaryReader *r, uint64_t id) {
+    return Door::fromJson(readJson(r), id);
+  });
+  _furniture.read(reader, [](BinaryReader *r, uint64_t id) {
+    return Furniture::fromJson(readJson(r), id);
+  });
 }
 
-std::shared_ptr<Furniture> Building::addFurniture(const Vector2f &position,
-                                                  const Vector2f &size,
-                                                  float rotation) {
-  _furniture.emplace_back(std::make_shared<Furniture>(
-      _id_generator->next(), position, size, rotation));
-  return _furniture.back();
+Room *Building::addRoom(const Vector2f &pos, const Vector2f &size) {
+  return &_rooms.create([&](uint64_t id) { return Room(id, pos, size); });
 }
 
-std::shared_ptr<Room> Building::room(uint64_t id) {
-  for (std::shared_ptr<Room> &r : _rooms) {
-    if (r->id() == id) {
-      return r;
-    }
-  }
-  return nullptr;
+Wall *Building::addWall(const Vector2f &start, const Vector2f &end) {
+  return &_walls.create([&](uint64_t id) { return Wall(id, start, end); });
 }
 
-std::shared_ptr<Wall> Building::wall(uint64_t id) {
-  for (std::shared_ptr<Wall> &r : _walls) {
-    if (r->id() == id) {
-      return r;
-    }
-  }
-  return nullptr;
+Door *Building::addDoor(const Vector2f &position, float width,
+                        float rotation) {
+  return &_doors.create(
+      [&](uint64_t id) { return Door(id, position, width, rotation); });
 }
 
-std::shared_ptr<Door> Building::door(uint64_t id) {
-  for (std::shared_ptr<Door> &r : _doors) {
-    if (r->id() == id) {
-      return r;
-    }
-  }
-  return nullptr;
+Furniture *Building::addFurniture(const Vector2f &position,
+                                  const Vector2f &size, float rotation) {
+  return &_furniture.create(
+      [&](uint64_t id) { return Furniture(id, position, size, rotation); });
 }
 
-std::shared_ptr<Furniture> Building::furniture(uint64_t id) {
-  for (std::shared_ptr<Furniture> &r : _furniture) {
-    if (r->id() == id) {
-      return r;
-    }
-  }
-  return nullptr;
-}
+Room *Building::room(uint64_t id) { return _rooms.get(id); }
 
-bool Building::deleteRoom(uint64_t id) {
-  for (size_t i = 0; i < _rooms.size(); ++i) {
-    if (_rooms[i]->id() == id) {
-      std::iter_swap(_rooms.begin() + i, _rooms.end() - 1);
-      _rooms.erase(_rooms.end() - 1);
-      return true;
-    }
-  }
-  return false;
-}
+Wall *Building::wall(uint64_t id) { return _walls.get(id); }
 
-bool Building::deleteWall(uint64_t id) {
-  for (size_t i = 0; i < _walls.size(); ++i) {
-    if (_walls[i]->id() == id) {
-      std::iter_swap(_walls.begin() + i, _walls.end() - 1);
-      _walls.erase(_walls.end() - 1);
-      return true;
-    }
-  }
-  return false;
-}
+Door *Building::door(uint64_t id) { return _doors.get(id); }
 
-bool Building::deleteDoor(uint64_t id) {
-  for (size_t i = 0; i < _doors.size(); ++i) {
-    if (_doors[i]->id() == id) {
-      std::iter_swap(_doors.begin() + i, _doors.end() - 1);
-      _doors.erase(_doors.end() - 1);
-      return true;
-    }
-  }
-  return false;
-}
+Furniture *Building::furniture(uint64_t id) { return _furniture.get(id); }
 
-bool Building::deleteFurniture(uint64_t id) {
-  for (size_t i = 0; i < _furniture.size(); ++i) {
-    if (_furniture[i]->id() == id) {
-      std::iter_swap(_furniture.begin() + i, _furniture.end() - 1);
-      _furniture.erase(_furniture.end() - 1);
-      return true;
-    }
-  }
-  return false;
-}
+bool Building::deleteRoom(uint64_t id) { return _rooms.erase(id); }
+
+bool Building::deleteWall(uint64_t id) { return _walls.erase(id); }
+
+bool Building::deleteDoor(uint64_t id) { return _doors.erase(id); }
+
+bool Building::deleteFurniture(uint64_t id) { return _furniture.erase(id); }
+
+SlotMap<Room> &Building::rooms() { return _rooms; }
+
+SlotMap<Wall> &Building::walls() { return _walls; }
+
+SlotMap<Door> &Building::doors() { return _doors; }
+
+SlotMap<Furniture> &Building::furniture() { return _furniture; }
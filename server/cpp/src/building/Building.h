@@ -17,13 +17,13 @@
 #pragma once
 
 #include <cstdint>
-#include <memory>
 #include <nlohmann/json.hpp>
-#include <vector>
 
+#include "BinaryStream.h"
 #include "Door.h"
 #include "IdGenerator.h"
 #include "Room.h"
+#include "SlotMap.h"
 #include "Wall.h"
 
 class Building {
@@ -31,31 +31,61 @@ class Building {
   Building(IdGenerator *id_generator);
 
   nlohmann::json toJson() const;
+  /**
+   * @brief Adds the elements of j, with new ids.
+   */
   void fromJson(const nlohmann::json &j);
+  /**
+   * @brief Removes all elements and gives the building a new id. The ids of
+   *        the removed elements are never handed out again.
+   */
+  void clear();
 
-  std::shared_ptr<Room> addRoom(const Vector2f &pos, const Vector2f &size);
-  std::shared_ptr<Wall> addWall(const Vector2f &start, const Vector2f &end);
-  std::shared_ptr<Door> addDoor(const Vector2f &position, float width, float rotation);
-  std::shared_ptr<Furniture> addFurniture(const Vector2f &position, const Vector2f &size,
+  /**
+   * @brief Writes the building for a snapshot of the table. Unlike fromJson,
+   *        read keeps the ids of all elements.
+   */
+  void write(BinaryWriter *writer) const;
+  void read(BinaryReader *reader);
+
+  /**
+   * The returned pointers are invalidated by the next creation or deletion of
+   * an element of the same kind.
+   */
+  Room *addRoom(const Vector2f &pos, const Vector2f &size);
+  Wall *addWall(const Vector2f &start, const Vector2f &end);
+  Door *addDoor(const Vector2f &position, float width, float rotation);
+  Furniture *addFurniture(const Vector2f &position, const Vector2f &size,
                           float rotation);
 
-  std::shared_ptr<Room> room(uint64_t id);
-  std::shared_ptr<Wall> wall(uint64_t id);
-  std::shared_ptr<Door> door(uint64_t id);
-  std::shared_ptr<Furniture> furniture(uint64_t id);
+  /**
+   * @return The element with the given id or nullptr if no such element
+   *         exists.
+   */
+  Room *room(uint64_t id);
+  Wall *wall(uint64_t id);
+  Door *door(uint64_t id);
+  Furniture *furniture(uint64_t id);
 
   bool deleteRoom(uint64_t id);
   bool deleteWall(uint64_t id);
   bool deleteDoor(uint64_t id);
   bool deleteFurniture(uint64_t id);
 
+  SlotMap<Room> &rooms();
+  SlotMap<Wall> &walls();
+  SlotMap<Door> &doors();
+  SlotMap<Furniture> &furniture();
+
  private:
   uint64_t _id;
 
-  std::vector<std::shared_ptr<Room>> _rooms;
-  std::vector<std::shared_ptr<Wall>> _walls;
-  std::vector<std::shared_ptr<Door>> _doors;
-  std::vector<std::shared_ptr<Furniture>> _furniture;
+  // The ids of the elements are their handles in these maps. The maps are
+  // tagged differently, so no two elements share an id.
+  SlotMap<Room> _rooms;
+  SlotMap<Wall> _walls;
+  SlotMap<Door> _doors;
+  SlotMap<Furniture> _furniture;
 
   IdGenerator *_id_generator;
 };
@@ -16,33 +16,243 @@
 
 #include "BuildingManager.h"
 
+#include <cmath>
+
 #include "Logger.h"
 
+namespace {
+// The kind of an element is part of its key in the spatial index, as the ids
+// of different kinds of elements may be equal.
+enum class ElementKind : uint64_t { ROOM = 1, WALL = 2, DOOR = 3, FURNITURE = 4 };
+
+uint64_t indexKey(ElementKind kind, uint64_t id) {
+  return (uint64_t(kind) << 56) | id;
+}
+
+Rect boundsOf(Room &r) {
+  return Rect::around(r.position(), r.size().x() / 2, r.size().y() / 2);
+}
+
+Rect boundsOf(Wall &w) { return Rect::spanning(w.start(), w.end()); }
+
+Rect boundsOf(Door &d) {
+  // The door may be rotated arbitrarily around its center
+  return Rect::around(d.position(), d.width() / 2, d.width() / 2);
+}
+
+Rect boundsOf(Furniture &f) {
+  float radius = std::hypot(f.size().x(), f.size().y()) / 2;
+  return Rect::around(f.position(), radius, radius);
+}
+
+// A closed door blocks the view along its frame
+void updateOccluder(Door &d, Occluders *occluders) {
+  uint64_t key = indexKey(ElementKind::DOOR, d.id());
+  if (d.isOpen()) {
+    occluders->remove(key);
+    return;
+  }
+  float dx = -std::sin(d.rotation()) * d.width() / 2;
+  float dy = std::cos(d.rotation()) * d.width() / 2;
+  occluders->set(key, Vector2f(d.position().x() - dx, d.position().y() - dy),
+                 Vector2f(d.position().x() + dx, d.position().y() + dy));
+}
+
+void updateOccluder(Wall &w, Occluders *occluders) {
+  occluders->set(indexKey(ElementKind::WALL, w.id()), w.start(), w.end());
+}
+
+// Walls and closed doors can not be crossed, furniture can not be entered
+void updateObstacle(Door &d, NavGrid *nav_grid) {
+  uint64_t key = indexKey(ElementKind::DOOR, d.id());
+  if (d.isOpen()) {
+    nav_grid->remove(key);
+    return;
+  }
+  float dx = -std::sin(d.rotation()) * d.width() / 2;
+  float dy = std::cos(d.rotation()) * d.width() / 2;
+  nav_grid->setSegment(key,
+                       Vector2f(d.position().x() - dx, d.position().y() - dy),
+                       Vector2f(d.position().x() + dx, d.position().y() + dy));
+}
+
+void updateObstacle(Wall &w, NavGrid *nav_grid) {
+  nav_grid->setSegment(indexKey(ElementKind::WALL, w.id()), w.start(),
+                       w.end());
+}
+
+void updateObstacle(Furniture &f, NavGrid *nav_grid) {
+  nav_grid->setBox(indexKey(ElementKind::FURNITURE, f.id()), f.position(),
+                   f.size(), f.rotation());
+}
+
+bool isSeen(const Visible &visible, Room &r) {
+  return visible.intersects(boundsOf(r));
+}
+
+bool isSeen(const Visible &visible, Wall &w) {
+  return visible.intersects(w.start(), w.end());
+}
+
+bool isSeen(const Visible &visible, Door &d) {
+  Vector2f offset(-std::sin(d.rotation()) * d.width() / 2,
+                  std::cos(d.rotation()) * d.width() / 2);
+  return visible.intersects(
+      Vector2f(d.position().x() - offset.x(), d.position().y() - offset.y()),
+      Vector2f(d.position().x() + offset.x(), d.position().y() + offset.y()));
+}
+
+bool isSeen(const Visible &visible, Furniture &f) {
+  return visible.intersects(boundsOf(f));
+}
+
+template <typename T>
+void revealElements(SlotMap<T> *elements, ElementKind kind,
+                    SpatialGrid *index, const Visible &visible,
+                    const char *packet_type, nlohmann::json *packets) {
+  // Walls lie on the border of the visible area
+  for (uint64_t key : index->query(visible.bounds().expanded(0.01))) {
+    if ((key >> 56) != uint64_t(kind)) {
+      continue;
+    }
+    T *element = elements->get(key & ((uint64_t(1) << 56) - 1));
+    if (element == nullptr || element->isVisible() ||
+        !isSeen(visible, *element)) {
+      continue;
+    }
+    element->isVisible() = true;
+    nlohmann::json packet;
+    packet["type"] = packet_type;
+    packet["data"] = element->toJson();
+    packets->push_back(packet);
+  }
+}
+
+template <typename T>
+void syncElements(SlotMap<T> *elements, ElementKind kind, SpatialGrid *index,
+                  const Rect &area, const Rect *known, nlohmann::json *out) {
+  *out = nlohmann::json::array();
+  for (uint64_t key : index->query(area)) {
+    if ((key >> 56) != uint64_t(kind)) {
+      continue;
+    }
+    if (known != nullptr && index->bounds(key)->intersects(*known)) {
+      continue;
+    }
+    T *element = elements->get(key & ((uint64_t(1) << 56) - 1));
+    if (element != nullptr) {
+      out->push_back(element->toJson());
+    }
+  }
+}
+}  // namespace
+
 BuildingManager::BuildingManager(IdGenerator *id_generator)
-    : _building(id_generator), _id_generator(id_generator) {}
+    : _building(id_generator),
+      _id_generator(id_generator),
+      _index(INDEX_CELL_SIZE) {}
 
 nlohmann::json BuildingManager::toJson() const { return _building.toJson(); }
 
-WebSocketServer::Response BuildingManager::onSetDoorOpen(const Packet &j) {
+std::shared_ptr<const Version<Building>> BuildingManager::version() {
+  return _version.current(_building);
+}
+
+void BuildingManager::syncArea(const Rect &area, const Rect *known,
+                               nlohmann::json *sync) {
+  syncElements(&_building.rooms(), ElementKind::ROOM, &_index, area, known,
+               &(*sync)["rooms"]);
+  syncElements(&_building.walls(), ElementKind::WALL, &_index, area, known,
+               &(*sync)["walls"]);
+  syncElements(&_building.doors(), ElementKind::DOOR, &_index, area, known,
+               &(*sync)["doors"]);
+  syncElements(&_building.furniture(), ElementKind::FURNITURE, &_index, area,
+               known, &(*sync)["furniture"]);
+}
+
+Visible BuildingManager::computeVisible(const Vector2f &origin, float range) {
+  return _occluders.computeVisible(origin, range);
+}
+
+bool BuildingManager::isBlocked(const Vector2f &a, const Vector2f &b) {
+  return _occluders.blocks(a, b);
+}
+
+std::vector<Rect> BuildingManager::takeOccluderChanges() {
+  return _occluders.takeChanges();
+}
+
+void BuildingManager::reveal(const Visible &visible, nlohmann::json *packets) {
+  size_t num_packets = packets->size();
+  revealElements(&_building.rooms(), ElementKind::ROOM, &_index, visible,
+                 "ModifyRoom", packets);
+  revealElements(&_building.walls(), ElementKind::WALL, &_index, visible,
+                 "ModifyWall", packets);
+  revealElements(&_building.doors(), ElementKind::DOOR, &_index, visible,
+                 "ModifyDoor", packets);
+  revealElements(&_building.furniture(), ElementKind::FURNITURE, &_index,
+                 visible, "ModifyFurniture", packets);
+  if (packets->size() != num_packets) {
+    _version.invalidate();
+  }
+}
+
+NavGrid &BuildingManager::navGrid() { return _nav_grid; }
+
+void BuildingManager::read(BinaryReader *reader) {
+  _building.read(reader);
+  rebuildIndex();
+  _version.invalidate();
+}
+
+void BuildingManager::rebuildIndex() {
+  _index.clear();
+  _occluders.clear();
+  _nav_grid.clear();
+  for (Room &r : _building.rooms()) {
+    _index.insert(indexKey(ElementKind::ROOM, r.id()), boundsOf(r));
+  }
+  for (Wall &w : _building.walls()) {
+    _index.insert(indexKey(ElementKind::WALL, w.id()), boundsOf(w));
+    updateOccluder(w, &_occluders);
+    updateObstacle(w, &_nav_grid);
+  }
+  for (Door &d : _building.doors()) {
+    _index.insert(indexKey(ElementKind::DOOR, d.id()), boundsOf(d));
+    updateOccluder(d, &_occluders);
+    updateObstacle(d, &_nav_grid);
+  }
+  for (Furniture &f : _building.furniture()) {
+    _index.insert(indexKey(ElementKind::FURNITURE, f.id()), boundsOf(f));
+    updateObstacle(f, &_nav_grid);
+  }
+}
+
+WebSocketServer::Response BuildingManager::onSetDoorOpen(
+    const Packet &j, const packets::SetDoorOpen &p) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  std::shared_ptr<Door> d = _building.door(j.json().at("data").at("id"));
+  Door *d = _building.door(p.id);
   if (d != nullptr) {
-    d->setOpen(j.json().at("data").at("open").get<bool>());
+    d->setOpen(p.open);
+    updateOccluder(*d, &_occluders);
+    updateObstacle(*d, &_nav_grid);
+    _version.invalidate();
     return {"", WebSocketServer::ResponseType::FORWARD};
   }
   return {"", WebSocketServer::ResponseType::SILENCE};
 }
 
-WebSocketServer::Response BuildingManager::onCreateRoom(const Packet &j) {
+WebSocketServer::Response BuildingManager::onCreateRoom(
+    const Packet &j, const packets::CreateRoom &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  Vector2f pos = Vector2f::fromJson(j.json().at("data").at("position"));
-  Vector2f size = Vector2f::fromJson(j.json().at("data").at("size"));
-  std::shared_ptr<Room> r = _building.addRoom(pos, size);
+  Room *r = _building.addRoom(p.position, p.size);
+  _version.invalidate();
+  _index.insert(indexKey(ElementKind::ROOM, r->id()), boundsOf(*r));
 
   json response;
   response["type"] = "CreateRoom";
@@ -51,15 +261,18 @@ WebSocketServer::Response BuildingManager::onCreateRoom(const Packet &j) {
   return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
 }
 
-WebSocketServer::Response BuildingManager::onCreateWall(const Packet &j) {
+WebSocketServer::Response BuildingManager::onCreateWall(
+    const Packet &j, const packets::CreateWall &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
 
-  Vector2f start = Vector2f::fromJson(j.json().at("data").at("start"));
-  Vector2f end = Vector2f::fromJson(j.json().at("data").at("end"));
-  std::shared_ptr<Wall> w = _building.addWall(start, end);
+  Wall *w = _building.addWall(p.start, p.end);
+  _version.invalidate();
+  _index.insert(indexKey(ElementKind::WALL, w->id()), boundsOf(*w));
+  updateOccluder(*w, &_occluders);
+  updateObstacle(*w, &_nav_grid);
 
   json response;
   response["type"] = "CreateWall";
@@ -68,16 +281,18 @@ WebSocketServer::Response BuildingManager::onCreateWall(const Packet &j) {
   return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
 }
 
-WebSocketServer::Response BuildingManager::onCreateDoor(const Packet &j) {
+WebSocketServer::Response BuildingManager::onCreateDoor(
+    const Packet &j, const packets::CreateDoor &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
 
-  Vector2f position = Vector2f::fromJson(j.json().at("data").at("position"));
-  float width = j.json().at("data").at("width").get<float>();
-  float rotation = j.json().at("data").at("rotation").get<float>();
-  std::shared_ptr<Door> d = _building.addDoor(position, width, rotation);
+  Door *d = _building.addDoor(p.position, p.width, p.rotation);
+  _version.invalidate();
+  _index.insert(indexKey(ElementKind::DOOR, d->id()), boundsOf(*d));
+  updateOccluder(*d, &_occluders);
+  updateObstacle(*d, &_nav_grid);
 
   json response;
   response["type"] = "CreateDoor";
@@ -86,17 +301,18 @@ WebSocketServer::Response BuildingManager::onCreateDoor(const Packet &j) {
   return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
 }
 
-WebSocketServer::Response BuildingManager::onCreateFurniture(const Packet &j) {
+WebSocketServer::Response BuildingManager::onCreateFurniture(
+    const Packet &j, const packets::CreateFurniture &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
 
-  Vector2f position = Vector2f::fromJson(j.json().at("data").at("position"));
-  Vector2f size = Vector2f::fromJson(j.json().at("data").at("size"));
-  float rotation = j.json().at("data").at("rotation").get<float>();
-  std::shared_ptr<Furniture> f =
-      _building.addFurniture(position, size, rotation);
+  Furniture *f =
+      _building.addFurniture(p.position, p.size, p.rotation);
+  _version.invalidate();
+  _index.insert(indexKey(ElementKind::FURNITURE, f->id()), boundsOf(*f));
+  updateObstacle(*f, &_nav_grid);
 
   json response;
   response["type"] = "CreateFurniture";
@@ -105,150 +321,167 @@ WebSocketServer::Response BuildingManager::onCreateFurniture(const Packet &j) {
   return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
 }
 
-WebSocketServer::Response BuildingManager::onModifyRoom(const Packet &j) {
+WebSocketServer::Response BuildingManager::onModifyRoom(
+    const Packet &j, const packets::ModifyRoom &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  uint64_t id = j.json().at("data").at("id").get<uint64_t>();
-  Vector2f pos = Vector2f::fromJson(j.json().at("data").at("position"));
-  Vector2f size = Vector2f::fromJson(j.json().at("data").at("size"));
-  bool is_visible = j.json().at("data").at("is_visible").get<bool>();
-
-  std::shared_ptr<Room> r = _building.room(id);
+  Room *r = _building.room(p.id);
   if (r) {
-    r->position() = pos;
-    r->size() = size;
-    r->isVisible() = is_visible;
+    Rect before = boundsOf(*r);
+    r->position() = p.position;
+    r->size() = p.size;
+    r->isVisible() = p.is_visible;
+    Rect after = boundsOf(*r);
+    _index.insert(indexKey(ElementKind::ROOM, r->id()), after);
+    _version.invalidate();
 
     json response;
     response["type"] = "ModifyRoom";
     response["data"] = r->toJson();
 
-    return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
+    // Only clients seeing the element before or after the change need it
+    return {response.dump(), WebSocketServer::ResponseType::BROADCAST,
+            before.united(after)};
   }
   return {"", WebSocketServer::ResponseType::SILENCE};
 }
 
-WebSocketServer::Response BuildingManager::onModifyWall(const Packet &j) {
+WebSocketServer::Response BuildingManager::onModifyWall(
+    const Packet &j, const packets::ModifyWall &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-
-  uint64_t id = j.json().at("data").at("id").get<uint64_t>();
-  Vector2f start = Vector2f::fromJson(j.json().at("data").at("start"));
-  Vector2f end = Vector2f::fromJson(j.json().at("data").at("end"));
-  bool is_visible = j.json().at("data").at("is_visible").get<bool>();
-
-  std::shared_ptr<Wall> w = _building.wall(id);
+  Wall *w = _building.wall(p.id);
   if (w) {
-    w->start() = start;
-    w->end() = end;
-    w->isVisible() = is_visible;
+    Rect before = boundsOf(*w);
+    w->start() = p.start;
+    w->end() = p.end;
+    w->isVisible() = p.is_visible;
+    Rect after = boundsOf(*w);
+    _index.insert(indexKey(ElementKind::WALL, w->id()), after);
+    updateOccluder(*w, &_occluders);
+    updateObstacle(*w, &_nav_grid);
+    _version.invalidate();
 
     json response;
     response["type"] = "ModifyWall";
     response["data"] = w->toJson();
 
-    return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
+    return {response.dump(), WebSocketServer::ResponseType::BROADCAST,
+            before.united(after)};
   }
   return {"", WebSocketServer::ResponseType::SILENCE};
 }
 
-WebSocketServer::Response BuildingManager::onModifyDoor(const Packet &j) {
+WebSocketServer::Response BuildingManager::onModifyDoor(
+    const Packet &j, const packets::ModifyDoor &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-
-  uint64_t id = j.json().at("data").at("id").get<uint64_t>();
-  Vector2f position = Vector2f::fromJson(j.json().at("data").at("position"));
-  float width = j.json().at("data").at("width").get<float>();
-  float rotation = j.json().at("data").at("rotation").get<float>();
-  bool is_open = j.json().at("data").at("is_open").get<bool>();
-  bool is_visible = j.json().at("data").at("is_visible").get<bool>();
-
-  std::shared_ptr<Door> d = _building.door(id);
+  Door *d = _building.door(p.id);
   if (d) {
-    d->position() = position;
-    d->width() = width;
-    d->rotation() = rotation;
-    d->isOpen() = is_open;
-    d->isVisible() = is_visible;
+    Rect before = boundsOf(*d);
+    d->position() = p.position;
+    d->width() = p.width;
+    d->rotation() = p.rotation;
+    d->isOpen() = p.is_open;
+    d->isVisible() = p.is_visible;
+    Rect after = boundsOf(*d);
+    _index.insert(indexKey(ElementKind::DOOR, d->id()), after);
+    updateOccluder(*d, &_occluders);
+    updateObstacle(*d, &_nav_grid);
+    _version.invalidate();
 
     json response;
     response["type"] = "ModifyDoor";
     response["data"] = d->toJson();
 
-    return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
+    return {response.dump(), WebSocketServer::ResponseType::BROADCAST,
+            before.united(after)};
   } else {
     LOG_WARN << "Tried to modify a nonexistant door" << LOG_END;
   }
   return {"", WebSocketServer::ResponseType::SILENCE};
 }
 
-WebSocketServer::Response BuildingManager::onModifyFurniture(const Packet &j) {
+WebSocketServer::Response BuildingManager::onModifyFurniture(
+    const Packet &j, const packets::ModifyFurniture &p) {
   using nlohmann::json;
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-
-  uint64_t id = j.json().at("data").at("id").get<uint64_t>();
-  Vector2f position = Vector2f::fromJson(j.json().at("data").at("position"));
-  Vector2f size = Vector2f::fromJson(j.json().at("data").at("size"));
-  float rotation = j.json().at("data").at("rotation").get<float>();
-  bool is_visible = j.json().at("data").at("is_visible").get<bool>();
-
-  std::shared_ptr<Furniture> f = _building.furniture(id);
+  Furniture *f = _building.furniture(p.id);
   if (f) {
-    f->position() = position;
-    f->size() = size;
-    f->rotation() = rotation;
-    f->isVisible() = is_visible;
+    Rect before = boundsOf(*f);
+    f->position() = p.position;
+    f->size() = p.size;
+    f->rotation() = p.rotation;
+    f->isVisible() = p.is_visible;
+    Rect after = boundsOf(*f);
+    _index.insert(indexKey(ElementKind::FURNITURE, f->id()), after);
+    updateObstacle(*f, &_nav_grid);
+    _version.invalidate();
 
     json response;
     response["type"] = "ModifyFurniture";
     response["data"] = f->toJson();
 
-    return {response.dump(), WebSocketServer::ResponseType::BROADCAST};
+    return {response.dump(), WebSocketServer::ResponseType::BROADCAST,
+            before.united(after)};
   }
   return {"", WebSocketServer::ResponseType::SILENCE};
 }
 
-WebSocketServer::Response BuildingManager::onDeleteRoom(const Packet &j) {
-  using nlohmann::json;
+WebSocketServer::Response BuildingManager::onDeleteRoom(
+    const Packet &j, const packets::DeleteRoom &p) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _building.deleteRoom(j.json().at("data").at("id").get<uint64_t>());
+  _building.deleteRoom(p.id);
+  _index.remove(indexKey(ElementKind::ROOM, p.id));
+  _version.invalidate();
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
-WebSocketServer::Response BuildingManager::onDeleteWall(const Packet &j) {
-  using nlohmann::json;
+WebSocketServer::Response BuildingManager::onDeleteWall(
+    const Packet &j, const packets::DeleteWall &p) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _building.deleteWall(j.json().at("data").at("id").get<uint64_t>());
+  _building.deleteWall(p.id);
+  _index.remove(indexKey(ElementKind::WALL, p.id));
+  _occluders.remove(indexKey(ElementKind::WALL, p.id));
+  _nav_grid.remove(indexKey(ElementKind::WALL, p.id));
+  _version.invalidate();
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
-WebSocketServer::Response BuildingManager::onDeleteDoor(const Packet &j) {
-  using nlohmann::json;
+WebSocketServer::Response BuildingManager::onDeleteDoor(
+    const Packet &j, const packets::DeleteDoor &p) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _building.deleteDoor(j.json().at("data").at("id").get<uint64_t>());
+  _building.deleteDoor(p.id);
+  _index.remove(indexKey(ElementKind::DOOR, p.id));
+  _occluders.remove(indexKey(ElementKind::DOOR, p.id));
+  _nav_grid.remove(indexKey(ElementKind::DOOR, p.id));
+  _version.invalidate();
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
-WebSocketServer::Response BuildingManager::onDeleteFurniture(const Packet &j) {
-  using nlohmann::json;
+WebSocketServer::Response BuildingManager::onDeleteFurniture(
+    const Packet &j, const packets::DeleteFurniture &p) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _building.deleteFurniture(j.json().at("data").at("id").get<uint64_t>());
+  _building.deleteFurniture(p.id);
+  _index.remove(indexKey(ElementKind::FURNITURE, p.id));
+  _nav_grid.remove(indexKey(ElementKind::FURNITURE, p.id));
+  _version.invalidate();
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
@@ -256,7 +489,11 @@ WebSocketServer::Response BuildingManager::onClearBuilding(const Packet &j) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _building = Building(_id_generator);
+  _building.clear();
+  _index.clear();
+  _occluders.clear();
+  _nav_grid.clear();
+  _version.invalidate();
   return {"", WebSocketServer::ResponseType::FORWARD};
 }
 
@@ -265,41 +502,13 @@ WebSocketServer::Response BuildingManager::onLoadBuilding(const Packet &j) {
   if (!j.checkPermissions(Permissions::GAMEMASTER)) {
     return j.makeMissingPermissionsResponse();
   }
-  _building = Building(_id_generator);
+  _building.clear();
   _building.fromJson(j.json().at("data"));
+  rebuildIndex();
+  _version.invalidate();
   json r;
   r["type"] = "LoadBuilding";
   r["data"] = _building.toJson();
-  return {r.dump(), WebSocketServer::ResponseType::BROADCAST};
-}
-
-void BuildingManager::registerPackets(
-    std::unordered_map<std::string,
-                       std::function<WebSocketServer::Response(const Packet &)>>
-        *packet_handlers) {
-  using std::placeholders::_1;
-  std::unordered_map<std::string,
-                     std::function<WebSocketServer::Response(const Packet &)>>
-      handlers = {
-          {"SetDoorOpen", std::bind(&BuildingManager::onSetDoorOpen, this, _1)},
-          {"ClearBuilding",
-           std::bind(&BuildingManager::onClearBuilding, this, _1)},
-          {"LoadBuilding",
-           std::bind(&BuildingManager::onLoadBuilding, this, _1)},
-          {"CreateRoom", std::bind(&BuildingManager::onCreateRoom, this, _1)},
-          {"CreateWall", std::bind(&BuildingManager::onCreateWall, this, _1)},
-          {"CreateDoor", std::bind(&BuildingManager::onCreateDoor, this, _1)},
-          {"CreateFurniture",
-           std::bind(&BuildingManager::onCreateFurniture, this, _1)},
-          {"ModifyRoom", std::bind(&BuildingManager::onModifyRoom, this, _1)},
-          {"ModifyWall", std::bind(&BuildingManager::onModifyWall, this, _1)},
-          {"ModifyDoor", std::bind(&BuildingManager::onModifyDoor, this, _1)},
-          {"ModifyFurniture",
-           std::bind(&BuildingManager::onModifyFurniture, this, _1)},
-          {"DeleteRoom", std::bind(&BuildingManager::onDeleteRoom, this, _1)},
-          {"DeleteWall", std::bind(&BuildingManager::onDeleteWall, this, _1)},
-          {"DeleteDoor", std::bind(&BuildingManager::onDeleteDoor, this, _1)},
-          {"DeleteFurniture",
-           std::bind(&BuildingManager::onDeleteFurniture, this, _1)}};
-  packet_handlers->insert(handlers.begin(), handlers.end());
+  return {r.dump(), WebSocketServer::ResponseType::BROADCAST,
+          Rect::everything(), WebSocketServer::Lane::BULK};
 }
@@ -21,39 +21,114 @@
 #include "Building.h"
 #include "WebSocketServer.h"
 #include "Packet.h"
+#include "PacketSchema.h"
 #include "IdGenerator.h"
+#include "NavGrid.h"
+#include "Scene.h"
+#include "Visible.h"
+#include "geometry/SpatialGrid.h"
 
 class BuildingManager {
  public:
   BuildingManager(IdGenerator *id_generator);
 
-  WebSocketServer::Response onSetDoorOpen(const Packet &j);
-  WebSocketServer::Response onCreateRoom(const Packet &j);
-  WebSocketServer::Response onCreateWall(const Packet &j);
-  WebSocketServer::Response onCreateDoor(const Packet &j);
-  WebSocketServer::Response onCreateFurniture(const Packet &j);
+  WebSocketServer::Response onSetDoorOpen(const Packet &j,
+                                          const packets::SetDoorOpen &p);
+  WebSocketServer::Response onCreateRoom(const Packet &j,
+                                         const packets::CreateRoom &p);
+  WebSocketServer::Response onCreateWall(const Packet &j,
+                                         const packets::CreateWall &p);
+  WebSocketServer::Response onCreateDoor(const Packet &j,
+                                         const packets::CreateDoor &p);
+  WebSocketServer::Response onCreateFurniture(
+      const Packet &j, const packets::CreateFurniture &p);
 
-  WebSocketServer::Response onModifyRoom(const Packet &j);
-  WebSocketServer::Response onModifyWall(const Packet &j);
-  WebSocketServer::Response onModifyDoor(const Packet &j);
-  WebSocketServer::Response onModifyFurniture(const Packet &j);
+  WebSocketServer::Response onModifyRoom(const Packet &j,
+                                         const packets::ModifyRoom &p);
+  WebSocketServer::Response onModifyWall(const Packet &j,
+                                         const packets::ModifyWall &p);
+  WebSocketServer::Response onModifyDoor(const Packet &j,
+                                         const packets::ModifyDoor &p);
+  WebSocketServer::Response onModifyFurniture(
+      const Packet &j, const packets::ModifyFurniture &p);
 
-  WebSocketServer::Response onDeleteRoom(const Packet &j);
-  WebSocketServer::Response onDeleteWall(const Packet &j);
-  WebSocketServer::Response onDeleteDoor(const Packet &j);
-  WebSocketServer::Response onDeleteFurniture(const Packet &j);
+  WebSocketServer::Response onDeleteRoom(const Packet &j,
+                                         const packets::DeleteRoom &p);
+  WebSocketServer::Response onDeleteWall(const Packet &j,
+                                         const packets::DeleteWall &p);
+  WebSocketServer::Response onDeleteDoor(const Packet &j,
+                                         const packets::DeleteDoor &p);
+  WebSocketServer::Response onDeleteFurniture(
+      const Packet &j, const packets::DeleteFurniture &p);
 
   WebSocketServer::Response onClearBuilding(const Packet &j);
   WebSocketServer::Response onLoadBuilding(const Packet &j);
 
   nlohmann::json toJson() const;
 
-  void registerPackets(
-      std::unordered_map<
-          std::string, std::function<WebSocketServer::Response(const Packet &)>>
-          *packet_handlers);
+  /**
+   * @brief Replaces the building with one written by Building::write.
+   */
+  void read(BinaryReader *reader);
+
+  /**
+   * @return An immutable copy of the building, which can be serialized on
+   *         another thread. The copy is shared until the building is
+   *         modified.
+   */
+  std::shared_ptr<const Version<Building>> version();
+
+  /**
+   * @brief Adds the elements intersecting area to the sync packet data, as
+   *        arrays named rooms, walls, doors and furniture.
+   * @param known Elements intersecting this area are skipped, as the client
+   *              already knows their current state. May be null.
+   */
+  void syncArea(const Rect &area, const Rect *known, nlohmann::json *sync);
+
+  /**
+   * @return The area visible from origin, blocked by walls and closed doors.
+   */
+  Visible computeVisible(const Vector2f &origin, float range);
+  /**
+   * @return True if a wall or closed door blocks the view from a to b.
+   */
+  bool isBlocked(const Vector2f &a, const Vector2f &b);
+
+  /**
+   * @return The areas in which walls or closed doors changed since the last
+   *         call.
+   */
+  std::vector<Rect> takeOccluderChanges();
+
+  /**
+   * @brief Makes all hidden elements within the visible area visible.
+   * @param packets The Modify packets of the revealed elements are appended to
+   *                this array.
+   */
+  void reveal(const Visible &visible, nlohmann::json *packets);
+
+  /**
+   * @return The grid on which tokens move around walls, closed doors and
+   *         furniture.
+   */
+  NavGrid &navGrid();
 
  private:
+  void rebuildIndex();
+
+  static constexpr float INDEX_CELL_SIZE = 8;
+
   Building _building;
   IdGenerator *_id_generator;
+
+  // The bounds of all elements of the building
+  SpatialGrid _index;
+  // The segments blocking the line of sight
+  Occluders _occluders;
+  // The obstacles blocking the movement of tokens
+  NavGrid _nav_grid;
+
+  // The latest copy of the building handed out by version()
+  VersionedSection<Building> _version;
 };
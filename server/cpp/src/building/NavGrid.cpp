@@ -0,0 +1,407 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "NavGrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+// The eight directions, counter clockwise starting east. Diagonal moves have
+// odd indices.
+const int32_t DX[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+const int32_t DY[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+const float DIAGONAL = std::sqrt(2.0f);
+
+const float INFINITE_COST = std::numeric_limits<float>::infinity();
+
+float cross(float ax, float ay, float bx, float by) { return ax * by - ay * bx; }
+
+bool segmentsIntersect(const Vector2f &a, const Vector2f &b, const Vector2f &c,
+                       const Vector2f &d) {
+  float abx = b.x() - a.x(), aby = b.y() - a.y();
+  float cdx = d.x() - c.x(), cdy = d.y() - c.y();
+  float denom = cross(abx, aby, cdx, cdy);
+  if (denom == 0) {
+    // Parallel segments never block a move, a wall along the move touches
+    // the cells on both sides of it at most.
+    return false;
+  }
+  float s = cross(c.x() - a.x(), c.y() - a.y(), cdx, cdy) / denom;
+  float t = cross(c.x() - a.x(), c.y() - a.y(), abx, aby) / denom;
+  return s >= 0 && s <= 1 && t >= 0 && t <= 1;
+}
+}  // namespace
+
+size_t NavGrid::Window::index(int32_t x, int32_t y) const {
+  return size_t(y - min_y) * width + (x - min_x);
+}
+
+bool NavGrid::Window::contains(int32_t x, int32_t y) const {
+  return x >= min_x && y >= min_y && x < min_x + width && y < min_y + height;
+}
+
+NavGrid::NavGrid() : _index(CHUNK_CELLS * CELL_SIZE) {}
+
+void NavGrid::setSegment(uint64_t key, const Vector2f &a, const Vector2f &b) {
+  remove(key);
+  Rect bounds = Rect::spanning(a, b);
+  _obstacles[key] = {false, a, b, 0};
+  _index.insert(key, bounds);
+  invalidate(bounds);
+}
+
+void NavGrid::setBox(uint64_t key, const Vector2f &center,
+                     const Vector2f &size, float rotation) {
+  remove(key);
+  // The box may be rotated arbitrarily around its center
+  float radius = std::hypot(size.x(), size.y()) / 2;
+  Rect bounds = Rect::around(center, radius, radius);
+  _obstacles[key] = {true, center, size, rotation};
+  _index.insert(key, bounds);
+  invalidate(bounds);
+}
+
+void NavGrid::remove(uint64_t key) {
+  const Rect *bounds = _index.bounds(key);
+  if (bounds != nullptr) {
+    invalidate(*bounds);
+    _index.remove(key);
+    _obstacles.erase(key);
+  }
+}
+
+void NavGrid::clear() {
+  _obstacles.clear();
+  _index.clear();
+  _chunks.clear();
+}
+
+int32_t NavGrid::cellOf(float v) { return int32_t(std::floor(v / CELL_SIZE)); }
+
+Vector2f NavGrid::centerOf(int32_t x, int32_t y) {
+  return Vector2f((x + 0.5f) * CELL_SIZE, (y + 0.5f) * CELL_SIZE);
+}
+
+uint64_t NavGrid::chunkKey(int32_t x, int32_t y) {
+  return (uint64_t(uint32_t(x)) << 32) | uint32_t(y);
+}
+
+void NavGrid::invalidate(const Rect &area) {
+  // Moves start up to one cell away from the obstacle
+  float chunk_size = CHUNK_CELLS * CELL_SIZE;
+  Rect affected = area.expanded(CELL_SIZE);
+  int32_t min_x = std::floor(affected.minX() / chunk_size);
+  int32_t min_y = std::floor(affected.minY() / chunk_size);
+  int32_t max_x = std::floor(affected.maxX() / chunk_size);
+  int32_t max_y = std::floor(affected.maxY() / chunk_size);
+  for (int32_t y = min_y; y <= max_y; ++y) {
+    for (int32_t x = min_x; x <= max_x; ++x) {
+      _chunks.erase(chunkKey(x, y));
+    }
+  }
+}
+
+const NavGrid::Chunk &NavGrid::chunk(int32_t chunk_x, int32_t chunk_y) {
+  std::unique_ptr<Chunk> &c = _chunks[chunkKey(chunk_x, chunk_y)];
+  if (!c) {
+    c = std::make_unique<Chunk>();
+    computeChunk(chunk_x, chunk_y, c.get());
+  }
+  return *c;
+}
+
+void NavGrid::computeChunk(int32_t chunk_x, int32_t chunk_y, Chunk *chunk) {
+  int32_t min_x = chunk_x * CHUNK_CELLS;
+  int32_t min_y = chunk_y * CHUNK_CELLS;
+  Rect area = Rect::spanning(centerOf(min_x - 1, min_y - 1),
+                             centerOf(min_x + CHUNK_CELLS, min_y + CHUNK_CELLS));
+  std::vector<const Obstacle *> obstacles;
+  for (uint64_t key : _index.query(area)) {
+    obstacles.push_back(&_obstacles.at(key));
+  }
+
+  auto isBlocked = [&obstacles](const Vector2f &from, const Vector2f &to) {
+    for (const Obstacle *o : obstacles) {
+      if (o->is_box) {
+        // Transform the target into the frame of the box
+        float dx = to.x() - o->a.x();
+        float dy = to.y() - o->a.y();
+        float c = std::cos(-o->rotation);
+        float s = std::sin(-o->rotation);
+        float lx = dx * c - dy * s;
+        float ly = dx * s + dy * c;
+        if (std::abs(lx) < o->b.x() / 2 && std::abs(ly) < o->b.y() / 2) {
+          return true;
+        }
+      } else if (segmentsIntersect(from, to, o->a, o->b)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (int32_t y = 0; y < CHUNK_CELLS; ++y) {
+    for (int32_t x = 0; x < CHUNK_CELLS; ++x) {
+      uint8_t blocked = 0;
+      Vector2f from = centerOf(min_x + x, min_y + y);
+      if (!obstacles.empty()) {
+        for (int d = 0; d < 8; ++d) {
+          if (isBlocked(from, centerOf(min_x + x + DX[d], min_y + y + DY[d]))) {
+            blocked |= 1 << d;
+          }
+        }
+        // Diagonal moves may not cut the corners of obstacles
+        for (int d = 1; d < 8; d += 2) {
+          if (blocked & ((1 << (d - 1)) | (1 << ((d + 1) % 8)))) {
+            blocked |= 1 << d;
+          }
+        }
+      }
+      chunk->blocked[y * CHUNK_CELLS + x] = blocked;
+    }
+  }
+}
+
+void NavGrid::loadWindow(int32_t min_x, int32_t min_y, int32_t max_x,
+                         int32_t max_y, Window *window) {
+  window->min_x = min_x;
+  window->min_y = min_y;
+  window->width = max_x - min_x + 1;
+  window->height = max_y - min_y + 1;
+  window->blocked.resize(size_t(window->width) * window->height);
+  // Copy chunk by chunk to look up every chunk only once
+  auto chunkOf = [](int32_t v) {
+    return int32_t(std::floor(float(v) / CHUNK_CELLS));
+  };
+  for (int32_t cy = chunkOf(min_y); cy <= chunkOf(max_y); ++cy) {
+    for (int32_t cx = chunkOf(min_x); cx <= chunkOf(max_x); ++cx) {
+      const Chunk &c = chunk(cx, cy);
+      int32_t from_x = std::max(min_x, cx * CHUNK_CELLS);
+      int32_t to_x = std::min(max_x, cx * CHUNK_CELLS + CHUNK_CELLS - 1);
+      int32_t from_y = std::max(min_y, cy * CHUNK_CELLS);
+      int32_t to_y = std::min(max_y, cy * CHUNK_CELLS + CHUNK_CELLS - 1);
+      for (int32_t y = from_y; y <= to_y; ++y) {
+        const uint8_t *row = c.blocked + (y - cy * CHUNK_CELLS) * CHUNK_CELLS;
+        std::copy(row + from_x - cx * CHUNK_CELLS,
+                  row + to_x - cx * CHUNK_CELLS + 1,
+                  window->blocked.begin() + window->index(from_x, y));
+      }
+    }
+  }
+  // Block all moves out of the window, so the search never has to check
+  // whether a neighbour is inside of it.
+  uint8_t leaves_west = 0, leaves_east = 0, leaves_south = 0, leaves_north = 0;
+  for (int d = 0; d < 8; ++d) {
+    leaves_west |= DX[d] < 0 ? 1 << d : 0;
+    leaves_east |= DX[d] > 0 ? 1 << d : 0;
+    leaves_south |= DY[d] < 0 ? 1 << d : 0;
+    leaves_north |= DY[d] > 0 ? 1 << d : 0;
+  }
+  for (int32_t y = min_y; y <= max_y; ++y) {
+    window->blocked[window->index(min_x, y)] |= leaves_west;
+    window->blocked[window->index(max_x, y)] |= leaves_east;
+  }
+  for (int32_t x = min_x; x <= max_x; ++x) {
+    window->blocked[window->index(x, min_y)] |= leaves_south;
+    window->blocked[window->index(x, max_y)] |= leaves_north;
+  }
+}
+
+void NavGrid::prepareSearch(const Window &window, int32_t *offset,
+                            float *step) {
+  size_t size = window.blocked.size();
+  _cost.assign(size, INFINITE_COST);
+  _parent.assign(size, -1);
+  _closed.assign(size, 0);
+  for (int d = 0; d < 8; ++d) {
+    offset[d] = DY[d] * window.width + DX[d];
+    step[d] = (d % 2 == 1 ? DIAGONAL : 1.0f) * CELL_SIZE;
+  }
+}
+
+void NavGrid::flood(const Window &window, int32_t start_x, int32_t start_y,
+                    float max_cost) {
+  int32_t offset[8];
+  float step[8];
+  prepareSearch(window, offset, step);
+
+  // Every move costs at least CELL_SIZE, so the moves out of a bucket of
+  // that width always end in a later bucket. All cells in a bucket are
+  // final once it is reached and need no ordering among each other.
+  size_t bucket_count = size_t(max_cost / CELL_SIZE) + 2;
+  if (_buckets.size() < bucket_count) {
+    _buckets.resize(bucket_count);
+  }
+  for (size_t b = 0; b < bucket_count; ++b) {
+    _buckets[b].clear();
+  }
+  int32_t start = int32_t(window.index(start_x, start_y));
+  _cost[start] = 0;
+  _buckets[0].push_back(start);
+  for (size_t b = 0; b < bucket_count; ++b) {
+    // Rounding may put a cell into the current bucket, so do not hold on to
+    // an iterator.
+    for (size_t i = 0; i < _buckets[b].size(); ++i) {
+      int32_t current = _buckets[b][i];
+      if (_closed[current]) {
+        continue;
+      }
+      _closed[current] = 1;
+      uint8_t blocked = window.blocked[current];
+      for (int d = 0; d < 8; ++d) {
+        if (blocked & (1 << d)) {
+          continue;
+        }
+        int32_t next = current + offset[d];
+        float cost = _cost[current] + step[d];
+        if (cost > max_cost || cost >= _cost[next]) {
+          continue;
+        }
+        _cost[next] = cost;
+        _parent[next] = current;
+        size_t bucket = std::max(b, size_t(cost / CELL_SIZE));
+        _buckets[std::min(bucket, bucket_count - 1)].push_back(next);
+      }
+    }
+  }
+}
+
+int64_t NavGrid::search(const Window &window, int32_t start_x,
+                        int32_t start_y, int32_t target_x, int32_t target_y) {
+  int32_t offset[8];
+  float step[8];
+  prepareSearch(window, offset, step);
+  int32_t target = int32_t(window.index(target_x, target_y));
+
+  // The octile distance never overestimates the cost of eight way moves
+  auto heuristic = [&](int32_t index) {
+    float dx = std::abs(window.min_x + index % window.width - target_x);
+    float dy = std::abs(window.min_y + index / window.width - target_y);
+    return (std::max(dx, dy) + (DIAGONAL - 1) * std::min(dx, dy)) * CELL_SIZE;
+  };
+
+  // A binary heap on a reused vector, std::priority_queue would allocate
+  // for every search.
+  auto later = [](const Entry &a, const Entry &b) { return a.first > b.first; };
+  _open.clear();
+  int32_t start = int32_t(window.index(start_x, start_y));
+  _cost[start] = 0;
+  _open.push_back({heuristic(start), start});
+  while (!_open.empty()) {
+    std::pop_heap(_open.begin(), _open.end(), later);
+    int32_t current = _open.back().second;
+    _open.pop_back();
+    if (_closed[current]) {
+      continue;
+    }
+    _closed[current] = 1;
+    if (current == target) {
+      return current;
+    }
+    uint8_t blocked = window.blocked[current];
+    for (int d = 0; d < 8; ++d) {
+      if (blocked & (1 << d)) {
+        continue;
+      }
+      int32_t next = current + offset[d];
+      float cost = _cost[current] + step[d];
+      if (cost >= _cost[next]) {
+        continue;
+      }
+      _cost[next] = cost;
+      _parent[next] = current;
+      _open.push_back({cost + heuristic(next), next});
+      std::push_heap(_open.begin(), _open.end(), later);
+    }
+  }
+  return -1;
+}
+
+std::vector<NavGrid::Span> NavGrid::reachable(const Vector2f &start,
+                                              float budget) {
+  std::vector<Span> spans;
+  int32_t sx = cellOf(start.x());
+  int32_t sy = cellOf(start.y());
+  int32_t radius = std::min<int32_t>(std::ceil(budget / CELL_SIZE),
+                                     MAX_WINDOW_CELLS / 2);
+  if (radius < 0) {
+    return spans;
+  }
+  Window window;
+  loadWindow(sx - radius, sy - radius, sx + radius, sy + radius, &window);
+  flood(window, sx, sy, budget);
+
+  for (int32_t y = 0; y < window.height; ++y) {
+    int32_t begin = -1;
+    for (int32_t x = 0; x <= window.width; ++x) {
+      bool is_reachable =
+          x < window.width && _cost[size_t(y) * window.width + x] <= budget;
+      if (is_reachable && begin < 0) {
+        begin = x;
+      } else if (!is_reachable && begin >= 0) {
+        spans.push_back({window.min_y + y, window.min_x + begin,
+                         window.min_x + x - 1});
+        begin = -1;
+      }
+    }
+  }
+  return spans;
+}
+
+bool NavGrid::findPath(const Vector2f &start, const Vector2f &target,
+                       std::vector<Vector2f> *path, float *cost) {
+  int32_t sx = cellOf(start.x());
+  int32_t sy = cellOf(start.y());
+  int32_t tx = cellOf(target.x());
+  int32_t ty = cellOf(target.y());
+  int32_t min_x = std::min(sx, tx) - PATH_MARGIN;
+  int32_t min_y = std::min(sy, ty) - PATH_MARGIN;
+  int32_t max_x = std::max(sx, tx) + PATH_MARGIN;
+  int32_t max_y = std::max(sy, ty) + PATH_MARGIN;
+  if (max_x - min_x >= MAX_WINDOW_CELLS || max_y - min_y >= MAX_WINDOW_CELLS) {
+    return false;
+  }
+  Window window;
+  loadWindow(min_x, min_y, max_x, max_y, &window);
+  int64_t found = search(window, sx, sy, tx, ty);
+  if (found < 0) {
+    return false;
+  }
+  *cost = _cost[found];
+
+  // Walk back from the target, keeping only the cells where the direction
+  // changes.
+  path->clear();
+  path->push_back(target);
+  int32_t last_dx = 0, last_dy = 0;
+  for (int32_t current = int32_t(found); _parent[current] >= 0;
+       current = _parent[current]) {
+    int32_t parent = _parent[current];
+    int32_t dx = current % window.width - parent % window.width;
+    int32_t dy = current / window.width - parent / window.width;
+    if ((dx != last_dx || dy != last_dy) && current != found) {
+      path->push_back(centerOf(window.min_x + current % window.width,
+                               window.min_y + current / window.width));
+    }
+    last_dx = dx;
+    last_dy = dy;
+  }
+  path->push_back(start);
+  std::reverse(path->begin(), path->end());
+  return true;
+}
@@ -0,0 +1,146 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+#include "geometry/Rect.h"
+#include "geometry/SpatialGrid.h"
+#include "geometry/Vector.h"
+
+/**
+ * @brief A grid over the map that knows which moves between neighbouring
+ *        cells are blocked by walls, closed doors or furniture. Tokens move
+ *        between the centers of cells in eight directions.
+ *
+ *        The grid is split into chunks that are computed when they are first
+ *        needed. Changing an obstacle only drops the chunks around it.
+ */
+class NavGrid {
+ public:
+  /**
+   * @brief A row of consecutive cells, from min_x to max_x inclusive.
+   */
+  struct Span {
+    int32_t y, min_x, max_x;
+  };
+
+  NavGrid();
+
+  /**
+   * @brief Adds a segment that can not be crossed, or moves it if it already
+   *        exists.
+   */
+  void setSegment(uint64_t key, const Vector2f &a, const Vector2f &b);
+  /**
+   * @brief Adds a rectangle, rotated around its center, that can not be
+   *        entered, or moves it if it already exists.
+   */
+  void setBox(uint64_t key, const Vector2f &center, const Vector2f &size,
+              float rotation);
+  void remove(uint64_t key);
+  void clear();
+
+  /**
+   * @return The cells reachable from start with moves costing at most budget
+   *         in total, as rows of cells.
+   */
+  std::vector<Span> reachable(const Vector2f &start, float budget);
+
+  /**
+   * @brief Finds the shortest path from start to target using A*.
+   * @param path Receives the points at which the path changes direction,
+   *             starting with start and ending with target.
+   * @return False if target is not reachable.
+   */
+  bool findPath(const Vector2f &start, const Vector2f &target,
+                std::vector<Vector2f> *path, float *cost);
+
+  static constexpr float CELL_SIZE = 0.5;
+
+ private:
+  struct Obstacle {
+    bool is_box;
+    // The endpoints of a segment or the center and size of a box
+    Vector2f a, b;
+    float rotation;
+  };
+
+  static const int32_t CHUNK_CELLS = 16;
+
+  struct Chunk {
+    // Bit d is set if the move in direction d is blocked
+    uint8_t blocked[CHUNK_CELLS * CHUNK_CELLS];
+  };
+
+  /**
+   * @brief The blocked moves of a rectangular part of the grid, copied out of
+   *        the chunks so the search does not have to look them up.
+   */
+  struct Window {
+    int32_t min_x, min_y, width, height;
+    std::vector<uint8_t> blocked;
+
+    size_t index(int32_t x, int32_t y) const;
+    bool contains(int32_t x, int32_t y) const;
+  };
+
+  static int32_t cellOf(float v);
+  static Vector2f centerOf(int32_t x, int32_t y);
+  static uint64_t chunkKey(int32_t x, int32_t y);
+
+  void invalidate(const Rect &area);
+  const Chunk &chunk(int32_t chunk_x, int32_t chunk_y);
+  void computeChunk(int32_t chunk_x, int32_t chunk_y, Chunk *chunk);
+  void loadWindow(int32_t min_x, int32_t min_y, int32_t max_x, int32_t max_y,
+                  Window *window);
+
+  void prepareSearch(const Window &window, int32_t *offset, float *step);
+  /**
+   * @brief Computes the cost of all cells reachable from start for at most
+   *        max_cost, using Dijkstra with a bucket queue.
+   */
+  void flood(const Window &window, int32_t start_x, int32_t start_y,
+             float max_cost);
+  /**
+   * @brief Runs A* from start to target.
+   * @return The index of the target in the window, or -1
+   */
+  int64_t search(const Window &window, int32_t start_x, int32_t start_y,
+                 int32_t target_x, int32_t target_y);
+
+  // Paths may leave the rectangle spanned by start and target by this many
+  // cells, and never use a window larger than MAX_WINDOW_CELLS on a side.
+  static const int32_t PATH_MARGIN = 32;
+  static const int32_t MAX_WINDOW_CELLS = 512;
+
+  std::unordered_map<uint64_t, Obstacle> _obstacles;
+  SpatialGrid _index;
+  std::unordered_map<uint64_t, std::unique_ptr<Chunk>> _chunks;
+
+  // The state of the last search, reused to avoid allocations
+  using Entry = std::pair<float, int32_t>;
+  std::vector<Entry> _open;
+  std::vector<std::vector<int32_t>> _buckets;
+  std::vector<float> _cost;
+  std::vector<int32_t> _parent;
+  std::vector<uint8_t> _closed;
+};
@@ -0,0 +1,241 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Visible.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+// Points closer than this are considered to touch
+const float EPSILON = 1e-3;
+// The inside of a rectangle starts this far from its border
+const float INSET = 1e-2;
+// The angle by which rays pass the endpoints of segments
+const double ANGLE_OFFSET = 1e-4;
+
+float cross(float ax, float ay, float bx, float by) { return ax * by - ay * bx; }
+
+bool segmentsTouch(const Vector2f &a, const Vector2f &b, const Vector2f &c,
+                   const Vector2f &d) {
+  float abx = b.x() - a.x(), aby = b.y() - a.y();
+  float cdx = d.x() - c.x(), cdy = d.y() - c.y();
+  float denom = cross(abx, aby, cdx, cdy);
+  if (denom != 0) {
+    float s = cross(c.x() - a.x(), c.y() - a.y(), cdx, cdy) / denom;
+    float t = cross(c.x() - a.x(), c.y() - a.y(), abx, aby) / denom;
+    if (s >= 0 && s <= 1 && t >= 0 && t <= 1) {
+      return true;
+    }
+  }
+  return distanceToSegment(a, c, d) < EPSILON ||
+         distanceToSegment(b, c, d) < EPSILON ||
+         distanceToSegment(c, a, b) < EPSILON ||
+         distanceToSegment(d, a, b) < EPSILON;
+}
+}  // namespace
+
+Visible::Visible(const Vector2f &origin, std::vector<Vector2f> polygon)
+    : _origin(origin), _polygon(std::move(polygon)) {
+  _bounds = Rect::spanning(origin, origin);
+  for (const Vector2f &p : _polygon) {
+    _bounds = _bounds.united(Rect::spanning(p, p));
+  }
+}
+
+const Vector2f &Visible::origin() const { return _origin; }
+
+const std::vector<Vector2f> &Visible::polygon() const { return _polygon; }
+
+const Rect &Visible::bounds() const { return _bounds; }
+
+bool Visible::contains(const Vector2f &p) const {
+  if (!_bounds.contains(p.x(), p.y())) {
+    return false;
+  }
+  // Count the crossings of a ray from p in positive x direction
+  bool inside = false;
+  for (size_t i = 0, j = _polygon.size() - 1; i < _polygon.size(); j = i++) {
+    const Vector2f &a = _polygon[i];
+    const Vector2f &b = _polygon[j];
+    if ((a.y() > p.y()) != (b.y() > p.y()) &&
+        p.x() < (b.x() - a.x()) * (p.y() - a.y()) / (b.y() - a.y()) + a.x()) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+bool Visible::intersects(const Vector2f &a, const Vector2f &b) const {
+  if (_polygon.empty() ||
+      !_bounds.expanded(EPSILON).intersects(Rect::spanning(a, b))) {
+    return false;
+  }
+  if (contains(a) || contains(b)) {
+    return true;
+  }
+  for (size_t i = 0, j = _polygon.size() - 1; i < _polygon.size(); j = i++) {
+    if (segmentsTouch(_polygon[j], _polygon[i], a, b)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Visible::intersects(const Rect &rect) const {
+  // Only the inside counts, otherwise seeing a wall would reveal the room
+  // behind it.
+  Rect inner = rect.expanded(-INSET);
+  if (_polygon.empty() || inner.minX() > inner.maxX() ||
+      inner.minY() > inner.maxY() || !_bounds.intersects(inner)) {
+    return false;
+  }
+  for (const Vector2f &p : _polygon) {
+    if (inner.contains(p.x(), p.y())) {
+      return true;
+    }
+  }
+  Vector2f corners[4] = {Vector2f(inner.minX(), inner.minY()),
+                         Vector2f(inner.maxX(), inner.minY()),
+                         Vector2f(inner.maxX(), inner.maxY()),
+                         Vector2f(inner.minX(), inner.maxY())};
+  for (size_t k = 0; k < 4; ++k) {
+    if (contains(corners[k])) {
+      return true;
+    }
+  }
+  for (size_t i = 0, j = _polygon.size() - 1; i < _polygon.size(); j = i++) {
+    for (size_t k = 0; k < 4; ++k) {
+      if (segmentsTouch(_polygon[j], _polygon[i], corners[k],
+                        corners[(k + 1) % 4])) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+Occluders::Occluders() : _index(INDEX_CELL_SIZE) {}
+
+void Occluders::set(uint64_t key, const Vector2f &a, const Vector2f &b) {
+  Rect bounds = Rect::spanning(a, b);
+  const Rect *old_bounds = _index.bounds(key);
+  if (old_bounds != nullptr) {
+    _changes.push_back(*old_bounds);
+  }
+  _changes.push_back(bounds);
+  _segments[key] = {a, b};
+  _index.insert(key, bounds);
+}
+
+void Occluders::remove(uint64_t key) {
+  const Rect *bounds = _index.bounds(key);
+  if (bounds != nullptr) {
+    _changes.push_back(*bounds);
+    _index.remove(key);
+    _segments.erase(key);
+  }
+}
+
+void Occluders::clear() {
+  _segments.clear();
+  _index.clear();
+  _changes.push_back(Rect::everything());
+}
+
+std::vector<Rect> Occluders::takeChanges() {
+  std::vector<Rect> changes;
+  changes.swap(_changes);
+  return changes;
+}
+
+bool Occluders::blocks(const Vector2f &a, const Vector2f &b) {
+  for (uint64_t key : _index.query(Rect::spanning(a, b))) {
+    const Segment &s = _segments.at(key);
+    float abx = b.x() - a.x(), aby = b.y() - a.y();
+    float sx = s.b.x() - s.a.x(), sy = s.b.y() - s.a.y();
+    float denom = cross(abx, aby, sx, sy);
+    if (denom == 0) {
+      continue;
+    }
+    float t = cross(s.a.x() - a.x(), s.a.y() - a.y(), sx, sy) / denom;
+    float u = cross(s.a.x() - a.x(), s.a.y() - a.y(), abx, aby) / denom;
+    if (t >= 0 && t <= 1 && u >= 0 && u <= 1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Visible Occluders::computeVisible(const Vector2f &origin, float range) {
+  Rect area = Rect::around(origin, range, range);
+  std::vector<Segment> segments;
+  for (uint64_t key : _index.query(area)) {
+    segments.push_back(_segments.at(key));
+  }
+  // The border of the range closes the polygon where nothing blocks the view
+  Vector2f corners[4] = {Vector2f(area.minX(), area.minY()),
+                         Vector2f(area.maxX(), area.minY()),
+                         Vector2f(area.maxX(), area.maxY()),
+                         Vector2f(area.minX(), area.maxY())};
+  for (size_t k = 0; k < 4; ++k) {
+    segments.push_back({corners[k], corners[(k + 1) % 4]});
+  }
+
+  // The polygon only changes direction at the endpoints of segments
+  std::vector<double> angles;
+  angles.reserve(segments.size() * 6);
+  for (const Segment &s : segments) {
+    for (const Vector2f *p : {&s.a, &s.b}) {
+      double angle = std::atan2(p->y() - origin.y(), p->x() - origin.x());
+      angles.push_back(angle - ANGLE_OFFSET);
+      angles.push_back(angle);
+      angles.push_back(angle + ANGLE_OFFSET);
+    }
+  }
+  std::sort(angles.begin(), angles.end());
+  angles.erase(std::unique(angles.begin(), angles.end()), angles.end());
+
+  std::vector<Vector2f> polygon;
+  polygon.reserve(angles.size());
+  for (double angle : angles) {
+    float dx = std::cos(angle);
+    float dy = std::sin(angle);
+    float closest = std::numeric_limits<float>::max();
+    for (const Segment &s : segments) {
+      float sx = s.b.x() - s.a.x();
+      float sy = s.b.y() - s.a.y();
+      float denom = cross(dx, dy, sx, sy);
+      if (denom == 0) {
+        // The ray is parallel to the segment
+        continue;
+      }
+      float ox = s.a.x() - origin.x();
+      float oy = s.a.y() - origin.y();
+      float t = cross(ox, oy, sx, sy) / denom;
+      float u = cross(ox, oy, dx, dy) / denom;
+      if (t >= 0 && u >= 0 && u <= 1 && t < closest) {
+        closest = t;
+      }
+    }
+    if (closest == std::numeric_limits<float>::max()) {
+      continue;
+    }
+    polygon.emplace_back(origin.x() + dx * closest, origin.y() + dy * closest);
+  }
+  return Visible(origin, std::move(polygon));
+}
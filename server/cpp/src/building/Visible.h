@@ -15,20 +15,91 @@
  */
 
 #pragma once
-#include <memory>
+
+#include <cstdint>
+#include <unordered_map>
 #include <vector>
 
+#include "geometry/Rect.h"
+#include "geometry/SpatialGrid.h"
+#include "geometry/Vector.h"
+
+/**
+ * @brief The area visible from a point, as a star shaped polygon around that
+ *        point.
+ */
 class Visible {
  public:
-  Visible();
-  void setVisible(bool visible);
+  Visible() {}
+  Visible(const Vector2f &origin, std::vector<Vector2f> polygon);
+
+  const Vector2f &origin() const;
+  const std::vector<Vector2f> &polygon() const;
+  const Rect &bounds() const;
 
-  void clearDependencies();
-  void reveals(std::shared_ptr<Visible> other);
+  bool contains(const Vector2f &p) const;
+
+  /**
+   * @return True if any part of the segment from a to b is visible. Segments
+   *         bounding the visible area, e.g. the walls of the room, count as
+   *         visible.
+   */
+  bool intersects(const Vector2f &a, const Vector2f &b) const;
+
+  /**
+   * @return True if any part of the inside of the rectangle is visible.
+   */
+  bool intersects(const Rect &rect) const;
 
  private:
-  bool is_visible;
+  Vector2f _origin;
+  std::vector<Vector2f> _polygon;
+  Rect _bounds;
+};
+
+/**
+ * @brief The segments blocking the line of sight, i.e. the walls and closed
+ *        doors of a building, in a spatial index.
+ */
+class Occluders {
+ public:
+  Occluders();
+
+  /**
+   * @brief Adds the segment or moves it if it already exists.
+   */
+  void set(uint64_t key, const Vector2f &a, const Vector2f &b);
+  void remove(uint64_t key);
+  void clear();
+
+  /**
+   * @brief Computes the area visible from origin up to range in every
+   *        direction. A ray is cast towards every segment endpoint in range,
+   *        and slightly past both sides of it, in the order of their angle.
+   *        The closest hits form the polygon.
+   */
+  Visible computeVisible(const Vector2f &origin, float range);
+
+  /**
+   * @return True if a segment crosses the line of sight from a to b.
+   */
+  bool blocks(const Vector2f &a, const Vector2f &b);
+
+  /**
+   * @return The areas in which segments were added, moved or removed since
+   *         the last call. Only visible areas intersecting these can have
+   *         changed.
+   */
+  std::vector<Rect> takeChanges();
+
+ private:
+  struct Segment {
+    Vector2f a, b;
+  };
+
+  static constexpr float INDEX_CELL_SIZE = 8;
 
-  std::vector<std::shared_ptr<Visible>> reveals();
-  std::vector<std::shared_ptr<Visible>> revealedBy();
+  std::unordered_map<uint64_t, Segment> _segments;
+  SpatialGrid _index;
+  std::vector<Rect> _changes;
 };
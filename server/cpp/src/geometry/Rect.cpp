@@ -0,0 +1,54 @@
+#include "Rect.h"
+
+#include <algorithm>
+#include <limits>
+
+Rect::Rect() : _min_x(0), _min_y(0), _max_x(0), _max_y(0) {}
+
+Rect::Rect(float min_x, float min_y, float max_x, float max_y)
+    : _min_x(min_x), _min_y(min_y), _max_x(max_x), _max_y(max_y) {}
+
+Rect Rect::everything() {
+  float inf = std::numeric_limits<float>::infinity();
+  return Rect(-inf, -inf, inf, inf);
+}
+
+Rect Rect::spanning(const Vector2f &a, const Vector2f &b) {
+  return Rect(std::min(a.x(), b.x()), std::min(a.y(), b.y()),
+              std::max(a.x(), b.x()), std::max(a.y(), b.y()));
+}
+
+Rect Rect::around(const Vector2f &center, float half_width,
+                  float half_height) {
+  return Rect(center.x() - half_width, center.y() - half_height,
+              center.x() + half_width, center.y() + half_height);
+}
+
+bool Rect::intersects(const Rect &other) const {
+  return _min_x <= other._max_x && other._min_x <= _max_x &&
+         _min_y <= other._max_y && other._min_y <= _max_y;
+}
+
+bool Rect::contains(float x, float y) const {
+  return x >= _min_x && x <= _max_x && y >= _min_y && y <= _max_y;
+}
+
+bool Rect::contains(const Rect &other) const {
+  return other._min_x >= _min_x && other._max_x <= _max_x &&
+         other._min_y >= _min_y && other._max_y <= _max_y;
+}
+
+Rect Rect::expanded(float margin) const {
+  return Rect(_min_x - margin, _min_y - margin, _max_x + margin,
+              _max_y + margin);
+}
+
+Rect Rect::united(const Rect &other) const {
+  return Rect(std::min(_min_x, other._min_x), std::min(_min_y, other._min_y),
+              std::max(_max_x, other._max_x), std::max(_max_y, other._max_y));
+}
+
+float Rect::minX() const { return _min_x; }
+float Rect::minY() const { return _min_y; }
+float Rect::maxX() const { return _max_x; }
+float Rect::maxY() const { return _max_y; }
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Vector.h"
+
+/**
+ * @brief An axis aligned rectangle.
+ */
+class Rect {
+ public:
+  Rect();
+  Rect(float min_x, float min_y, float max_x, float max_y);
+
+  /**
+   * @return A rectangle containing the whole plane.
+   */
+  static Rect everything();
+
+  /**
+   * @return The smallest rectangle containing both points.
+   */
+  static Rect spanning(const Vector2f &a, const Vector2f &b);
+
+  /**
+   * @return A rectangle with the given half extents centered on center.
+   */
+  static Rect around(const Vector2f &center, float half_width,
+                     float half_height);
+
+  bool intersects(const Rect &other) const;
+  bool contains(float x, float y) const;
+  bool contains(const Rect &other) const;
+
+  Rect expanded(float margin) const;
+  Rect united(const Rect &other) const;
+
+  float minX() const;
+  float minY() const;
+  float maxX() const;
+  float maxY() const;
+
+ private:
+  float _min_x, _min_y, _max_x, _max_y;
+};
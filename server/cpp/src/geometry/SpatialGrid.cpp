@@ -0,0 +1,160 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "SpatialGrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+int32_t toCell(float v, float cell_size) {
+  // Clamp to keep infinite or huge coordinates representable
+  float c = std::floor(v / cell_size);
+  c = std::max(c, float(std::numeric_limits<int32_t>::min() / 2));
+  c = std::min(c, float(std::numeric_limits<int32_t>::max() / 2));
+  return int32_t(c);
+}
+
+void eraseValue(std::vector<uint64_t> *values, uint64_t value) {
+  auto it = std::find(values->begin(), values->end(), value);
+  if (it != values->end()) {
+    *it = values->back();
+    values->pop_back();
+  }
+}
+}  // namespace
+
+SpatialGrid::SpatialGrid(float cell_size)
+    : _cell_size(cell_size), _query_stamp(0) {}
+
+uint64_t SpatialGrid::CellRange::size() const {
+  return uint64_t(max_x - min_x + 1) * uint64_t(max_y - min_y + 1);
+}
+
+SpatialGrid::CellRange SpatialGrid::cellRange(const Rect &bounds) const {
+  return {toCell(bounds.minX(), _cell_size), toCell(bounds.minY(), _cell_size),
+          toCell(bounds.maxX(), _cell_size), toCell(bounds.maxY(), _cell_size)};
+}
+
+uint64_t SpatialGrid::cellKey(int32_t x, int32_t y) {
+  return (uint64_t(uint32_t(x)) << 32) | uint32_t(y);
+}
+
+void SpatialGrid::insert(uint64_t key, const Rect &bounds) {
+  auto it = _entries.find(key);
+  if (it != _entries.end()) {
+    unlink(key, it->second);
+    it->second.bounds = bounds;
+    link(key, &it->second);
+    return;
+  }
+  Entry &entry = _entries[key];
+  entry.bounds = bounds;
+  entry.query_stamp = 0;
+  link(key, &entry);
+}
+
+void SpatialGrid::remove(uint64_t key) {
+  auto it = _entries.find(key);
+  if (it != _entries.end()) {
+    unlink(key, it->second);
+    _entries.erase(it);
+  }
+}
+
+void SpatialGrid::clear() {
+  _entries.clear();
+  _cells.clear();
+  _large.clear();
+}
+
+void SpatialGrid::link(uint64_t key, Entry *entry) {
+  CellRange range = cellRange(entry->bounds);
+  entry->is_large = range.size() > MAX_CELLS_PER_ELEMENT;
+  if (entry->is_large) {
+    _large.push_back(key);
+    return;
+  }
+  for (int32_t x = range.min_x; x <= range.max_x; ++x) {
+    for (int32_t y = range.min_y; y <= range.max_y; ++y) {
+      _cells[cellKey(x, y)].push_back(key);
+    }
+  }
+}
+
+void SpatialGrid::unlink(uint64_t key, const Entry &entry) {
+  if (entry.is_large) {
+    eraseValue(&_large, key);
+    return;
+  }
+  CellRange range = cellRange(entry.bounds);
+  for (int32_t x = range.min_x; x <= range.max_x; ++x) {
+    for (int32_t y = range.min_y; y <= range.max_y; ++y) {
+      auto cell_it = _cells.find(cellKey(x, y));
+      if (cell_it != _cells.end()) {
+        eraseValue(&cell_it->second, key);
+        if (cell_it->second.empty()) {
+          _cells.erase(cell_it);
+        }
+      }
+    }
+  }
+}
+
+std::vector<uint64_t> SpatialGrid::query(const Rect &area) {
+  std::vector<uint64_t> result;
+  CellRange range = cellRange(area);
+  if (range.size() > _cells.size()) {
+    // Looking at every element is cheaper than looking at every cell
+    for (const auto &entry : _entries) {
+      if (entry.second.bounds.intersects(area)) {
+        result.push_back(entry.first);
+      }
+    }
+    return result;
+  }
+
+  _query_stamp++;
+  auto report = [&](uint64_t key) {
+    Entry &entry = _entries.at(key);
+    if (entry.query_stamp != _query_stamp && entry.bounds.intersects(area)) {
+      entry.query_stamp = _query_stamp;
+      result.push_back(key);
+    }
+  };
+  for (int32_t x = range.min_x; x <= range.max_x; ++x) {
+    for (int32_t y = range.min_y; y <= range.max_y; ++y) {
+      auto cell_it = _cells.find(cellKey(x, y));
+      if (cell_it != _cells.end()) {
+        for (uint64_t key : cell_it->second) {
+          report(key);
+        }
+      }
+    }
+  }
+  for (uint64_t key : _large) {
+    report(key);
+  }
+  return result;
+}
+
+const Rect *SpatialGrid::bounds(uint64_t key) const {
+  auto it = _entries.find(key);
+  if (it == _entries.end()) {
+    return nullptr;
+  }
+  return &it->second.bounds;
+}
@@ -0,0 +1,84 @@
+/**
+ * Copyright 2020 Florian Kramer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "Rect.h"
+
+/**
+ * @brief A uniform grid over the bounding rectangles of map elements, used to
+ *        find the elements within an area without looking at all of them.
+ *        Elements are identified by a key chosen by the user of the grid.
+ */
+class SpatialGrid {
+ public:
+  /**
+   * @param cell_size The edge length of a grid cell in world units.
+   */
+  explicit SpatialGrid(float cell_size);
+
+  /**
+   * @brief Adds the element or updates its bounds if it is already part of
+   *        the grid.
+   */
+  void insert(uint64_t key, const Rect &bounds);
+  void remove(uint64_t key);
+  void clear();
+
+  /**
+   * @return The keys of all elements whose bounds intersect area, each key
+   *         exactly once.
+   */
+  std::vector<uint64_t> query(const Rect &area);
+
+  /**
+   * @return The bounds of the element or nullptr if it is not in the grid.
+   */
+  const Rect *bounds(uint64_t key) const;
+
+ private:
+  struct Entry {
+    Rect bounds;
+    // The id of the last query that reported this entry
+    uint64_t query_stamp;
+    bool is_large;
+  };
+
+  struct CellRange {
+    int32_t min_x, min_y, max_x, max_y;
+    uint64_t size() const;
+  };
+
+  CellRange cellRange(const Rect &bounds) const;
+  static uint64_t cellKey(int32_t x, int32_t y);
+
+  void link(uint64_t key, Entry *entry);
+  void unlink(uint64_t key, const Entry &entry);
+
+  // Elements covering more cells than this are kept in a separate list that
+  // is checked by every query.
+  static const uint64_t MAX_CELLS_PER_ELEMENT = 64;
+
+  float _cell_size;
+  uint64_t _query_stamp;
+
+  std::unordered_map<uint64_t, Entry> _entries;
+  std::unordered_map<uint64_t, std::vector<uint64_t>> _cells;
+  std::vector<uint64_t> _large;
+};
@@ -1,5 +1,6 @@
 #include "Vector.h"
 
+#include <algorithm>
 #include <cmath>
 
 template <typename T>
@@ -78,3 +79,16 @@ const T &Vector2<T>::y() const {
 
 template class Vector2<float>;
 template class Vector2<double>;
+
+float distanceToSegment(const Vector2f &p, const Vector2f &a,
+                        const Vector2f &b) {
+  float dx = b.x() - a.x();
+  float dy = b.y() - a.y();
+  float length_sq = dx * dx + dy * dy;
+  float t = 0;
+  if (length_sq > 0) {
+    t = ((p.x() - a.x()) * dx + (p.y() - a.y()) * dy) / length_sq;
+    t = std::max(0.0f, std::min(1.0f, t));
+  }
+  return std::hypot(a.x() + t * dx - p.x(), a.y() + t * dy - p.y());
+}
@@ -30,3 +30,9 @@ class Vector2 {
 
 using Vector2f = Vector2<float>;
 using Vector2d = Vector2<double>;
+
+/**
+ * @return The distance of p to the closest point of the segment from a to b.
+ */
+float distanceToSegment(const Vector2f &p, const Vector2f &a,
+                        const Vector2f &b);
@@ -18,20 +18,38 @@
 #include <getopt.h>
 #endif
 
+#include <algorithm>
+#include <cstdlib>
 #include <functional>
 #include <memory>
+#include <thread>
 
 #include "Authenticator.h"
 #include "Database.h"
 #include "HttpServer.h"
 #include "Logger.h"
-#include "Simulation.h"
+#include "TableManager.h"
 #include "WebSocketServer.h"
 #include "Wiki.h"
 
 struct Settings {
   int do_keycheck = true;
   std::string base_dir = ".";
+  // The rate in Hz at which batched updates are sent to the clients
+  int tick_rate = 30;
+  // The directory in which the tables are saved, empty to not save them
+  std::string state_dir = "./tables";
+  // The number of tables that may be open at once, each runs its own threads
+  int max_tables = 64;
+  // The number of threads running the websockets, mostly busy with tls
+  int io_threads = std::max(1u, std::thread::hardware_concurrency());
+  // The zlib level of the messages sent to clients that support
+  // permessage-deflate, 0 to not compress them
+  int compression_level = 6;
+  // Compress every client's messages with its own context, see
+  // WebSocketServer::DeflateSettings
+  int context_takeover = false;
+  int compression_min_bytes = 256;
 };
 
 Settings parseSettings(int argc, char **argv) {
@@ -40,11 +58,19 @@ Settings parseSettings(int argc, char **argv) {
   struct option long_options[] = {
       {"no-key", no_argument, &s.do_keycheck, false},
       {"data-dir", required_argument, 0, 'd'},
+      {"tick-rate", required_argument, 0, 't'},
+      {"state-dir", required_argument, 0, 's'},
+      {"max-tables", required_argument, 0, 'n'},
+      {"io-threads", required_argument, 0, 'i'},
+      {"compression-level", required_argument, 0, 'c'},
+      {"context-takeover", no_argument, &s.context_takeover, true},
+      {"compression-min-bytes", required_argument, 0, 'm'},
       {0, 0, 0, 0}};
   int option_index = 0;
   bool failed = false;
   while (true) {
-    int c = getopt_long(argc, argv, "d:", long_options, &option_index);
+    int c = getopt_long(argc, argv, "d:t:s:n:i:c:m:",
+                        long_options, &option_index);
     if (c < 0) {
       break;
     }
@@ -54,6 +80,50 @@ Settings parseSettings(int argc, char **argv) {
         break;
       case 'd':
         s.base_dir = optarg;
+        break;
+      case 't':
+        s.tick_rate = std::atoi(optarg);
+        if (s.tick_rate <= 0 || s.tick_rate > 1000) {
+          LOG_ERROR << "The tick rate has to be between 1 and 1000 Hz."
+                    << LOG_END;
+          failed = true;
+        }
+        break;
+      case 's':
+        s.state_dir = optarg;
+        break;
+      case 'n':
+        s.max_tables = std::atoi(optarg);
+        if (s.max_tables <= 0) {
+          LOG_ERROR << "The maximum number of tables has to be positive."
+                    << LOG_END;
+          failed = true;
+        }
+        break;
+      case 'i':
+        s.io_threads = std::atoi(optarg);
+        if (s.io_threads <= 0) {
+          LOG_ERROR << "The number of io threads has to be positive."
+                    << LOG_END;
+          failed = true;
+        }
+        break;
+      case 'c':
+        s.compression_level = std::atoi(optarg);
+        if (s.compression_level < 0 || s.compression_level > 9) {
+          LOG_ERROR << "The compression level has to be between 0 and 9."
+                    << LOG_END;
+          failed = true;
+        }
+        break;
+      case 'm':
+        s.compression_min_bytes = std::atoi(optarg);
+        if (s.compression_min_bytes < 0) {
+          LOG_ERROR << "The minimum size of compressed messages can not be "
+                    << "negative." << LOG_END;
+          failed = true;
+        }
+        break;
       case '?':
         failed = true;
         break;
@@ -80,12 +150,23 @@ int main(int argc, char **argv) {
 
   Database db("./database.sqlite3");
   std::shared_ptr<Wiki> wiki = std::make_shared<Wiki>(&db);
-  Simulation sim;
-  WebSocketServer wss(
-      authenticator,
-      std::bind(&Simulation::onMessage, &sim, std::placeholders::_1),
-      std::bind(&Simulation::onNewClient, &sim), settings.base_dir);
-  sim.setWebSocketServer(&wss);
+  TableManager tables(settings.tick_rate, settings.state_dir,
+                      settings.max_tables);
+  WebSocketServer::DeflateSettings deflate_settings;
+  deflate_settings.level = settings.compression_level;
+  deflate_settings.context_takeover = settings.context_takeover;
+  deflate_settings.min_bytes = settings.compression_min_bytes;
+  WebSocketServer wss(authenticator,
+                      std::bind(&TableManager::onMessage, &tables,
+                                std::placeholders::_1, std::placeholders::_2,
+                                std::placeholders::_3),
+                      std::bind(&TableManager::onNewClient, &tables,
+                                std::placeholders::_1),
+                      std::bind(&TableManager::onClientLeft, &tables,
+                                std::placeholders::_1),
+                      settings.base_dir, settings.io_threads,
+                      deflate_settings);
+  tables.setWebSocketServer(&wss);
   if (!settings.do_keycheck) {
     wss.disableKeyCheck();
   }